@@ -1,5 +1,5 @@
 #include "uzenet-fatfs-server.h"
-#include "uzenet-tunnel.h"
+#include "../uzenet-tunnel/uzenet-tunnel.h"
 
 #include <stdarg.h>
 #include <stdio.h>
@@ -27,17 +27,17 @@
 
 #define FATFS_SOCKET_PATH "/run/uzenet/fatfs.sock"
 
-// For LOGIN meta frames (same as used in uzenet-lichess / virtual-fujinet)
-typedef struct{
-	uint16_t user_id;
-	uint16_t reserved;
-} TunnelLoginMeta;
+#define TS_OUT_SIZE 4096	// reply bytes gathered into one DATA frame
 
-// Simple byte-stream adapter over TunnelFrame DATA frames
+// Simple byte-stream adapter over tunnel DATA frames; reads are served
+// straight out of the codec's receive buffer, and a reply's pieces are
+// gathered and sent as one frame before the next read
 typedef struct{
-	int      fd;
-	uint8_t  buf[1024];
-	size_t   len;
+	UtunConn       conn;
+	const uint8_t *p;	// unread part of the current DATA frame
+	size_t         len;
+	uint8_t        out[TS_OUT_SIZE];
+	size_t         out_len;
 } TunnelStream;
 
 // -----------------------------------------------------------------------------
@@ -210,27 +210,29 @@ int quota_check(const char *user, uint64_t new_bytes, int check_files){
 // Tunnel byte-stream helpers
 // -----------------------------------------------------------------------------
 
-// Fill TunnelStream.buf with one DATA frame's payload
+static int ts_flush(TunnelStream *ts){
+	if(!ts->out_len) return 0;
+	int r = utun_send(&ts->conn, UTUN_TYPE_DATA, ts->out, ts->out_len);
+	ts->out_len = 0;
+	return r;
+}
+
+// Point the stream at the next DATA frame's payload; only called once the
+// previous one is used up, which is what makes it safe to let go of. The
+// client waits for our reply before sending more, so flush it first.
 static int ts_fill(TunnelStream *ts){
-	TunnelFrame fr;
-	int r = ReadTunnelFramed(ts->fd, &fr);
+	UtunFrameRef fr;
+	if(ts_flush(ts) < 0) return -1;
+	int r = utun_next_frame(&ts->conn, &fr);
 	if(r <= 0){
 		return r; // 0 = EOF, <0 = error
 	}
-	if(fr.type == TUNNEL_TYPE_LOGIN){
-		// Unexpected extra LOGIN; just ignore.
+	if(fr.type != UTUN_TYPE_DATA || fr.length == 0){
+		// Extra LOGIN, unknown or empty; ignore.
 		return 1;
 	}
-	if(fr.type != TUNNEL_TYPE_DATA || fr.length == 0){
-		// Unknown / empty; ignore.
-		return 1;
-	}
-	if(ts->len + fr.length > sizeof(ts->buf)){
-		// Overflow: treat as error.
-		return -1;
-	}
-	memcpy(ts->buf + ts->len, fr.data, fr.length);
-	ts->len += fr.length;
+	ts->p   = fr.data;
+	ts->len = fr.length;
 	return 1;
 }
 
@@ -249,33 +251,24 @@ static int ts_read_exact(TunnelStream *ts, void *out, size_t need){
 		}
 		size_t take = need - got;
 		if(take > ts->len) take = ts->len;
-		memcpy(dst + got, ts->buf, take);
-		memmove(ts->buf, ts->buf + take, ts->len - take);
+		memcpy(dst + got, ts->p, take);
+		ts->p   += take;
 		ts->len -= take;
 		got += take;
 	}
 	return 0;
 }
 
-// Write arbitrary bytes as one or more DATA frames
+// Queue arbitrary bytes for the next DATA frame; more than fits goes out
+// as it is, cut to the room's limit
 static int ts_write(TunnelStream *ts, const void *buf, size_t len){
-	const uint8_t *p = (const uint8_t*)buf;
-	while(len > 0){
-		size_t chunk = len;
-		if(chunk > TUNNEL_MAX_PAYLOAD) chunk = TUNNEL_MAX_PAYLOAD;
-
-		TunnelFrame fr;
-		fr.type   = TUNNEL_TYPE_DATA;
-		fr.flags  = 0;
-		fr.length = (uint16_t)chunk;
-		memcpy(fr.data, p, chunk);
-
-		if(WriteTunnelFramed(ts->fd, &fr) < 0){
-			return -1;
-		}
-		p   += chunk;
-		len -= chunk;
+	if(ts->out_len + len > sizeof(ts->out)){
+		if(ts_flush(ts) < 0) return -1;
+		if(len > sizeof(ts->out))
+			return utun_send(&ts->conn, UTUN_TYPE_DATA, buf, len);
 	}
+	memcpy(ts->out + ts->out_len, buf, len);
+	ts->out_len += len;
 	return 0;
 }
 
@@ -299,7 +292,7 @@ static void *handle_client(void *arg){
 	ThreadArg *ta = (ThreadArg*)arg;
 	ClientContext ctx;
 	TunnelStream ts;
-	TunnelFrame  first_fr;
+	UtunFrameRef first_fr;
 
 	memset(&ctx, 0, sizeof(ctx));
 	memset(&ts,  0, sizeof(ts));
@@ -313,22 +306,24 @@ static void *handle_client(void *arg){
 	strncpy(ctx.user_id,    "guest",   PASSWORD_LEN);
 	ctx.is_guest = 1;
 
-	ts.fd  = ctx.fd;
+	utun_conn_init(&ts.conn, ctx.fd, 0);
 	ts.len = 0;
 
 	free(ta);
 
 	// Expect an initial LOGIN frame from uzenet-room
-	int r = ReadTunnelFramed(ctx.fd, &first_fr);
+	int r = utun_next_frame(&ts.conn, &first_fr);
 	if(r <= 0){
 		close(ctx.fd);
 		return NULL;
 	}
 
-	if(first_fr.type == TUNNEL_TYPE_LOGIN &&
-	   first_fr.length >= sizeof(TunnelLoginMeta)){
-		const TunnelLoginMeta *meta = (const TunnelLoginMeta*)first_fr.data;
-		uint16_t uid = meta->user_id;
+	if(first_fr.type == UTUN_TYPE_LOGIN){
+		int uid = utun_login(&ts.conn, &first_fr);
+		if(uid < 0){
+			close(ctx.fd);
+			return NULL;
+		}
 
 		if(uid != 0xFFFF){
 			snprintf(ctx.user_id, PASSWORD_LEN, "%u", (unsigned)uid);
@@ -338,12 +333,9 @@ static void *handle_client(void *arg){
 		// You can later map uid -> per-user directory here.
 		log_msg("[room] LOGIN user_id=%u (guest=%d)",
 		        (unsigned)uid, ctx.is_guest ? 1 : 0);
-	}else if(first_fr.type == TUNNEL_TYPE_DATA && first_fr.length > 0){
+	}else if(first_fr.type == UTUN_TYPE_DATA && first_fr.length > 0){
 		// No LOGIN (older room?), treat payload as start of byte stream.
-		if(first_fr.length > sizeof(ts.buf)){
-			first_fr.length = sizeof(ts.buf);
-		}
-		memcpy(ts.buf, first_fr.data, first_fr.length);
+		ts.p   = first_fr.data;
 		ts.len = first_fr.length;
 	}else{
 		// Unknown; just continue with empty stream buffer.
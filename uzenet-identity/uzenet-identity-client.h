@@ -11,6 +11,13 @@ struct uzenet_identity {
 	char flags;				// 'R', 'G', 'A', etc.
 };
 
+// Socket protocol on /run/uzenet/identity.sock: the client sends the 6 byte
+// password token, the server answers with the 16 bit user id, high byte
+// first. Connections stay open and requests may be pipelined; replies come
+// back in request order.
+#define IDENTITY_UID_GUEST		0xFFFF	// "000000"
+#define IDENTITY_UID_UNKNOWN		0xFFFE	// no such user
+
 // Called on an accepted fd, returns 1 on success
 int uzenet_identity_check_fd(int fd, struct uzenet_identity *out);
 void uzenet_identity_init(void);
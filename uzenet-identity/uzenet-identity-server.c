@@ -19,6 +19,12 @@
 #define SOCK_PATH "/run/uzenet/identity.sock"
 #define DB_PATH   "/var/lib/uzenet/users.csv"
 #define MAX_LINE  512
+#define MAX_CONNS 64	// room keeps a couple open; one-shot tools come and go
+
+struct conn {
+	char pw[7];
+	int got;
+};
 
 struct user {
 	uint16_t user_id;
@@ -94,6 +100,35 @@ static void load_users(void){
 	users_by_id = tmp_by_id;
 }
 
+static uint16_t lookup(const char *pw){
+	if(!strcmp(pw, "000000")) return IDENTITY_UID_GUEST;
+	struct user *u = NULL;
+	HASH_FIND_STR(users_by_name, pw, u);
+	return u ? u->user_id : IDENTITY_UID_UNKNOWN;
+}
+
+// Answer every complete 6 byte request buffered on this connection.
+// Returns -1 once the peer hung up.
+static int serve_conn(int fd, struct conn *c){
+	uint8_t buf[6 * 64];
+	int r = read(fd, buf, sizeof(buf));
+	if(r <= 0) return (r < 0 && errno == EINTR) ? 0 : -1;
+
+	uint8_t reply[2 * (64 + 1)];
+	int n = 0;
+	for(int i = 0; i < r; ++i){
+		c->pw[c->got++] = buf[i];
+		if(c->got < 6) continue;
+		c->pw[6] = 0;
+		c->got = 0;
+		uint16_t uid = lookup(c->pw);
+		reply[n++] = uid >> 8;
+		reply[n++] = uid & 0xFF;
+	}
+	if(n && write(fd, reply, n) != n) return -1;
+	return 0;
+}
+
 void uzenet_identity_init(void){
 	struct stat st;
 	if(stat(DB_PATH, &st) == 0)
@@ -115,46 +150,42 @@ void uzenet_identity_init(void){
 		exit(1);
 	}
 	chmod(SOCK_PATH, 0666);
-	listen(sock, 16);
+	listen(sock, 64);
 
 	syslog(LOG_INFO, "uzenet-identity: listening on %s", SOCK_PATH);
 
-	while(1){
-		struct pollfd pfd = {.fd = sock, .events = POLLIN};
-		if(poll(&pfd, 1, 1000) > 0){
-			int client = accept(sock, NULL, NULL);
-			if(client < 0) continue;
+	// pfd[0] is the listener; the rest are persistent client connections
+	struct pollfd pfd[1 + MAX_CONNS];
+	struct conn conns[1 + MAX_CONNS];
+	int nfds = 1;
+	pfd[0].fd = sock;
+	pfd[0].events = POLLIN;
 
-			char pw[7] = {0};
-			int total = 0;
-			int timeout_ms = 3000;
-			struct pollfd cpf = {.fd = client, .events = POLLIN};
-			while(total < 6 && poll(&cpf, 1, timeout_ms) > 0){
-				int r = read(client, pw + total, 6 - total);
-				if(r <= 0) break;
-				total += r;
-			}
-
-			if(total < 6){
-				close(client);
-				continue;
+	while(1){
+		if(poll(pfd, nfds, 1000) <= 0) continue;
+
+		for(int i = nfds - 1; i >= 1; --i){
+			if(!pfd[i].revents) continue;
+			if(serve_conn(pfd[i].fd, &conns[i]) < 0){
+				close(pfd[i].fd);
+				pfd[i] = pfd[--nfds];
+				conns[i] = conns[nfds];
 			}
+		}
 
-			struct user *u = NULL;
-			if(!strcmp(pw, "000000")){
-				uint8_t reply[2] = {0xFF, 0xFF};
-				write(client, reply, 2);
-				close(client);
-				continue;
-			}
-			HASH_FIND_STR(users_by_name, pw, u);
-			if(!u){
+		if(pfd[0].revents & POLLIN){
+			int client = accept(sock, NULL, NULL);
+			if(client < 0) continue;
+			if(nfds == 1 + MAX_CONNS){
+				syslog(LOG_WARNING, "identity: too many connections");
 				close(client);
 				continue;
 			}
-			uint8_t reply[2] = { u->user_id & 0xFF, u->user_id >> 8 };
-			write(client, reply, 2);
-			close(client);
+			pfd[nfds].fd = client;
+			pfd[nfds].events = POLLIN;
+			pfd[nfds].revents = 0;
+			conns[nfds].got = 0;
+			nfds++;
 		}
 	}
 }
@@ -10,6 +10,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/eventfd.h>
 #include <poll.h>
 #include <fcntl.h>
 #include <syslog.h>
@@ -17,44 +18,24 @@
 #include <curl/curl.h>
 
 #include "uzenet-lichess.h"
+#include "../uzenet-tunnel/uzenet-tunnel.h"
 
 /* Paths / config */
 
 #define LICHESS_SOCK_PATH	"/run/uzenet/lichess.sock"
 #define LICHESS_USERS_DIR	"/var/lib/uzenet/lichess-users"
 
-/* Tunnel framing (UzeNet-room <-> service)
- *
- * 4-byte header:
- *   [0] = type
- *   [1] = flags
- *   [2] = length hi
- *   [3] = length lo
- * Followed by "length" bytes of payload.
- */
+/* Tunnel framing (UzeNet-room <-> service) is uzenet-tunnel's codec; one
+ * LCH message per DATA frame, and we ask the room for frames no larger than
+ * an outgoing queue slot. */
 
-#define TUNNEL_TYPE_LOGIN	0x01
-#define TUNNEL_TYPE_DATA	0x02
-
-#define TUNNEL_MAX_PAYLOAD	64
-
-typedef struct{
-	u8	type;
-	u8	flags;
-	u16	length;
-	u8	data[TUNNEL_MAX_PAYLOAD];
-} TunnelFrame;
-
-typedef struct{
-	u16	user_id;
-	u16	reserved;
-} TunnelLoginMeta;
+#define LCH_MAX_PAYLOAD		64
 
 /* Client state */
 
 #define LCH_MAX_CLIENTS			64
 #define LCH_OUTQ_SLOTS			16	/* power-of-two */
-#define LCH_OUTQ_SLOT_BYTES		64	/* must be <= TUNNEL_MAX_PAYLOAD */
+#define LCH_OUTQ_SLOT_BYTES		64	/* must be <= LCH_MAX_PAYLOAD */
 
 #define LCH_MAX_MOVES			512	/* half-moves (plies) */
 #define LCH_MAX_CHAT_LINES		256
@@ -83,6 +64,7 @@ typedef struct{
 typedef struct{
 	int				fd;
 	client_state_t	state;
+	UtunConn		tun;			/* frame codec on fd */
 
 	u16				user_id;
 	LichessPrefs	prefs;
@@ -121,6 +103,7 @@ typedef struct{
 static client_t g_clients[LCH_MAX_CLIENTS];
 
 static int g_listen_fd = -1;
+static int g_wake_fd = -1;	/* rung when a message is queued, so poll() sees it */
 static int g_running = 1;
 
 /* Helpers for JSON/NDJSON parsing from game stream */
@@ -153,35 +136,6 @@ static void on_sigint(int sig){
 	g_running = 0;
 }
 
-static int read_full(int fd, void *buf, size_t len){
-	u8 *p = (u8*)buf;
-	while(len){
-		ssize_t r = read(fd, p, len);
-		if(r == 0) return 0;
-		if(r < 0){
-			if(errno == EINTR) continue;
-			return -1;
-		}
-		p   += r;
-		len -= r;
-	}
-	return 1;
-}
-
-static int write_full(int fd, const void *buf, size_t len){
-	const u8 *p = (const u8*)buf;
-	while(len){
-		ssize_t r = write(fd, p, len);
-		if(r < 0){
-			if(errno == EINTR) continue;
-			return -1;
-		}
-		p   += r;
-		len -= r;
-	}
-	return 0;
-}
-
 /* --------------------------------------------------------------------- */
 /* libcurl buffer helper                                                 */
 /* --------------------------------------------------------------------- */
@@ -300,44 +254,6 @@ static int lch_extract_challenge_id(const char *json,
 	return 0;
 }
 
-/* --------------------------------------------------------------------- */
-/* Tunnel framing I/O                                                    */
-/* --------------------------------------------------------------------- */
-
-static int ReadTunnelFramed(int fd, TunnelFrame *fr){
-	u8 hdr[4];
-	int r = read_full(fd, hdr, sizeof(hdr));
-	if(r <= 0) return r;
-
-	fr->type   = hdr[0];
-	fr->flags  = hdr[1];
-	fr->length = (u16)((hdr[2] << 8) | hdr[3]);
-	if(fr->length > TUNNEL_MAX_PAYLOAD) return -1;
-
-	if(fr->length){
-		r = read_full(fd, fr->data, fr->length);
-		if(r <= 0) return r;
-	}
-	return 1;
-}
-
-static int WriteTunnelFramed(int fd, const TunnelFrame *fr){
-	u8 hdr[4];
-	u16 len = fr->length;
-	if(len > TUNNEL_MAX_PAYLOAD) len = TUNNEL_MAX_PAYLOAD;
-
-	hdr[0] = fr->type;
-	hdr[1] = fr->flags;
-	hdr[2] = (u8)(len >> 8);
-	hdr[3] = (u8)(len & 0xff);
-
-	if(write_full(fd, hdr, sizeof(hdr)) < 0) return -1;
-	if(len){
-		if(write_full(fd, fr->data, len) < 0) return -1;
-	}
-	return 0;
-}
-
 /* --------------------------------------------------------------------- */
 /* Ring buffer helpers                                                   */
 /* --------------------------------------------------------------------- */
@@ -358,9 +274,24 @@ static int lch_enqueue_to_client(client_t *c, const void *msg, u8 len){
 	c->outq_len[c->outq_tail] = len;
 	c->outq_tail = next;
 	pthread_mutex_unlock(&c->outq_mutex);
+	if(g_wake_fd >= 0){
+		uint64_t one = 1;
+		ssize_t w = write(g_wake_fd, &one, sizeof(one));
+		(void)w;	/* only fails with the counter full, when poll() is awake anyway */
+	}
 	return 0;
 }
 
+/* length of the next queued message, 0 if there is none */
+static u8 lch_peek_client(client_t *c){
+	u8 len = 0;
+
+	pthread_mutex_lock(&c->outq_mutex);
+	if(c->outq_head != c->outq_tail) len = c->outq_len[c->outq_head];
+	pthread_mutex_unlock(&c->outq_mutex);
+	return len;
+}
+
 static int lch_dequeue_from_client(client_t *c, void *buf, u8 *len){
 	u8 idx;
 
@@ -805,6 +736,7 @@ static client_t *alloc_client(int fd){
 			memset(c, 0, sizeof(*c));
 			c->fd       = fd;
 			c->state    = CLST_ACTIVE;
+			utun_conn_init(&c->tun, fd, LCH_MAX_PAYLOAD);
 			c->user_id  = 0xffff;
 			c->my_side  = -1;
 			c->move_count = 0;
@@ -836,18 +768,7 @@ static void free_client(client_t *c){
 /* --------------------------------------------------------------------- */
 
 static int send_lch_msg(client_t *c, const void *msg, u8 len){
-	TunnelFrame fr;
-
-	if(len > TUNNEL_MAX_PAYLOAD) len = TUNNEL_MAX_PAYLOAD;
-	fr.type   = TUNNEL_TYPE_DATA;
-	fr.flags  = 0;
-	fr.length = len;
-	memcpy(fr.data, msg, len);
-
-	if(WriteTunnelFramed(c->fd, &fr) < 0){
-		return -1;
-	}
-	return 0;
+	return utun_send(&c->tun, UTUN_TYPE_DATA, msg, len);
 }
 
 /* --------------------------------------------------------------------- */
@@ -1353,12 +1274,11 @@ static void handle_client_frame(client_t *c, const u8 *buf, u8 len){
 /* LOGIN meta (tunnel)                                                   */
 /* --------------------------------------------------------------------- */
 
-static void handle_login_meta(client_t *c, const u8 *data, u16 len){
-	const TunnelLoginMeta *m;
+static void handle_login_meta(client_t *c, const UtunFrameRef *fr){
+	int uid = utun_login(&c->tun, fr);
 
-	if(len < sizeof(TunnelLoginMeta)) return;
-	m = (const TunnelLoginMeta*)data;
-	c->user_id = m->user_id;
+	if(uid < 0) return;
+	c->user_id = (u16)uid;
 
 	/* pre-load prefs so we have token ready for first NEW_GAME */
 	load_prefs_for_client(c);
@@ -1427,6 +1347,12 @@ int main(int argc, char **argv){
 		return 1;
 	}
 
+	g_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(g_wake_fd < 0){
+		syslog(LOG_ERR, "eventfd failed");
+		return 1;
+	}
+
 	for(i=0;i<LCH_MAX_CLIENTS;i++){
 		g_clients[i].state = CLST_UNUSED;
 	}
@@ -1434,7 +1360,8 @@ int main(int argc, char **argv){
 	syslog(LOG_INFO, "uzenet-lichess listening on %s", LICHESS_SOCK_PATH);
 
 	while(g_running){
-		struct pollfd pfds[1 + LCH_MAX_CLIENTS];
+		struct pollfd pfds[2 + LCH_MAX_CLIENTS];
+		client_t *polled[2 + LCH_MAX_CLIENTS];	/* client behind each pfds slot */
 		int nfds = 0;
 
 		/* listen fd */
@@ -1443,12 +1370,23 @@ int main(int argc, char **argv){
 		pfds[nfds].revents = 0;
 		nfds++;
 
-		/* client fds */
+		/* queued messages */
+		pfds[nfds].fd = g_wake_fd;
+		pfds[nfds].events = POLLIN;
+		pfds[nfds].revents = 0;
+		nfds++;
+
+		/* client fds; writable only matters with a message that room's
+		   window takes, or poll() would return at once while it waits */
 		for(i=0;i<LCH_MAX_CLIENTS;i++){
-			if(g_clients[i].state == CLST_ACTIVE){
-				pfds[nfds].fd = g_clients[i].fd;
-				pfds[nfds].events = POLLIN | POLLOUT;
+			client_t *c = &g_clients[i];
+			if(c->state == CLST_ACTIVE){
+				u8 next = lch_peek_client(c);
+				pfds[nfds].fd = c->fd;
+				pfds[nfds].events = POLLIN;
+				if(next && next <= utun_credit(&c->tun, 0)) pfds[nfds].events |= POLLOUT;
 				pfds[nfds].revents = 0;
+				polled[nfds] = c;
 				nfds++;
 			}
 		}
@@ -1472,52 +1410,57 @@ int main(int argc, char **argv){
 			}
 		}
 
-		/* handle clients */
-		{
-			int idx = 1;
-			for(i=0;i<LCH_MAX_CLIENTS;i++){
-				client_t *c = &g_clients[i];
-				if(c->state != CLST_ACTIVE) continue;
+		if(pfds[1].revents & POLLIN){
+			uint64_t n;
+			ssize_t r = read(g_wake_fd, &n, sizeof(n));
+			(void)r;
+		}
 
+		/* handle clients polled above; one accepted just now waits a round */
+		{
+			int idx;
+			for(idx=2;idx<nfds;idx++){
+				client_t *c = polled[idx];
 				short re = pfds[idx].revents;
-				int fd   = pfds[idx].fd;
-				idx++;
 
 				if(re & (POLLHUP | POLLERR | POLLNVAL)){
 					free_client(c);
 					continue;
 				}
 
-				/* readable: tunnel frame */
+				/* readable: every tunnel frame that came in, handled in place */
 				if(re & POLLIN){
-					TunnelFrame fr;
-					int r2 = ReadTunnelFramed(fd, &fr);
-					if(r2 == 0){
-						/* EOF */
-						free_client(c);
-						continue;
-					}else if(r2 < 0){
-						/* error */
+					UtunFrameRef fr;
+					int r2;
+					do{
+						r2 = utun_next_frame(&c->tun, &fr);
+						if(r2 <= 0) break;
+
+						if(fr.type == UTUN_TYPE_LOGIN){
+							handle_login_meta(c, &fr);
+						}else if(fr.type == UTUN_TYPE_DATA){
+							if(fr.length > 0){
+								handle_client_frame(c, fr.data, (u8)fr.length);
+							}
+						}else{
+							/* unknown type, ignore for now */
+						}
+					}while(utun_conn_ready(&c->tun));
+					if(r2 == 0 || (r2 < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EMSGSIZE)){
+						/* EOF or error */
 						free_client(c);
 						continue;
 					}
-
-					if(fr.type == TUNNEL_TYPE_LOGIN){
-						handle_login_meta(c, fr.data, fr.length);
-					}else if(fr.type == TUNNEL_TYPE_DATA){
-						if(fr.length > 0){
-							handle_client_frame(c, fr.data, (u8)fr.length);
-						}
-					}else{
-						/* unknown type, ignore for now */
-					}
 				}
 
-				/* writable: flush queue */
+				/* writable: flush queue, as far as room's window goes. A
+				   client whose Uzebox is slow keeps its messages queued
+				   here until the WINDOW, read above, lets them through. */
 				if(re & POLLOUT){
 					u8 buf[LCH_OUTQ_SLOT_BYTES];
 					u8 len;
-					if(lch_dequeue_from_client(c, buf, &len) == 0){
+					if(lch_peek_client(c) <= utun_credit(&c->tun, 0) &&
+					   lch_dequeue_from_client(c, buf, &len) == 0){
 						if(send_lch_msg(c, buf, len) < 0){
 							free_client(c);
 							continue;
@@ -1529,6 +1472,7 @@ int main(int argc, char **argv){
 	}
 
 	close(g_listen_fd);
+	close(g_wake_fd);
 	unlink(LICHESS_SOCK_PATH);
 	lichess_shutdown();
 	syslog(LOG_INFO, "uzenet-lichess exiting");
@@ -1,16 +1,17 @@
-#include "metrics_client.h"
+#include "uzenet-metrics-client.h"
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
 
 static int metrics_fd = -1;
 
 int metrics_init(const char *socket_path){
 	struct sockaddr_un addr;
-	metrics_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	metrics_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
 	if(metrics_fd < 0) return -1;
 	memset(&addr, 0, sizeof(addr));
 	addr.sun_family = AF_UNIX;
@@ -30,7 +31,8 @@ static void metrics_send(const char *fmt, ...){
 	va_start(ap, fmt);
 	int n = vsnprintf(buf, sizeof(buf), fmt, ap);
 	va_end(ap);
-	if(n > 0) write(metrics_fd, buf, n);
+	// never stall the caller on a backed-up sidecar; drop the sample instead
+	if(n > 0) send(metrics_fd, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL);
 }
 
 void metrics_gauge(const char *name, double value){
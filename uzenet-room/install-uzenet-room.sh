@@ -5,10 +5,18 @@ echo "[*] Installing uzenet-room-server..."
 BIN=uzenet-room-server
 TARGET=/usr/local/bin/$BIN
 SERVICE=/etc/systemd/system/uzenet-room.service
+WORKERS=$(nproc)	# one room worker (shard) per core
 
 # Install binary
 install -m 755 $BIN "$TARGET"
 
+# Kernel TLS offload; the room runs as nobody and can't load the module itself
+KTLS=
+if modprobe tls 2>/dev/null; then
+	echo tls > /etc/modules-load.d/uzenet-room-tls.conf
+	KTLS=" --ktls"
+fi
+
 # Install systemd service
 cat <<EOF > "$SERVICE"
 [Unit]
@@ -16,7 +24,8 @@ Description=Uzenet Room Server
 After=network.target
 
 [Service]
-ExecStart=$TARGET
+ExecStart=$TARGET --workers $WORKERS$KTLS
+ExecReload=/bin/kill -HUP \$MAINPID
 Restart=always
 User=nobody
 Group=nogroup
@@ -28,10 +37,22 @@ EOF
 # Update Certificate
 ./update-cert.sh
 
+# TLS ticket keys, rotated daily so restarts can still resume sessions
+if [ ! -f /etc/uzenet/ticket.keys ]; then
+	./rotate-ticket-keys.sh
+fi
+install -m 755 rotate-ticket-keys.sh /usr/local/bin/rotate-uzenet-room-ticket-keys
+echo "0 4 * * * root /usr/local/bin/rotate-uzenet-room-ticket-keys >/dev/null" > /etc/cron.d/uzenet-room-ticket-keys
+
 # Enable + start
 systemctl daemon-reexec
 systemctl daemon-reload
 systemctl enable uzenet-room
-systemctl restart uzenet-room
+if systemctl is-active --quiet uzenet-room; then
+	# Hot restart: the running room hands its sessions to the new binary
+	systemctl kill --kill-who=main -s USR2 uzenet-room
+else
+	systemctl start uzenet-room
+fi
 
 echo "[+] uzenet-room-server installed and running."
@@ -12,6 +12,7 @@ rm -f "$SERVICE"
 
 # Remove binary
 rm -f "$BIN"
+rm -f /usr/local/bin/rotate-uzenet-room-ticket-keys /etc/cron.d/uzenet-room-ticket-keys
 
 # Reload systemd
 systemctl daemon-reexec
@@ -0,0 +1,29 @@
+#!/bin/bash
+# Rotate the TLS session ticket keys shared by uzenet-room restarts.
+# The new key goes first (used to issue tickets); older keys are kept so
+# bridges holding a recent ticket can still resume. Run daily from cron.
+
+KEY_FILE="/etc/uzenet/ticket.keys"
+KEEP=3			# current + 2 previous keys (room accepts up to 4)
+SERVER_RELOAD_CMD="systemctl reload uzenet-room"
+
+set -e
+umask 077
+
+NEW_KEY=$(openssl rand -hex 80)
+{
+	echo "$NEW_KEY"
+	if [ -f "$KEY_FILE" ]; then
+		grep -v '^#' "$KEY_FILE" | head -n $((KEEP - 1))
+	fi
+} > "$KEY_FILE.tmp"
+
+chown root:nogroup "$KEY_FILE.tmp"
+chmod 640 "$KEY_FILE.tmp"
+mv "$KEY_FILE.tmp" "$KEY_FILE"
+echo "[+] Rotated ticket keys in $KEY_FILE"
+
+if systemctl is-active --quiet uzenet-room; then
+	echo "[*] Reloading server..."
+	$SERVER_RELOAD_CMD
+fi
@@ -0,0 +1,124 @@
+#define _GNU_SOURCE
+#include "uzenet-room-server.h"
+
+#include <time.h>
+
+// -----------------------------------------------------------------------------
+// Room commands
+//
+// A byte below 0xF0 outside a tunnel frame starts a room command, addressed
+// to the room itself rather than a service. Commands have a fixed length per
+// id and the table below holds it with the handler; an id with no entry is
+// skipped one byte at a time, as before there were any.
+//
+// Client -> room:
+//   NULL     [0x00]			ignored; keeps NAT mappings open, not the session
+//   PING     [0x01][seq]		answered with PONG, for the client's own RTT
+//   GET_TIME [0x02]			answered with [0x02][unix time u32][ms u16]
+//   PONG     [0x03][seq][clock u32]	answer to the room's PING, client clock in ms
+// Room -> client:
+//   PING     [0x01][seq]		every ROOM_PING_INTERVAL_US
+//   GET_TIME [0x02][unix time u32][ms u16]
+//   PONG     [0x03][seq][clock u32]	room clock in ms
+//
+// The room only probes clients that sent a command first, so firmware that
+// predates them never sees a stray byte, and none that hibernate. PONG and
+// NULL don't count as traffic, so they hold off neither hibernation nor the
+// idle timeout. Each PONG gives one RTT sample, smoothed like TCP does
+// (RFC 6298), and a clock offset taken from samples no slower than the
+// smoothed RTT, since a queued probe skews it by half the queueing delay. The RTT sizes the client's token bucket (pace_burst() in
+// uzenet-room-server.c) and is what matchmaking seats players by.
+// -----------------------------------------------------------------------------
+
+#define ROOM_PING_TIMEOUT_US	2000000	// a PONG later than this is not a sample
+
+typedef struct{
+	uint8_t len;		// command byte included
+	int (*run)(client_t *c, const uint8_t *p);
+} room_cmd_t;
+
+static uint32_t room_clock_ms(void){
+	return room_now_us() / 1000;
+}
+
+static void put32(uint8_t *p, uint32_t v){
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static int reply(client_t *c, const uint8_t *msg, int len){
+	return room_client_reply(c, msg, len) < 0 ? -1 : 0;	// full: the client asks again
+}
+
+static int cmd_null(client_t *c, const uint8_t *p){
+	return 0;
+}
+
+static int cmd_ping(client_t *c, const uint8_t *p){
+	uint8_t msg[6] = { ROOM_CMD_PONG, p[1] };
+	put32(msg + 2, room_clock_ms());
+	c->speaks_cmds = 1;
+	return reply(c, msg, sizeof(msg));
+}
+
+static int cmd_get_time(client_t *c, const uint8_t *p){
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	uint16_t ms = ts.tv_nsec / 1000000;
+	uint8_t msg[7] = { ROOM_CMD_GET_TIME };
+	put32(msg + 1, ts.tv_sec);
+	msg[5] = ms >> 8;
+	msg[6] = ms;
+	c->speaks_cmds = 1;
+	return reply(c, msg, sizeof(msg));
+}
+
+static int cmd_pong(client_t *c, const uint8_t *p){
+	uint64_t now = room_now_us();
+	c->speaks_cmds = 1;
+	if(!c->ping_sent_us || p[1] != c->ping_seq) return 0;	// stale or unasked
+	uint32_t r = now - c->ping_sent_us;
+	if(r > ROOM_PING_TIMEOUT_US) return 0;
+	uint32_t clock = (uint32_t)p[2] << 24 | p[3] << 16 | p[4] << 8 | p[5];
+	uint32_t sent_ms = c->ping_sent_us / 1000;
+	c->ping_sent_us = 0;
+
+	int fresh = !c->rtt_us || r <= c->rtt_us;
+	if(!c->rtt_us){
+		c->rtt_us = r ? r : 1;
+		c->rtt_var_us = r / 2;
+	}else{
+		uint32_t err = r > c->rtt_us ? r - c->rtt_us : c->rtt_us - r;
+		c->rtt_var_us = (3 * c->rtt_var_us + err) / 4;
+		c->rtt_us = (7 * c->rtt_us + r) / 8;
+		if(!c->rtt_us) c->rtt_us = 1;
+	}
+	// The client read its clock about half a round trip after we sent
+	if(fresh) c->clock_offset_ms = (int32_t)(clock - (sent_ms + r / 2000));
+	return 0;
+}
+
+static const room_cmd_t commands[FRAME_TUNNEL_PREFIX] = {
+	[ROOM_CMD_NULL]     = { 1, cmd_null },
+	[ROOM_CMD_PING]     = { 2, cmd_ping },
+	[ROOM_CMD_GET_TIME] = { 1, cmd_get_time },
+	[ROOM_CMD_PONG]     = { 6, cmd_pong },
+};
+
+int dispatch_room_command(client_t *c, const uint8_t *p, int len){
+	const room_cmd_t *cmd = p[0] < FRAME_TUNNEL_PREFIX ? &commands[p[0]] : NULL;
+	if(!cmd || !cmd->run) return 1;
+	if(len < cmd->len) return 0;	// rest arrives with the next read
+	return cmd->run(c, p) < 0 ? -1 : cmd->len;
+}
+
+int room_ping(client_t *c, uint64_t now){
+	if(!c->speaks_cmds || c->state != CLIENT_ACTIVE) return 0;
+	if(c->ping_sent_us && now - c->ping_sent_us < ROOM_PING_TIMEOUT_US) return 0;
+	uint8_t msg[2] = { ROOM_CMD_PING, ++c->ping_seq };
+	int r = room_client_reply(c, msg, sizeof(msg));
+	if(r > 0) c->ping_sent_us = now;
+	return r < 0 ? -1 : 0;
+}
@@ -0,0 +1,153 @@
+/* uzenet-room-egress-bench.c
+ *
+ * Gameplay latency under a concurrent bulk download, simulated in UART byte
+ * times (100 us each). One client has a fatfs download keeping its tunnel
+ * queue full (optionally a zipstream one too) while the game sends an 8 byte
+ * input frame on TUNNEL_GAMEPLAY 60 times a second. The room's token bucket
+ * feeds a UART that drains one byte per tick; a gameplay frame's latency is
+ * from the moment the service queues it to its last byte leaving the UART.
+ *
+ * Three schedulers are compared: the old gather (tunnels in index order,
+ * each emptied before the next), flat DRR (one class, equal weights) and
+ * the priority classes from uzenet-room-egress.h with the server defaults,
+ * backlog caps included. Bulk throughput is printed alongside so the cost
+ * of the caps is visible.
+ *
+ *   uzenet-room-egress-bench [--seconds 60] [--burst 65536] [--zip]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "uzenet-room-egress.h"
+
+#define QUEUE_SIZE	4096
+#define MAX_PAYLOAD	255
+#define GAME_BYTES	8
+#define GAME_TICKS	167	// ~60 Hz in 100 us ticks
+#define MAX_MSGS	4096
+
+#define T_AUDIO		1
+#define T_GAMEPLAY	2
+#define T_FATFS		5
+#define T_ZIPSTREAM	7
+
+enum{ SCHED_INDEX, SCHED_FLAT, SCHED_CLASSES };
+
+static long seconds = 60;
+static long burst = 65536;
+static int zip = 0;
+
+// Gameplay messages still queued: payload bytes left and the tick they were queued
+static struct{
+	int left;
+	long queued;
+} msgs[MAX_MSGS];
+static int msg_head, msg_tail;
+
+static long *lat;
+static int num_lat;
+
+static int cmp_long(const void *a, const void *b){
+	long x = *(const long *)a, y = *(const long *)b;
+	return (x > y) - (x < y);
+}
+
+static void game_sent(int bytes, long done){
+	while(bytes > 0 && msg_head != msg_tail){
+		int n = msgs[msg_head].left < bytes ? msgs[msg_head].left : bytes;
+		msgs[msg_head].left -= n;
+		bytes -= n;
+		if(!msgs[msg_head].left){
+			lat[num_lat++] = done - msgs[msg_head].queued;
+			msg_head = (msg_head + 1) % MAX_MSGS;
+		}
+	}
+}
+
+static void run(int sched, const char *label){
+	egress_policy_t policy;
+	egress_drr_t drr;
+	int queued[EGRESS_TUNNELS];
+	long tokens = burst, uart_free = 0, bulk = 0;
+	long ticks = seconds * 10000;
+
+	memset(&policy, 0, sizeof(policy));
+	memset(&drr, 0, sizeof(drr));
+	memset(queued, 0, sizeof(queued));
+	for(int t = 0; t < EGRESS_TUNNELS; ++t){
+		policy.prio[t] = (sched == SCHED_CLASSES) ? 2 : 0;
+		policy.weight[t] = 1;
+	}
+	if(sched == SCHED_CLASSES){
+		policy.prio[T_GAMEPLAY] = policy.prio[T_AUDIO] = 0;
+		policy.weight[T_FATFS] = 2;
+		policy.backlog[1] = 4096;
+		policy.backlog[2] = 2 * EGRESS_QUANTUM;
+	}
+	egress_policy_build(&policy);
+	msg_head = msg_tail = 0;
+	num_lat = 0;
+
+	for(long now = 0; now < ticks; ++now){
+		if(tokens < burst) tokens++;
+		// Services keep the bulk queues topped up
+		queued[T_FATFS] = QUEUE_SIZE;
+		if(zip) queued[T_ZIPSTREAM] = QUEUE_SIZE;
+		if(now % GAME_TICKS == 0 && queued[T_GAMEPLAY] + GAME_BYTES <= QUEUE_SIZE){
+			queued[T_GAMEPLAY] += GAME_BYTES;
+			msgs[msg_tail].left = GAME_BYTES;
+			msgs[msg_tail].queued = now;
+			msg_tail = (msg_tail + 1) % MAX_MSGS;
+		}
+
+		// One flush: frames go out while the bucket covers them
+		for(;;){
+			uint16_t head[EGRESS_TUNNELS];
+			int t = -1;
+			for(int i = 0; i < EGRESS_TUNNELS; ++i){
+				head[i] = queued[i] ? 2 + (queued[i] > MAX_PAYLOAD ? MAX_PAYLOAD : queued[i]) : 0;
+				if(t < 0 && head[i]) t = i;
+			}
+			if(sched != SCHED_INDEX) t = egress_pick(&policy, &drr, head);
+			if(t < 0 || tokens < head[t] + (long)egress_reserve(&policy, t, burst)) break;
+			tokens -= head[t];
+			if(sched != SCHED_INDEX) egress_charge(&drr, t, head[t]);
+			queued[t] -= head[t] - 2;
+			uart_free = (uart_free > now ? uart_free : now) + head[t];
+			if(t == T_GAMEPLAY) game_sent(head[t] - 2, uart_free);
+			else bulk += head[t] - 2;
+		}
+	}
+
+	qsort(lat, num_lat, sizeof(long), cmp_long);
+	if(!num_lat){
+		printf("%-16s no gameplay frame delivered\n", label);
+		return;
+	}
+	printf("%-16s gameplay p50 %7.1f ms  p99 %7.1f ms  max %7.1f ms  bulk %5.0f B/s\n", label,
+	       lat[num_lat / 2] / 10.0, lat[num_lat * 99 / 100] / 10.0, lat[num_lat - 1] / 10.0, (double)bulk / seconds);
+}
+
+static void usage(const char *prog){
+	fprintf(stderr, "usage: %s [--seconds n] [--burst bytes] [--zip]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[]){
+	for(int i = 1; i < argc; ++i){
+		if(strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) seconds = atol(argv[++i]);
+		else if(strcmp(argv[i], "--burst") == 0 && i + 1 < argc) burst = atol(argv[++i]);
+		else if(strcmp(argv[i], "--zip") == 0) zip = 1;
+		else usage(argv[0]);
+	}
+	if(seconds <= 0 || burst < 2 + MAX_PAYLOAD) usage(argv[0]);
+
+	lat = malloc(sizeof(long) * (seconds * 10000 / GAME_TICKS + 1));
+	run(SCHED_INDEX, "index order");
+	run(SCHED_FLAT, "flat DRR");
+	run(SCHED_CLASSES, "priority classes");
+	free(lat);
+	return 0;
+}
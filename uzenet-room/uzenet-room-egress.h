@@ -0,0 +1,91 @@
+#ifndef UZENET_ROOM_EGRESS_H
+#define UZENET_ROOM_EGRESS_H
+
+/* Egress scheduling between the tunnels of one client.
+ *
+ * Every tunnel belongs to a priority class. Classes are strict: a frame
+ * from a lower class only goes out while every tunnel in the classes above
+ * it is empty, so gameplay and audio never queue behind a bulk transfer
+ * inside the client's token budget. Tunnels sharing a class are served by
+ * deficit round robin: each turn a tunnel earns <weight> full frames worth
+ * of bytes and sends frames while its deficit covers them.
+ *
+ * Ordering alone is not enough: whatever the token bucket lets through
+ * sits in the bridge/UART backlog ahead of the next gameplay frame. Each
+ * class therefore has a backlog cap, the bytes it may spend below a full
+ * bucket. Bulk classes keep only a couple of frames in flight, so the UART
+ * still runs at line rate but an urgent frame waits behind at most those.
+ *
+ * The scheduler only sees the wire size of each tunnel's head frame
+ * ([0xFx][len] + payload, 0 when empty); the caller peeks the rings, checks
+ * budget and tokens, and charges what it actually sent.
+ */
+
+#include <stdint.h>
+
+#define EGRESS_TUNNELS		16
+#define EGRESS_CLASSES		4	// 0 = most urgent
+#define EGRESS_QUANTUM		257	// one full [0xFx][len][255] frame
+
+typedef struct{
+	uint8_t prio[EGRESS_TUNNELS];
+	uint8_t weight[EGRESS_TUNNELS];		// frames per round, >= 1
+	uint32_t backlog[EGRESS_CLASSES];	// bytes in flight allowed, 0 = whole bucket
+	// Derived by egress_policy_build()
+	uint8_t member[EGRESS_CLASSES][EGRESS_TUNNELS];
+	uint8_t count[EGRESS_CLASSES];
+} egress_policy_t;
+
+// Per-client state, carried across flushes so fairness spans batches
+typedef struct{
+	int32_t deficit[EGRESS_TUNNELS];
+	uint8_t cursor[EGRESS_CLASSES];		// index into member[class]
+	uint8_t granted[EGRESS_CLASSES];	// cursor's tunnel already got its quantum
+} egress_drr_t;
+
+static inline void egress_policy_build(egress_policy_t *p){
+	for(int k = 0; k < EGRESS_CLASSES; ++k) p->count[k] = 0;
+	for(int t = 0; t < EGRESS_TUNNELS; ++t){
+		if(p->prio[t] >= EGRESS_CLASSES) p->prio[t] = EGRESS_CLASSES - 1;
+		if(!p->weight[t]) p->weight[t] = 1;
+		int k = p->prio[t];
+		p->member[k][p->count[k]++] = t;
+	}
+}
+
+// Tunnel whose head frame goes next, or -1 when every tunnel is empty.
+// head[t] is the wire size of tunnel t's next frame, 0 when none is queued.
+static inline int egress_pick(const egress_policy_t *p, egress_drr_t *d, const uint16_t *head){
+	for(int k = 0; k < EGRESS_CLASSES; ++k){
+		int n = p->count[k], any = 0;
+		for(int i = 0; i < n && !any; ++i) any = head[p->member[k][i]] != 0;
+		if(!any) continue;
+		for(;;){
+			int t = p->member[k][d->cursor[k]];
+			if(head[t]){
+				if(!d->granted[k]){
+					d->deficit[t] += p->weight[t] * EGRESS_QUANTUM;
+					d->granted[k] = 1;
+				}
+				if(d->deficit[t] >= head[t]) return t;
+			}else{
+				d->deficit[t] = 0;	// idle tunnels do not bank credit
+			}
+			d->cursor[k] = (d->cursor[k] + 1) % n;
+			d->granted[k] = 0;
+		}
+	}
+	return -1;
+}
+
+// Tokens a frame from <tunnel> must leave in a bucket of <burst> bytes
+static inline uint32_t egress_reserve(const egress_policy_t *p, int tunnel, uint32_t burst){
+	uint32_t cap = p->backlog[p->prio[tunnel]];
+	return (cap && cap < burst) ? burst - cap : 0;
+}
+
+static inline void egress_charge(egress_drr_t *d, int tunnel, int bytes){
+	d->deficit[tunnel] -= bytes;
+}
+
+#endif // UZENET_ROOM_EGRESS_H
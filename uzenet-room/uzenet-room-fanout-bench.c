@@ -0,0 +1,174 @@
+/* uzenet-room-fanout-bench.c
+ *
+ * One publisher, many subscribers: every published chat/lobby frame has to
+ * reach every subscriber's tunnel and then be gathered for its socket. Two
+ * ways of doing that are compared:
+ *
+ *   copy   the frame is written into each subscriber's 4 KB tunnel ring
+ *          (what room_send_to_user() per recipient would do), and egress
+ *          reads it back out of the ring;
+ *   shared the frame is encoded once into a refcounted message and each
+ *          subscriber queues a pointer (uzenet-room-pubsub.h), egress reads
+ *          the shared bytes.
+ *
+ * A fraction of the subscribers is slow and only drains every 64 publishes;
+ * the publisher never waits for them, so frames they cannot hold are
+ * dropped (copy: the new one, shared: the oldest, or coalesced with
+ * --coalesce). Reported: delivered frames/s, drops, and the memory held by
+ * the subscriber queues plus live message buffers. No sockets involved.
+ *
+ *   uzenet-room-fanout-bench [--subs 1000] [--frames 200000] [--len 64]
+ *                            [--slow 10] [--coalesce]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "uzenet-room-ring.h"
+#include "uzenet-room-pubsub.h"
+
+#define QUEUE_SIZE	4096
+#define SLOW_EVERY	64
+
+typedef struct{
+	room_ring_t ring;
+	uint8_t queue[QUEUE_SIZE];
+} sub_ring_t;
+
+static long subs = 1000, frames = 200000;
+static int len = 64, slow_pct = 10, coalesce = 0;
+static volatile uint32_t sink;
+
+// Stand-in for the message pool: a free list that never shrinks
+static pubsub_msg_t *free_msgs;
+static long live_msgs, peak_msgs;
+
+static pubsub_msg_t *msg_alloc(){
+	pubsub_msg_t *m = free_msgs;
+	if(m) free_msgs = *(pubsub_msg_t **)m;
+	else m = malloc(sizeof(*m));
+	if(++live_msgs > peak_msgs) peak_msgs = live_msgs;
+	return m;
+}
+
+static void msg_release(pubsub_msg_t *m){
+	if(!pubsub_unref(m)) return;
+	*(pubsub_msg_t **)m = free_msgs;
+	free_msgs = m;
+	live_msgs--;
+}
+
+static double now_s(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Egress touches every byte it would hand to writev()
+static void consume(const uint8_t *p, size_t n){
+	uint32_t h = sink;
+	for(size_t i = 0; i < n; i += 16) h += p[i];
+	sink = h;
+}
+
+static int is_slow(long s){
+	return s * 100 < subs * slow_pct;
+}
+
+static void report(const char *label, double secs, long delivered, long dropped, size_t bytes){
+	printf("%-7s %6.2f M frames/s delivered  %8ld dropped  %7.1f KB held  (%.0f B/subscriber)\n", label,
+	       delivered / secs / 1e6, dropped, bytes / 1024.0, (double)bytes / subs);
+}
+
+static void run_copy(const uint8_t *payload){
+	sub_ring_t *r = calloc(subs, sizeof(*r));
+	uint8_t frame[2 + 255] = { 0xF0, (uint8_t)len };
+	memcpy(frame + 2, payload, len);
+	long delivered = 0, dropped = 0;
+	double t0 = now_s();
+	for(long f = 0; f < frames; ++f){
+		for(long s = 0; s < subs; ++s){
+			if(ring_space(&r[s].ring, QUEUE_SIZE) < (uint32_t)(2 + len)){
+				dropped++;
+				continue;
+			}
+			ring_write(&r[s].ring, r[s].queue, QUEUE_SIZE, frame, 2 + len);
+		}
+		for(long s = 0; s < subs; ++s){
+			if(is_slow(s) && f % SLOW_EVERY) continue;
+			struct iovec iov[2];
+			uint32_t used = ring_used(&r[s].ring);
+			int n = ring_peek(&r[s].ring, r[s].queue, QUEUE_SIZE, iov, used);
+			for(int k = 0; k < n; ++k) consume(iov[k].iov_base, iov[k].iov_len);
+			ring_consume(&r[s].ring, used);
+			delivered += used / (2 + len);
+		}
+	}
+	report("copy", now_s() - t0, delivered, dropped, subs * sizeof(sub_ring_t));
+	free(r);
+}
+
+static void run_shared(const uint8_t *payload){
+	pubsub_queue_t *q = calloc(subs, sizeof(*q));
+	long delivered = 0, dropped = 0;
+	double t0 = now_s();
+	for(long f = 0; f < frames; ++f){
+		pubsub_msg_t *m = msg_alloc();
+		m->refs = 1;
+		m->channel = 1;
+		m->size = 2 + len;
+		m->wire[0] = 0xF0;
+		m->wire[1] = len;
+		memcpy(m->wire + 2, payload, len);
+		for(long s = 0; s < subs; ++s){
+			pubsub_msg_t *old = pubsub_push(&q[s], m, coalesce);
+			if(old){
+				if(!coalesce) dropped++;
+				msg_release(old);
+			}
+		}
+		msg_release(m);
+		for(long s = 0; s < subs; ++s){
+			if(is_slow(s) && f % SLOW_EVERY) continue;
+			pubsub_msg_t *d;
+			while((d = pubsub_pop(&q[s]))){
+				consume(d->wire, d->size);
+				msg_release(d);
+				delivered++;
+			}
+		}
+	}
+	double secs = now_s() - t0;
+	report(coalesce ? "coalesc" : "shared", secs, delivered, dropped,
+	       subs * sizeof(pubsub_queue_t) + peak_msgs * sizeof(pubsub_msg_t));
+	for(long s = 0; s < subs; ++s){
+		pubsub_msg_t *d;
+		while((d = pubsub_pop(&q[s]))) msg_release(d);
+	}
+	free(q);
+}
+
+static void usage(const char *prog){
+	fprintf(stderr, "usage: %s [--subs n] [--frames n] [--len 1-255] [--slow percent] [--coalesce]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[]){
+	for(int i = 1; i < argc; ++i){
+		if(strcmp(argv[i], "--subs") == 0 && i + 1 < argc) subs = atol(argv[++i]);
+		else if(strcmp(argv[i], "--frames") == 0 && i + 1 < argc) frames = atol(argv[++i]);
+		else if(strcmp(argv[i], "--len") == 0 && i + 1 < argc) len = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--slow") == 0 && i + 1 < argc) slow_pct = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--coalesce") == 0) coalesce = 1;
+		else usage(argv[0]);
+	}
+	if(subs <= 0 || frames <= 0 || len < 1 || len > 255 || slow_pct < 0 || slow_pct > 100) usage(argv[0]);
+
+	uint8_t payload[255];
+	for(int i = 0; i < len; ++i) payload[i] = 'a' + i % 26;
+	printf("%ld subscribers (%d%% slow), %ld frames of %d bytes\n", subs, slow_pct, frames, len);
+	run_copy(payload);
+	run_shared(payload);
+	return 0;
+}
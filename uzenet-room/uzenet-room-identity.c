@@ -0,0 +1,277 @@
+#define _GNU_SOURCE
+#include "uzenet-room-server.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+// -----------------------------------------------------------------------------
+// Identity lookups
+//
+// Logins are resolved over a couple of persistent, non-blocking connections
+// to uzenet-identity. Requests are pipelined (6 byte token out, 2 byte user
+// id back, in order), so a reconnect storm after a restart costs one write
+// per epoll batch instead of a connect/lookup/close round trip per client.
+// Answers are cached for a short while by token: good tokens so a bridge
+// that drops and reconnects logs in without asking, bad ones so a client
+// retrying a wrong password does not hammer the identity service.
+// -----------------------------------------------------------------------------
+
+#define IDENTITY_PATH		"/run/uzenet/identity.sock"
+#define IDENTITY_LINKS		2
+#define IDENTITY_PIPELINE	256	// requests in flight per link, power of two
+#define IDENTITY_CACHE_SIZE	1024	// power of two
+#define IDENTITY_HIT_TTL_US	30000000ULL
+#define IDENTITY_MISS_TTL_US	5000000ULL
+#define IDENTITY_RETRY_US	1000000	// back-off after a failed connect
+
+struct room_id_request_s{
+	client_t *client;	// NULL once the client is gone; the answer is still cached
+	uint8_t pw[6];
+};
+
+typedef struct{
+	int ev_kind;		// EV_IDENTITY
+	int fd;			// -1 while down
+	int epollout;
+	room_id_request_t req[IDENTITY_PIPELINE];
+	uint32_t head, tail;	// queued at head, answered at tail
+	uint8_t tx[IDENTITY_PIPELINE * 6];	// only used once the socket would block
+	int tx_off, tx_len;
+	uint8_t rx[2];
+	int rx_len;
+} identity_link_t;
+
+static identity_link_t links[IDENTITY_LINKS];
+static uint64_t retry_after;
+static int down;
+
+static struct{
+	uint8_t pw[6];
+	uint16_t uid;
+	uint64_t expires;	// 0 = empty
+} cache[IDENTITY_CACHE_SIZE];
+
+// -----------------------------------------------------------------------------
+// Cache
+// -----------------------------------------------------------------------------
+
+static uint32_t cache_slot(const uint8_t *pw){
+	uint32_t h = 2166136261u;	// FNV-1a
+	for(int i = 0; i < 6; ++i) h = (h ^ pw[i]) * 16777619u;
+	return h & (IDENTITY_CACHE_SIZE - 1);
+}
+
+static int cache_get(const uint8_t *pw, uint16_t *uid){
+	uint32_t s = cache_slot(pw);
+	if(!cache[s].expires || cache[s].expires <= room_now_us() || memcmp(cache[s].pw, pw, 6)) return 0;
+	*uid = cache[s].uid;
+	return 1;
+}
+
+// Direct mapped: a collision just evicts, the next login asks again
+static void cache_put(const uint8_t *pw, uint16_t uid){
+	uint32_t s = cache_slot(pw);
+	memcpy(cache[s].pw, pw, 6);
+	cache[s].uid = uid;
+	cache[s].expires = room_now_us() + (uid == IDENTITY_UID_UNKNOWN ? IDENTITY_MISS_TTL_US : IDENTITY_HIT_TTL_US);
+}
+
+static int fill_ident(client_t *c, uint16_t uid){
+	if(uid == IDENTITY_UID_UNKNOWN) return 0;
+	c->ident.user_id = uid;
+	snprintf(c->ident.name13, 14, "%06u", (uid == IDENTITY_UID_GUEST ? 0 : uid));
+	snprintf(c->ident.name8, 9,  "%.8s", c->ident.name13);
+	snprintf(c->ident.name6, 7,  "%.6s", c->ident.name13);
+	c->ident.flags = (uid == IDENTITY_UID_GUEST ? 'R' : 'G');
+	return 1;
+}
+
+// -----------------------------------------------------------------------------
+// Links
+// -----------------------------------------------------------------------------
+
+static void link_update_events(identity_link_t *l){
+	int want = l->tx_len > l->tx_off;
+	if(want == l->epollout) return;
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLET | (want ? EPOLLOUT : 0), .data.ptr = l };
+	epoll_ctl(room_epfd, EPOLL_CTL_MOD, l->fd, &ev);
+	l->epollout = want;
+}
+
+// Everyone waiting on this link fails their login; they reconnect and land
+// on a fresh link.
+static void link_close(identity_link_t *l){
+	syslog(LOG_WARNING, "room: identity link lost, failing %u pending login(s)", l->head - l->tail);
+	epoll_ctl(room_epfd, EPOLL_CTL_DEL, l->fd, NULL);
+	close(l->fd);
+	l->fd = -1;
+	l->ev_kind = EV_DEAD;	// a later event in this batch may still point here
+	l->tx_off = l->tx_len = l->rx_len = 0;
+	while(l->tail != l->head){
+		room_id_request_t *r = &l->req[l->tail++ & (IDENTITY_PIPELINE - 1)];
+		client_t *c = r->client;
+		if(!c) continue;
+		r->client = NULL;
+		c->id_req = NULL;
+		room_login_done(c, 0);
+	}
+}
+
+static int link_connect(identity_link_t *l){
+	uint64_t now = room_now_us();
+	if(now < retry_after) return -1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0) return -1;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	strcpy(addr.sun_path, IDENTITY_PATH);
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0){
+		if(!down) syslog(LOG_WARNING, "room: identity service unavailable: %s", strerror(errno));
+		down = 1;
+		retry_after = now + IDENTITY_RETRY_US;
+		close(fd);
+		return -1;
+	}
+	if(down){
+		syslog(LOG_INFO, "room: identity service reachable again");
+		down = 0;
+	}
+	l->ev_kind = EV_IDENTITY;
+	l->fd = fd;
+	l->epollout = 0;
+	l->head = l->tail = 0;
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = l };
+	if(epoll_ctl(room_epfd, EPOLL_CTL_ADD, fd, &ev) < 0){
+		close(fd);
+		l->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static int link_flush_tx(identity_link_t *l){
+	while(l->tx_off < l->tx_len){
+		ssize_t w = write(l->fd, l->tx + l->tx_off, l->tx_len - l->tx_off);
+		if(w < 0){
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return -1;
+		}
+		l->tx_off += w;
+	}
+	if(l->tx_off == l->tx_len) l->tx_off = l->tx_len = 0;
+	link_update_events(l);
+	return 0;
+}
+
+// Least loaded live link, connecting one if none is up
+static identity_link_t *link_pick(){
+	identity_link_t *best = NULL;
+	for(int i = 0; i < IDENTITY_LINKS; ++i){
+		identity_link_t *l = &links[i];
+		if(l->fd < 0) continue;
+		if(!best || l->head - l->tail < best->head - best->tail) best = l;
+	}
+	if(best && best->head - best->tail < IDENTITY_PIPELINE / 2) return best;
+	for(int i = 0; i < IDENTITY_LINKS; ++i)
+		if(links[i].fd < 0 && link_connect(&links[i]) == 0) return &links[i];
+	return (best && best->head - best->tail < IDENTITY_PIPELINE) ? best : NULL;
+}
+
+// Answers arrive in request order
+static int link_read(identity_link_t *l){
+	for(;;){
+		ssize_t r = read(l->fd, l->rx + l->rx_len, sizeof(l->rx) - l->rx_len);
+		if(r == 0) return -1;
+		if(r < 0){
+			if(errno == EINTR) continue;
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+		l->rx_len += r;
+		if(l->rx_len < 2) continue;
+		l->rx_len = 0;
+		if(l->tail == l->head){
+			syslog(LOG_WARNING, "room: unsolicited reply from identity service");
+			return -1;
+		}
+		room_id_request_t *q = &l->req[l->tail++ & (IDENTITY_PIPELINE - 1)];
+		uint16_t uid = (l->rx[0] << 8) | l->rx[1];
+		cache_put(q->pw, uid);
+		client_t *c = q->client;
+		if(!c) continue;
+		q->client = NULL;
+		c->id_req = NULL;
+		room_login_done(c, fill_ident(c, uid));
+	}
+}
+
+void identity_event(void *link, uint32_t events){
+	identity_link_t *l = link;
+	if((events & EPOLLOUT) && link_flush_tx(l) < 0){
+		link_close(l);
+		return;
+	}
+	if((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && link_read(l) < 0)
+		link_close(l);
+}
+
+// -----------------------------------------------------------------------------
+// Lookups
+// -----------------------------------------------------------------------------
+
+void identity_init(){
+	for(int i = 0; i < IDENTITY_LINKS; ++i) links[i].fd = -1;
+	link_connect(&links[0]);	// so the first login after a restart does not pay for it
+}
+
+int identity_lookup(client_t *c){
+	uint16_t uid;
+	if(cache_get(c->pw, &uid)) return fill_ident(c, uid) ? 1 : -1;
+
+	identity_link_t *l = link_pick();
+	if(!l) return -1;
+
+	room_id_request_t *q = &l->req[l->head++ & (IDENTITY_PIPELINE - 1)];
+	q->client = c;
+	memcpy(q->pw, c->pw, 6);
+	c->id_req = q;
+
+	if(l->tx_off == l->tx_len){
+		ssize_t w;
+		do w = write(l->fd, c->pw, 6); while(w < 0 && errno == EINTR);
+		if(w < 0){
+			if(errno != EAGAIN && errno != EWOULDBLOCK){
+				q->client = NULL;	// c fails through our return, not link_close()
+				c->id_req = NULL;
+				link_close(l);
+				return -1;
+			}
+			w = 0;
+		}
+		if(w == 6) return 0;
+		l->tx_off = l->tx_len = 0;
+		memcpy(l->tx, c->pw + w, 6 - w);
+		l->tx_len = 6 - w;
+		link_update_events(l);
+		return 0;
+	}
+	if(l->tx_len + 6 > (int)sizeof(l->tx)){
+		memmove(l->tx, l->tx + l->tx_off, l->tx_len - l->tx_off);
+		l->tx_len -= l->tx_off;
+		l->tx_off = 0;
+	}
+	memcpy(l->tx + l->tx_len, c->pw, 6);
+	l->tx_len += 6;
+	return 0;
+}
+
+void identity_client_closed(client_t *c){
+	if(c->id_req) c->id_req->client = NULL;
+	c->id_req = NULL;
+}
@@ -0,0 +1,581 @@
+#define _GNU_SOURCE
+#include "uzenet-room-server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+// -----------------------------------------------------------------------------
+// Lockstep relay
+//
+// TUNNEL_GAMEPLAY carries lockstep play for multiplayer Uzebox games. Every
+// player sends its controller word for each frame; once the room has the
+// word of every player for frame N it sends all of them, in slot order, to
+// every player, who then run frame N. That happens in the epoll batch the
+// last input arrived in, so the relay adds no waiting of its own.
+//
+// If some inputs for frame N are still missing LOCKSTEP_TIMEOUT_US after the
+// first one arrived, the frame goes out anyway with those players' previous
+// word repeated and their bits set in the predicted mask. Since everyone
+// runs the frame the room sent, the players stay in sync; an input that
+// shows up later is dropped.
+//
+// The last LOCKSTEP_HISTORY frames sent are kept per match. A player who
+// disconnects is marked away and predicted without being waited for; when
+// they JOIN again they get their slot back and catch up from the history:
+// the latest state snapshot if there is one, then every frame since in
+// REPLAY bursts, then live frames. A player whose tunnel cannot take a frame
+// is caught up the same way instead of silently falling out of step.
+// Observers (JOIN with 0 players) follow a running match likewise. A
+// uzenet-sim sidecar joins as an observer, runs the game itself and sends
+// SNAPSHOTs of its state now and then, so a late joiner only needs the frames
+// since the last one.
+//
+// Client -> room, several messages may share one tunnel frame:
+//   JOIN     [0x01][match u16][players]	players 2..LOCKSTEP_PLAYERS, 0 = observe
+//   INPUT    [0x02][frame u16][input u16]	frames may run LOCKSTEP_WINDOW ahead
+//   LEAVE    [0x03]
+//   SNAPSHOT [0x04][frame u16][total u16][offset u16][len][data]
+//	observers only: state before <frame>, chunks in order, len up to
+//	LOCKSTEP_CHUNK
+// Room -> client:
+//   START    [0x81][players][slot][first frame u16]	slot 0xFE: observer
+//   FRAME    [0x82][frame u16][predicted mask][input u16 x players]
+//   END      [0x83][0xFF]		match over, no such match, or refused
+//   SNAPSHOT [0x84][frame u16][total u16][offset u16][len][data]	load, then replay
+//   REPLAY   [0x85][first frame u16][count][input u16 x players x count]
+//   AWAY     [0x86][slot]		disconnected, predicted from now on
+//   BACK     [0x87][slot]		caught up, waited for again
+//
+// A match lives on shard (id % workers); players on other shards reach it
+// through the shard rings and get frames back with room_send_to_session().
+// Matches come from a pool and carry fixed arrays, so nothing is allocated
+// per frame; the snapshot buffers are allocated with the first chunk.
+// -----------------------------------------------------------------------------
+
+#define LOCKSTEP_PLAYERS	8
+#define LOCKSTEP_OBSERVERS	4
+#define LOCKSTEP_WINDOW		16	// frames, power of two
+#define LOCKSTEP_HISTORY	512	// frames, power of two; 8.5 s at 60 Hz
+#define LOCKSTEP_SNAPSHOT_MAX	4096	// all of the Uzebox's RAM
+#define LOCKSTEP_CHUNK		240	// snapshot bytes per message
+#define LOCKSTEP_TIMEOUT_US	32000	// about two video frames
+#define MATCH_SLAB_COUNT	16
+#define MATCHES			65536
+#define SLOT_OBSERVER		0xFE
+
+enum{
+	LS_JOIN = 0x01,
+	LS_INPUT,
+	LS_LEAVE,
+	LS_SNAPSHOT_IN,
+};
+
+enum{
+	LS_START = 0x81,
+	LS_FRAME,
+	LS_END,
+	LS_SNAPSHOT,
+	LS_REPLAY,
+	LS_AWAY,
+	LS_BACK,
+};
+
+enum{
+	SLOT_FREE = 0,
+	SLOT_LIVE,
+	SLOT_SYNC,	// catching up from the history
+	SLOT_AWAY,
+};
+
+typedef struct{
+	uint32_t handle;	// room_session_handle()
+	uint16_t uid;		// who may take the slot back when away
+	uint8_t state;
+	uint8_t snap;		// catch-up starts with the snapshot
+	uint16_t cursor;	// next frame to replay
+	uint16_t snap_off;	// snapshot bytes sent
+} slot_t;
+
+typedef struct match_s match_t;
+struct match_s{
+	uint16_t id;
+	uint8_t players, joined;
+	uint16_t next;				// frame to send next
+	uint32_t sent;				// frames sent, saturating
+	slot_t slot[LOCKSTEP_PLAYERS];
+	slot_t obs[LOCKSTEP_OBSERVERS];
+	uint16_t last[LOCKSTEP_PLAYERS];	// repeated when an input is late
+	uint8_t have[LOCKSTEP_WINDOW];		// slots heard from, per frame
+	uint16_t input[LOCKSTEP_WINDOW][LOCKSTEP_PLAYERS];
+	uint16_t history[LOCKSTEP_HISTORY][LOCKSTEP_PLAYERS];
+	uint8_t *snap, *snap_in;		// last complete snapshot, one arriving
+	uint16_t snap_frame, snap_len;
+	uint16_t snap_in_frame, snap_in_len, snap_in_got;
+	uint64_t pending_since;			// first input for next arrived, 0 = none
+	uint64_t deadline;			// 0 = not on the wait list
+	match_t *tprev, *tnext;
+	uint32_t predicted, late, resyncs;
+};
+
+static match_t **matches;
+static pool_t match_pool = { .size = sizeof(match_t), .per_slab = MATCH_SLAB_COUNT };
+// Every match waits the same LOCKSTEP_TIMEOUT_US, so appending keeps it sorted
+static match_t *wait_head, *wait_tail;
+static const uint8_t match_over[2] = { LS_END, 0xFF };
+
+void lockstep_init(void){
+	matches = calloc(MATCHES, sizeof(match_t *));
+}
+
+static void wait_remove(match_t *m){
+	if(!m->deadline) return;
+	if(m->tprev) m->tprev->tnext = m->tnext; else wait_head = m->tnext;
+	if(m->tnext) m->tnext->tprev = m->tprev; else wait_tail = m->tprev;
+	m->tprev = m->tnext = NULL;
+	m->deadline = 0;
+}
+
+static void wait_append(match_t *m, uint64_t now){
+	m->deadline = now + LOCKSTEP_TIMEOUT_US;
+	m->tprev = wait_tail;
+	m->tnext = NULL;
+	if(wait_tail) wait_tail->tnext = m; else wait_head = m;
+	wait_tail = m;
+}
+
+// len when queued, 0 when the path to the player is full, -1 when they are gone
+static int send_to(uint32_t handle, const uint8_t *msg, int len){
+	return room_send_to_session(handle, TUNNEL_GAMEPLAY, msg, len);
+}
+
+// Player slots first, then the observers
+static slot_t *slot_at(match_t *m, int i){
+	return i < m->joined ? &m->slot[i] : &m->obs[i - m->joined];
+}
+
+static void send_all(match_t *m, const uint8_t *msg, int len){
+	for(int i = 0; i < m->joined + LOCKSTEP_OBSERVERS; ++i){
+		slot_t *s = slot_at(m, i);
+		if(s->state == SLOT_LIVE || s->state == SLOT_SYNC) send_to(s->handle, msg, len);
+	}
+}
+
+static uint8_t live_mask(match_t *m){
+	uint8_t live = 0;
+	for(int i = 0; i < m->joined; ++i)
+		if(m->slot[i].state == SLOT_LIVE) live |= 1 << i;
+	return live;
+}
+
+static void match_free(match_t *m){
+	send_all(m, match_over, sizeof(match_over));
+	if(m->predicted || m->late || m->resyncs)
+		syslog(LOG_INFO, "room: match %u over after %u frame(s), %u predicted and %u late input(s), %u resync(s)",
+		       m->id, m->sent, m->predicted, m->late, m->resyncs);
+	wait_remove(m);
+	matches[m->id] = NULL;
+	free(m->snap < m->snap_in ? m->snap : m->snap_in);
+	pool_free(&match_pool, m);
+}
+
+// -----------------------------------------------------------------------------
+// Catching up
+// -----------------------------------------------------------------------------
+
+// Start from the snapshot if the history still reaches back to it, else
+// from frame one if the history still holds every frame. -1: neither.
+static int resync_begin(match_t *m, slot_t *s){
+	if(m->snap_len && (uint16_t)(m->next - m->snap_frame) <= LOCKSTEP_HISTORY){
+		s->snap = 1;
+		s->snap_off = 0;
+		s->cursor = m->snap_frame;
+	}else if(m->sent <= LOCKSTEP_HISTORY){
+		s->snap = 0;
+		s->cursor = m->next - m->sent;
+	}else{
+		return -1;
+	}
+	s->state = SLOT_SYNC;
+	m->resyncs++;
+	return 0;
+}
+
+// Send as much of the catch-up as the path to the player takes; the rest
+// goes out after the next frame or wait-list tick.
+static void resync_pump(match_t *m, slot_t *s, int slot){
+	uint8_t msg[MAX_FRAME_PAYLOAD];
+	int r = 0;
+	while(s->state == SLOT_SYNC){
+		if((uint16_t)(m->next - s->cursor) > LOCKSTEP_HISTORY){
+			// Too slow to keep up with the history: start over, or give up
+			if(resync_begin(m, s) == 0) continue;
+			send_to(s->handle, match_over, sizeof(match_over));
+			r = -1;
+			break;
+		}
+		if(s->snap && s->snap_off < m->snap_len){
+			int n = m->snap_len - s->snap_off;
+			if(n > LOCKSTEP_CHUNK) n = LOCKSTEP_CHUNK;
+			msg[0] = LS_SNAPSHOT;
+			msg[1] = m->snap_frame >> 8;
+			msg[2] = m->snap_frame;
+			msg[3] = m->snap_len >> 8;
+			msg[4] = m->snap_len;
+			msg[5] = s->snap_off >> 8;
+			msg[6] = s->snap_off;
+			msg[7] = n;
+			memcpy(msg + 8, m->snap + s->snap_off, n);
+			if((r = send_to(s->handle, msg, 8 + n)) <= 0) break;
+			s->snap_off += n;
+			continue;
+		}
+		int left = (uint16_t)(m->next - s->cursor);
+		if(!left){
+			s->state = SLOT_LIVE;
+			if(slot != SLOT_OBSERVER){
+				uint8_t back[2] = { LS_BACK, slot };
+				send_all(m, back, sizeof(back));
+			}
+			return;
+		}
+		int count = (MAX_FRAME_PAYLOAD - 4) / (2 * m->players), len = 4;
+		if(count > left) count = left;
+		msg[0] = LS_REPLAY;
+		msg[1] = s->cursor >> 8;
+		msg[2] = s->cursor;
+		msg[3] = count;
+		for(int f = 0; f < count; ++f){
+			uint16_t *in = m->history[(uint16_t)(s->cursor + f) & (LOCKSTEP_HISTORY - 1)];
+			for(int i = 0; i < m->players; ++i){
+				msg[len++] = in[i] >> 8;
+				msg[len++] = in[i];
+			}
+		}
+		if((r = send_to(s->handle, msg, len)) <= 0) break;
+		s->cursor += count;
+	}
+	if(r < 0) s->state = slot == SLOT_OBSERVER ? SLOT_FREE : SLOT_AWAY;
+}
+
+static int pump_all(match_t *m){
+	int syncing = 0;
+	for(int i = 0; i < m->joined + LOCKSTEP_OBSERVERS; ++i){
+		slot_t *s = slot_at(m, i);
+		if(s->state != SLOT_SYNC) continue;
+		resync_pump(m, s, i < m->joined ? i : SLOT_OBSERVER);
+		syncing |= s->state == SLOT_SYNC;
+	}
+	return syncing;
+}
+
+// Chunks have to arrive in order; a gap drops the snapshot being assembled
+static void snapshot_in(match_t *m, const uint8_t *p){
+	uint16_t frame = p[1] << 8 | p[2];
+	uint16_t total = p[3] << 8 | p[4];
+	uint16_t off = p[5] << 8 | p[6];
+	int n = p[7];
+	if(!total || total > LOCKSTEP_SNAPSHOT_MAX || off + n > total) return;
+	if(!m->snap){
+		if(!(m->snap = malloc(2 * LOCKSTEP_SNAPSHOT_MAX))) return;
+		m->snap_in = m->snap + LOCKSTEP_SNAPSHOT_MAX;
+	}
+	if(off == 0){
+		m->snap_in_frame = frame;
+		m->snap_in_len = total;
+		m->snap_in_got = 0;
+	}
+	if(frame != m->snap_in_frame || total != m->snap_in_len || off != m->snap_in_got) return;
+	memcpy(m->snap_in + off, p + 8, n);
+	if((m->snap_in_got += n) < total) return;
+
+	// Complete: swap it in, and restart whoever was halfway through the old one
+	uint8_t *t = m->snap;
+	m->snap = m->snap_in;
+	m->snap_in = t;
+	m->snap_frame = frame;
+	m->snap_len = total;
+	m->snap_in_got = 0;
+	for(int i = 0; i < m->joined + LOCKSTEP_OBSERVERS; ++i){
+		slot_t *s = slot_at(m, i);
+		if(s->state == SLOT_SYNC && s->snap && s->snap_off){
+			s->snap_off = 0;
+			s->cursor = frame;
+		}
+	}
+}
+
+// -----------------------------------------------------------------------------
+// Frames
+// -----------------------------------------------------------------------------
+
+// Send frame m->next, predicting whoever has not been heard from
+static void emit(match_t *m){
+	int w = m->next & (LOCKSTEP_WINDOW - 1);
+	uint16_t *h = m->history[m->next & (LOCKSTEP_HISTORY - 1)];
+	uint8_t msg[4 + 2 * LOCKSTEP_PLAYERS];
+	int len = 4;
+	msg[0] = LS_FRAME;
+	msg[1] = m->next >> 8;
+	msg[2] = m->next;
+	msg[3] = ~m->have[w] & ((1 << m->players) - 1);
+	for(int i = 0; i < m->players; ++i){
+		if(m->have[w] & (1 << i)) m->last[i] = m->input[w][i];
+		h[i] = m->last[i];
+		msg[len++] = m->last[i] >> 8;
+		msg[len++] = m->last[i];
+	}
+	m->predicted += __builtin_popcount(msg[3] & live_mask(m));
+	for(int i = 0; i < m->joined + LOCKSTEP_OBSERVERS; ++i){
+		slot_t *s = slot_at(m, i);
+		// A frame that does not fit is replayed with the ones after it
+		if(s->state == SLOT_LIVE && send_to(s->handle, msg, len) == 0){
+			s->state = SLOT_SYNC;
+			s->snap = 0;
+			s->cursor = m->next;
+		}
+	}
+	m->have[w] = 0;
+	m->next++;
+	m->pending_since = 0;
+	if(m->sent != UINT32_MAX) m->sent++;
+}
+
+// Send every frame the live players are complete for, feed whoever is
+// catching up, then wait on the next frame if it has begun
+static void advance(match_t *m, uint64_t now){
+	uint8_t live = live_mask(m);
+	int sent = 0;
+	while(live && (m->have[m->next & (LOCKSTEP_WINDOW - 1)] & live) == live){
+		emit(m);
+		sent = 1;
+	}
+	if(m->have[m->next & (LOCKSTEP_WINDOW - 1)] && !m->pending_since) m->pending_since = now;
+	int syncing = pump_all(m);
+	if(sent) wait_remove(m);
+	if(!m->deadline && (m->pending_since || syncing)) wait_append(m, now);
+}
+
+// -----------------------------------------------------------------------------
+// Players
+// -----------------------------------------------------------------------------
+
+static int slot_of(match_t *m, uint32_t handle){
+	for(int i = 0; i < m->joined; ++i)
+		if(m->slot[i].handle == handle && m->slot[i].state != SLOT_AWAY) return i;
+	return -1;
+}
+
+static slot_t *observer_of(match_t *m, uint32_t handle){
+	for(int i = 0; i < LOCKSTEP_OBSERVERS; ++i)
+		if(m->obs[i].state != SLOT_FREE && m->obs[i].handle == handle) return &m->obs[i];
+	return NULL;
+}
+
+// The away slot a reconnecting user gets back. Guests all share one uid,
+// so a guest may take over any away guest's slot.
+static int away_slot(match_t *m, uint16_t uid){
+	for(int i = 0; i < m->joined; ++i)
+		if(m->slot[i].state == SLOT_AWAY && m->slot[i].uid == uid) return i;
+	return -1;
+}
+
+static void start_msg(match_t *m, slot_t *s, int slot){
+	uint8_t msg[5] = { LS_START, m->players, slot, s->cursor >> 8, s->cursor };
+	send_to(s->handle, msg, sizeof(msg));
+}
+
+// Running match, s just got its catch-up point: tell them and start it
+static void rejoin(match_t *m, slot_t *s, int slot){
+	if(resync_begin(m, s) < 0){
+		s->state = slot == SLOT_OBSERVER ? SLOT_FREE : SLOT_AWAY;
+		send_to(s->handle, match_over, sizeof(match_over));
+		return;
+	}
+	start_msg(m, s, slot);
+	advance(m, room_now_us());
+}
+
+static void join(uint16_t id, uint32_t handle, uint16_t uid, int players){
+	match_t *m = matches[id];
+	if(!players){
+		slot_t *s = NULL;
+		for(int i = 0; m && i < LOCKSTEP_OBSERVERS && !s; ++i)
+			if(m->obs[i].state == SLOT_FREE) s = &m->obs[i];
+		if(m && observer_of(m, handle)) return;
+		if(!s){
+			send_to(handle, match_over, sizeof(match_over));
+			return;
+		}
+		s->handle = handle;
+		s->uid = uid;
+		s->state = SLOT_LIVE;	// START comes with the players' if not started yet
+		if(m->joined == m->players) rejoin(m, s, SLOT_OBSERVER);
+		return;
+	}
+	if(!m){
+		if(players < 2 || players > LOCKSTEP_PLAYERS || !(m = pool_alloc(&match_pool))){
+			send_to(handle, match_over, sizeof(match_over));
+			return;
+		}
+		m->id = id;
+		m->players = players;
+		matches[id] = m;
+	}
+	if(slot_of(m, handle) >= 0) return;
+	int slot = m->players == players ? away_slot(m, uid) : -1;
+	if(slot >= 0){
+		m->slot[slot].handle = handle;
+		rejoin(m, &m->slot[slot], slot);
+		return;
+	}
+	if(m->joined == m->players || m->players != players){
+		send_to(handle, match_over, sizeof(match_over));
+		return;
+	}
+	slot_t *s = &m->slot[m->joined++];
+	s->handle = handle;
+	s->uid = uid;
+	s->state = SLOT_LIVE;
+	if(m->joined < m->players) return;
+	for(int i = 0; i < m->joined + LOCKSTEP_OBSERVERS; ++i){
+		s = slot_at(m, i);
+		s->cursor = m->next;
+		if(s->state == SLOT_LIVE) start_msg(m, s, i < m->joined ? i : SLOT_OBSERVER);
+	}
+}
+
+static void leave(match_t *m, uint32_t handle){
+	slot_t *o = observer_of(m, handle);
+	if(o){
+		o->state = SLOT_FREE;
+		return;
+	}
+	int slot = slot_of(m, handle);
+	if(slot < 0) return;
+	if(m->joined < m->players){
+		// Not started: the slot simply goes away
+		memmove(&m->slot[slot], &m->slot[slot + 1], (--m->joined - slot) * sizeof(slot_t));
+		if(!m->joined) match_free(m);
+		return;
+	}
+	m->slot[slot].state = SLOT_AWAY;
+	int left = 0;
+	for(int i = 0; i < m->joined; ++i) left += m->slot[i].state != SLOT_AWAY;
+	if(!left){
+		match_free(m);	// nobody left to play
+		return;
+	}
+	uint8_t away[2] = { LS_AWAY, slot };
+	send_all(m, away, sizeof(away));
+	advance(m, room_now_us());	// the frame may have been waiting on them alone
+}
+
+// One message (already checked by op_len()) on the match's shard
+static void match_op(uint16_t id, uint32_t handle, uint16_t uid, const uint8_t *p){
+	if(p[0] == LS_JOIN){
+		join(id, handle, uid, p[3]);
+		return;
+	}
+	match_t *m = matches[id];
+	int slot = m ? slot_of(m, handle) : -1;
+	if(p[0] == LS_LEAVE){
+		if(m) leave(m, handle);
+		return;
+	}
+	if(p[0] == LS_SNAPSHOT_IN){
+		if(m && observer_of(m, handle)) snapshot_in(m, p);
+		return;
+	}
+	if(slot < 0){
+		if(!m || !observer_of(m, handle)) send_to(handle, match_over, sizeof(match_over));
+		return;
+	}
+	if(m->joined < m->players || m->slot[slot].state != SLOT_LIVE) return;	// not started / catching up
+	uint16_t frame = p[1] << 8 | p[2];
+	if((uint16_t)(frame - m->next) >= LOCKSTEP_WINDOW){
+		m->late++;	// already sent with a prediction, or absurdly far ahead
+		return;
+	}
+	int w = frame & (LOCKSTEP_WINDOW - 1);
+	m->input[w][slot] = p[3] << 8 | p[4];
+	m->have[w] |= 1 << slot;
+	advance(m, room_now_us());
+}
+
+static int op_len(const uint8_t *p, int len){
+	switch(p[0]){
+	case LS_JOIN:        return len >= 4 ? 4 : 0;
+	case LS_INPUT:       return len >= 5 ? 5 : 0;
+	case LS_LEAVE:       return 1;
+	case LS_SNAPSHOT_IN: return len >= 8 && p[7] && p[7] <= LOCKSTEP_CHUNK && len >= 8 + p[7] ? 8 + p[7] : 0;
+	default:             return 0;
+	}
+}
+
+// Run one message where the match lives
+static void route(uint16_t id, uint32_t handle, uint16_t uid, const uint8_t *p, int len){
+	int home = id % room_shard_count();
+	if(home == room_shard_id()){
+		match_op(id, handle, uid, p);
+		return;
+	}
+	uint8_t rec[6 + 8 + LOCKSTEP_CHUNK] = { handle >> 24, handle >> 16, handle >> 8, handle, uid >> 8, uid };
+	memcpy(rec + 6, p, len);
+	shard_lockstep(home, id, rec, 6 + len);	// a full ring loses it like a late input
+}
+
+void lockstep_client_data(client_t *c, const uint8_t *data, int len){
+	uint32_t handle = room_session_handle(c);
+	uint16_t uid = c->ident.user_id;
+	for(int i = 0, n; i < len; i += n){
+		n = op_len(data + i, len - i);
+		if(!n) return;
+		if(data[i] == LS_JOIN){
+			if(c->in_match && c->match_id != (data[i + 1] << 8 | data[i + 2]))
+				route(c->match_id, handle, uid, (const uint8_t[]){ LS_LEAVE }, 1);
+			c->match_id = data[i + 1] << 8 | data[i + 2];
+			c->in_match = 1;
+		}else if(!c->in_match){
+			if(data[i] == LS_INPUT){
+				room_queue_tunnel(c, TUNNEL_GAMEPLAY, match_over, sizeof(match_over));
+				room_client_output(c);
+			}
+			continue;
+		}
+		route(c->match_id, handle, uid, data + i, n);
+		if(data[i] == LS_LEAVE) c->in_match = 0;
+	}
+}
+
+// [handle u32][uid u16][message]
+void lockstep_forwarded(uint16_t match, const uint8_t *data, int len){
+	if(len < 7) return;
+	uint32_t handle = (uint32_t)data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+	uint16_t uid = data[4] << 8 | data[5];
+	if(op_len(data + 6, len - 6) == len - 6) match_op(match, handle, uid, data + 6);
+}
+
+void lockstep_client_closed(client_t *c){
+	if(!c->in_match) return;
+	route(c->match_id, room_session_handle(c), c->ident.user_id, (const uint8_t[]){ LS_LEAVE }, 1);
+	c->in_match = 0;
+}
+
+void lockstep_timers(uint64_t now){
+	while(wait_head && wait_head->deadline <= now){
+		match_t *m = wait_head;
+		wait_remove(m);
+		if(m->pending_since && now - m->pending_since >= LOCKSTEP_TIMEOUT_US) emit(m);
+		advance(m, now);
+	}
+}
+
+int lockstep_match_busy(uint16_t match){
+	return matches[match] != NULL;
+}
+
+uint64_t lockstep_next_us(void){
+	return wait_head ? wait_head->deadline : UINT64_MAX;
+}
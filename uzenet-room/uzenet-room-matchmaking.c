@@ -0,0 +1,344 @@
+#define _GNU_SOURCE
+#include "uzenet-room-server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/random.h>
+
+// -----------------------------------------------------------------------------
+// Matchmaking
+//
+// TUNNEL_MATCHMAKING queues players for a game and seats them together by
+// round trip time (measured by the room, see uzenet-room-command.c), so a
+// match is not held back by one far-away player. A full match gets a lockstep
+// match id (uzenet-room-lockstep.c) and a shared random seed; each player
+// then JOINs that match on TUNNEL_GAMEPLAY.
+//
+// Every (game code, player count) has a queue, and a queue has one bucket
+// per MM_BUCKET_US of RTT. Players arrive in time order, so each bucket is a
+// FIFO of intrusive links with the longest waiting at its head: enqueue,
+// cancel and taking the head are O(1), and a busy mask of non-empty buckets
+// makes finding candidates a bit scan, as on the pacing wheel. A match takes
+// players from the newcomer's bucket first and then from the nearest ones.
+// The RTT spread a player accepts widens by one bucket per MM_WIDEN_US of
+// waiting, so nobody waits forever when it is quiet. New players are matched
+// as they arrive; widening runs on one tick every MM_TICK_US that passes
+// over every waiting queue.
+//
+// Client -> room:
+//   QUEUE  [0x01][game 8][players]	players 2..LOCKSTEP_PLAYERS; queue again to move
+//   CANCEL [0x02]
+// Room -> client:
+//   QUEUED [0x81][bucket]		RTT bucket, 0xFF: refused
+//   FOUND  [0x82][match u16][players][seat][seed u32]	JOIN <match> next
+//   CANCELLED [0x83]
+//
+// Queues for a game live on shard (hash of game code % workers); players on
+// other shards reach them through the shard rings.
+// -----------------------------------------------------------------------------
+
+#define MM_BUCKETS		8
+#define MM_BUCKET_US		30000		// RTT per bucket; the last takes the rest and the unmeasured
+#define MM_WIDEN_US		5000000		// waiting this long accepts one more bucket either way
+#define MM_TICK_US		250000
+#define MM_PLAYERS		8		// LOCKSTEP_PLAYERS
+#define MM_GAME_LEN		8
+#define MM_HASH			1024		// power of two
+#define MM_ENTRY_SLAB_COUNT	256
+#define MM_MATCH_FIRST		0x8000		// lockstep ids below are left to clients
+
+enum{
+	MM_QUEUE = 0x01,
+	MM_CANCEL,
+};
+
+enum{
+	MM_QUEUED = 0x81,
+	MM_FOUND,
+	MM_CANCELLED,
+};
+
+typedef struct mm_entry_s mm_entry_t;
+typedef struct mm_queue_s mm_queue_t;
+
+struct mm_entry_s{
+	uint32_t handle;		// room_session_handle()
+	uint16_t uid;
+	uint8_t bucket;
+	uint64_t since;
+	mm_queue_t *q;
+	mm_entry_t *prev, *next;	// bucket FIFO
+	mm_entry_t *hnext;		// by handle
+};
+
+struct mm_queue_s{
+	char game[MM_GAME_LEN];
+	uint8_t players;
+	uint8_t busy;			// non-empty buckets
+	uint32_t waiting;
+	mm_entry_t *head[MM_BUCKETS], *tail[MM_BUCKETS];
+	uint32_t count[MM_BUCKETS];
+	mm_queue_t *hnext;		// same game hash
+	mm_queue_t *wprev, *wnext;	// queues with players waiting
+};
+
+static mm_queue_t *queues[MM_HASH];
+static mm_entry_t *entries[MM_HASH];
+static mm_queue_t *waiting_head;
+static pool_t entry_pool = { .size = sizeof(mm_entry_t), .per_slab = MM_ENTRY_SLAB_COUNT };
+static uint64_t next_tick_us;
+static uint16_t next_match;
+static uint32_t matched, widened;
+
+static uint32_t game_hash(const uint8_t *game){
+	uint32_t h = 2166136261u;	// FNV-1a
+	for(int i = 0; i < MM_GAME_LEN; ++i) h = (h ^ game[i]) * 16777619u;
+	return h;
+}
+
+static uint32_t handle_hash(uint32_t handle){
+	return (handle * 2654435761u) >> 22;	// 10 bits
+}
+
+static int rtt_bucket(uint32_t rtt_us){
+	if(!rtt_us) return MM_BUCKETS - 1;	// not measured: assume the worst
+	uint32_t b = rtt_us / MM_BUCKET_US;
+	return b < MM_BUCKETS ? b : MM_BUCKETS - 1;
+}
+
+static void send_to(uint32_t handle, const uint8_t *msg, int len){
+	room_send_to_session(handle, TUNNEL_MATCHMAKING, msg, len);
+}
+
+static mm_queue_t *queue_get(const uint8_t *game, int players){
+	mm_queue_t **pp = &queues[game_hash(game) & (MM_HASH - 1)];
+	for(mm_queue_t *q = *pp; q; q = q->hnext)
+		if(q->players == players && !memcmp(q->game, game, MM_GAME_LEN)) return q;
+	mm_queue_t *q = calloc(1, sizeof(*q));
+	if(!q) return NULL;
+	memcpy(q->game, game, MM_GAME_LEN);
+	q->players = players;
+	q->hnext = *pp;
+	*pp = q;
+	return q;
+}
+
+// Queues go as soon as nobody waits in them; game codes are up to the clients
+static void queue_drop(mm_queue_t *q){
+	if(q->waiting) return;
+	for(mm_queue_t **pp = &queues[game_hash((const uint8_t *)q->game) & (MM_HASH - 1)]; *pp; pp = &(*pp)->hnext){
+		if(*pp != q) continue;
+		*pp = q->hnext;
+		break;
+	}
+	free(q);
+}
+
+static mm_entry_t *entry_find(uint32_t handle){
+	for(mm_entry_t *e = entries[handle_hash(handle)]; e; e = e->hnext)
+		if(e->handle == handle) return e;
+	return NULL;
+}
+
+static void entry_add(mm_queue_t *q, mm_entry_t *e){
+	int b = e->bucket;
+	e->q = q;
+	e->prev = q->tail[b];
+	e->next = NULL;
+	if(q->tail[b]) q->tail[b]->next = e; else q->head[b] = e;
+	q->tail[b] = e;
+	q->count[b]++;
+	q->busy |= 1 << b;
+	if(!q->waiting++){
+		q->wprev = NULL;
+		q->wnext = waiting_head;
+		if(waiting_head) waiting_head->wprev = q;
+		waiting_head = q;
+	}
+	e->hnext = entries[handle_hash(e->handle)];
+	entries[handle_hash(e->handle)] = e;
+}
+
+static void entry_remove(mm_entry_t *e){
+	mm_queue_t *q = e->q;
+	int b = e->bucket;
+	if(e->prev) e->prev->next = e->next; else q->head[b] = e->next;
+	if(e->next) e->next->prev = e->prev; else q->tail[b] = e->prev;
+	if(!--q->count[b]) q->busy &= ~(1 << b);
+	if(!--q->waiting){
+		if(q->wprev) q->wprev->wnext = q->wnext; else waiting_head = q->wnext;
+		if(q->wnext) q->wnext->wprev = q->wprev;
+	}
+	for(mm_entry_t **pp = &entries[handle_hash(e->handle)]; *pp; pp = &(*pp)->hnext){
+		if(*pp != e) continue;
+		*pp = e->hnext;
+		break;
+	}
+	pool_free(&entry_pool, e);
+}
+
+// A free lockstep id whose match will run on this shard, next to the queue
+static int match_id(void){
+	int shards = room_shard_count(), me = room_shard_id();
+	for(int tries = 0; tries < 0x8000; ++tries){
+		uint16_t id = MM_MATCH_FIRST | (next_match++ & 0x7FFF);
+		if(id % shards == me && !lockstep_match_busy(id)) return id;
+	}
+	return -1;
+}
+
+// Seat q->players around bucket <b> within <w> buckets of it, nearest first
+static int seat(mm_queue_t *q, int b, int w){
+	int lo = b - w < 0 ? 0 : b - w, hi = b + w >= MM_BUCKETS ? MM_BUCKETS - 1 : b + w;
+	uint32_t n = 0;
+	for(int k = lo; k <= hi; ++k) n += q->count[k];
+	if(n < q->players) return 0;
+	int id = match_id();
+	if(id < 0) return 0;
+	uint32_t seed;
+	if(getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) seed = room_now_us() * 2654435761u;
+
+	uint8_t msg[9] = { MM_FOUND, id >> 8, id, q->players, 0, seed >> 24, seed >> 16, seed >> 8, seed };
+	int seated = 0;
+	for(int d = 0; seated < q->players; ++d){
+		for(int k = b - d; k <= b + d && seated < q->players; k += d ? 2 * d : 1){
+			if(k < lo || k > hi) continue;
+			while(q->head[k] && seated < q->players){
+				mm_entry_t *e = q->head[k];
+				msg[4] = seated++;
+				send_to(e->handle, msg, sizeof(msg));
+				entry_remove(e);
+			}
+		}
+	}
+	matched++;
+	if(w) widened++;
+	return 1;
+}
+
+// Seat everyone who can be, given how long each bucket's head has waited
+static void queue_match(mm_queue_t *q, uint64_t now){
+	for(int again = 1; again && q->waiting >= q->players;){
+		again = 0;
+		for(uint8_t busy = q->busy; busy; busy &= busy - 1){
+			int b = __builtin_ctz(busy);
+			if(!q->head[b]) continue;	// emptied by a match this pass
+			int w = (now - q->head[b]->since) / MM_WIDEN_US;
+			if(seat(q, b, w)){
+				again = 1;
+				break;
+			}
+		}
+	}
+}
+
+static void cancel(uint32_t handle, int quiet){
+	mm_entry_t *e = entry_find(handle);
+	if(!e) return;
+	mm_queue_t *q = e->q;
+	entry_remove(e);
+	queue_drop(q);
+	if(!quiet){
+		static const uint8_t msg[1] = { MM_CANCELLED };
+		send_to(handle, msg, sizeof(msg));
+	}
+}
+
+// On the queue's shard: [handle u32][rtt u32][message]
+static void mm_op(uint16_t uid, const uint8_t *p, int len){
+	uint32_t handle = (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+	uint32_t rtt = (uint32_t)p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+	const uint8_t *op = p + 8;
+	if(op[0] == MM_CANCEL){
+		cancel(handle, len > 9);	// [0x02][0]: the room's own, nobody to tell
+		return;
+	}
+	cancel(handle, 1);	// queueing again moves the player
+	mm_queue_t *q = op[9] >= 2 && op[9] <= MM_PLAYERS ? queue_get(op + 1, op[9]) : NULL;
+	mm_entry_t *e = q ? pool_alloc(&entry_pool) : NULL;
+	uint8_t msg[2] = { MM_QUEUED, 0xFF };
+	if(!e){
+		if(q) queue_drop(q);
+		send_to(handle, msg, sizeof(msg));
+		return;
+	}
+	uint64_t now = room_now_us();
+	e->handle = handle;
+	e->uid = uid;
+	e->bucket = rtt_bucket(rtt);
+	e->since = now;
+	entry_add(q, e);
+	msg[1] = e->bucket;
+	send_to(handle, msg, sizeof(msg));
+	queue_match(q, now);
+	queue_drop(q);
+}
+
+static int op_len(const uint8_t *p, int len){
+	switch(p[0]){
+	case MM_QUEUE:  return len >= 2 + MM_GAME_LEN ? 2 + MM_GAME_LEN : 0;
+	case MM_CANCEL: return 1;
+	default:        return 0;
+	}
+}
+
+static void route(client_t *c, const uint8_t *op, int len){
+	uint32_t handle = room_session_handle(c);
+	uint8_t rec[8 + 2 + MM_GAME_LEN] = {
+		handle >> 24, handle >> 16, handle >> 8, handle,
+		c->rtt_us >> 24, c->rtt_us >> 16, c->rtt_us >> 8, c->rtt_us,
+	};
+	memcpy(rec + 8, op, len);
+	if(c->mm_home == room_shard_id()) mm_op(c->ident.user_id, rec, 8 + len);
+	else shard_matchmaking(c->mm_home, c->ident.user_id, rec, 8 + len);
+}
+
+void matchmaking_client_data(client_t *c, const uint8_t *data, int len){
+	for(int i = 0, n; i < len; i += n){
+		n = op_len(data + i, len - i);
+		if(!n) return;
+		if(data[i] == MM_QUEUE){
+			int home = game_hash(data + i + 1) % room_shard_count();
+			if(c->mm_queued && c->mm_home != home) route(c, (const uint8_t[]){ MM_CANCEL, 0 }, 2);
+			c->mm_home = home;
+			c->mm_queued = 1;
+		}else if(!c->mm_queued){
+			continue;
+		}else{
+			c->mm_queued = 0;
+		}
+		route(c, data + i, n);
+	}
+}
+
+void matchmaking_forwarded(uint16_t uid, const uint8_t *data, int len){
+	if(len < 9 || op_len(data + 8, len - 8) == 0) return;
+	mm_op(uid, data, len);
+}
+
+void matchmaking_client_closed(client_t *c){
+	if(!c->mm_queued) return;
+	route(c, (const uint8_t[]){ MM_CANCEL, 0 }, 2);
+	c->mm_queued = 0;
+}
+
+void matchmaking_timers(uint64_t now){
+	if(!waiting_head || now < next_tick_us) return;
+	next_tick_us = now + MM_TICK_US;
+	for(mm_queue_t *q = waiting_head, *next; q; q = next){
+		next = q->wnext;	// a match may take the queue off the list
+		queue_match(q, now);
+		queue_drop(q);
+	}
+	if(matched){
+		syslog(LOG_DEBUG, "room: matchmaking seated %u match(es), %u across RTT buckets", matched, widened);
+		matched = widened = 0;
+	}
+}
+
+uint64_t matchmaking_next_us(void){
+	if(!waiting_head) return UINT64_MAX;
+	return next_tick_us;
+}
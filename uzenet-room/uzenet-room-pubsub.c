@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+#include "uzenet-room-server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+// -----------------------------------------------------------------------------
+// Channels
+//
+// A channel is a 16 bit id bound to one tunnel, typically TUNNEL_CHAT or
+// TUNNEL_MATCHMAKING. Services subscribe the user behind a link and publish
+// to a channel over their room link (UTUN_TYPE_SUBSCRIBE/PUBLISH); the frame
+// reaches every subscriber on this shard through the queues described in
+// uzenet-room-pubsub.h, and every other shard through its ring.
+//
+// A subscriber's published frames go out when its tunnel has no service
+// bytes pending, so they never land inside a DATA payload.
+// -----------------------------------------------------------------------------
+
+#define CHANNELS		65536
+#define MSG_SLAB_COUNT		256
+#define SUB_SLAB_COUNT		256
+
+typedef struct{
+	uint16_t id;
+	uint8_t tunnel;
+	uint8_t flags;		// ROOM_CHAN_*
+	room_sub_t **subs;
+	uint32_t count, cap;
+	uint32_t dropped;	// frames lost to full subscriber queues
+} room_channel_t;
+
+struct room_sub_s{
+	room_channel_t *ch;
+	client_t *client;
+	uint32_t slot;		// index in ch->subs
+	room_sub_t *next;	// the client's other subscriptions
+};
+
+static room_channel_t **channels;
+static pool_t msg_pool = { .size = sizeof(pubsub_msg_t), .per_slab = MSG_SLAB_COUNT };
+static pool_t sub_pool = { .size = sizeof(room_sub_t), .per_slab = SUB_SLAB_COUNT };
+
+void pubsub_init(void){
+	channels = calloc(CHANNELS, sizeof(room_channel_t *));
+}
+
+void pubsub_release(pubsub_msg_t *m){
+	if(pubsub_unref(m)) pool_free(&msg_pool, m);
+}
+
+static void channel_drop(room_channel_t *ch){
+	if(ch->dropped)
+		syslog(LOG_INFO, "room: channel %u closed, %u frame(s) dropped for slow subscribers", ch->id, ch->dropped);
+	channels[ch->id] = NULL;
+	free(ch->subs);
+	free(ch);
+}
+
+int room_subscribe(client_t *c, uint16_t channel, int tunnel, int flags){
+	room_channel_t *ch = channels[channel];
+	if(!ch){
+		ch = calloc(1, sizeof(*ch));
+		if(!ch) return -1;
+		ch->id = channel;
+		ch->tunnel = tunnel;
+		channels[channel] = ch;
+	}
+	if(ch->tunnel != tunnel) return -1;
+	ch->flags |= flags;
+	for(room_sub_t *s = c->subs; s; s = s->next)
+		if(s->ch == ch) return 0;
+	if(ch->count == ch->cap){
+		uint32_t cap = ch->cap ? ch->cap * 2 : 8;
+		room_sub_t **subs = realloc(ch->subs, cap * sizeof(room_sub_t *));
+		if(!subs) goto fail;
+		ch->subs = subs;
+		ch->cap = cap;
+	}
+	room_sub_t *s = pool_alloc(&sub_pool);
+	if(!s) goto fail;
+	s->ch = ch;
+	s->client = c;
+	s->slot = ch->count;
+	s->next = c->subs;
+	c->subs = s;
+	ch->subs[ch->count++] = s;
+	return 0;
+fail:
+	if(!ch->count) channel_drop(ch);
+	return -1;
+}
+
+static void sub_remove(room_sub_t *s){
+	room_channel_t *ch = s->ch;
+	room_sub_t *last = ch->subs[--ch->count];
+	ch->subs[s->slot] = last;
+	last->slot = s->slot;
+	pool_free(&sub_pool, s);
+	if(!ch->count) channel_drop(ch);
+}
+
+void room_unsubscribe(client_t *c, uint16_t channel){
+	for(room_sub_t **pp = &c->subs; *pp; pp = &(*pp)->next){
+		room_sub_t *s = *pp;
+		if(s->ch->id != channel) continue;
+		*pp = s->next;
+		sub_remove(s);
+		return;
+	}
+}
+
+// Frames still queued are released too; the tunnels themselves are freed by
+// the caller.
+void pubsub_client_closed(client_t *c){
+	while(c->subs){
+		room_sub_t *s = c->subs;
+		c->subs = s->next;
+		sub_remove(s);
+	}
+	for(int i = 0; i < MAX_SERVICE_TUNNELS; ++i){
+		struct service_tunnel *t = c->tunnels[i];
+		pubsub_msg_t *m;
+		while(t && (m = pubsub_pop(&t->pub))) pubsub_release(m);
+	}
+}
+
+// -----------------------------------------------------------------------------
+// Publishing
+// -----------------------------------------------------------------------------
+
+void pubsub_deliver(uint16_t channel, const uint8_t *data, int len){
+	room_channel_t *ch = channels[channel];
+	if(!ch || len > MAX_FRAME_PAYLOAD) return;
+	pubsub_msg_t *m = pool_alloc(&msg_pool);
+	if(!m) return;
+	m->refs = 1;	// ours until every subscriber has it
+	m->channel = channel;
+	m->size = 2 + len;
+	m->wire[0] = FRAME_TUNNEL_PREFIX | ch->tunnel;
+	m->wire[1] = len;
+	memcpy(m->wire + 2, data, len);
+
+	int coalesce = ch->flags & ROOM_CHAN_COALESCE;
+	for(uint32_t i = 0; i < ch->count; ++i){
+		client_t *c = ch->subs[i]->client;
+		struct service_tunnel *t = room_tunnel(c, ch->tunnel);
+		if(!t) continue;
+		pubsub_msg_t *old = pubsub_push(&t->pub, m, coalesce);
+		if(old){
+			// A coalesced frame was superseded; anything else fell off a full queue
+			if(!coalesce || old->channel != channel){
+				room_channel_t *lost = channels[old->channel];
+				if(lost) lost->dropped++;
+			}
+			pubsub_release(old);
+		}
+		room_client_output(c);
+	}
+	pubsub_release(m);
+}
+
+int room_publish(uint16_t channel, const uint8_t *data, int len){
+	if(len > MAX_FRAME_PAYLOAD) return -1;
+	shard_publish(channel, data, len);
+	pubsub_deliver(channel, data, len);
+	return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Hot restart
+// -----------------------------------------------------------------------------
+
+// [count u8]{channel u16, tunnel u8, flags u8}, then per tunnel with queued
+// frames [tunnel u8][count u8]{channel u16, size u16, wire}, ending in 0xFF
+void pubsub_client_save(client_t *c, handoff_buf_t *b){
+	uint8_t n = 0;
+	for(room_sub_t *s = c->subs; s && n < 255; s = s->next) n++;
+	hbuf_put(b, &n, 1);
+	for(room_sub_t *s = c->subs; s && n; s = s->next, n--){
+		uint8_t rec[4] = { s->ch->id >> 8, s->ch->id, s->ch->tunnel, s->ch->flags };
+		hbuf_put(b, rec, sizeof(rec));
+	}
+	for(int i = 0; i < MAX_SERVICE_TUNNELS; ++i){
+		struct service_tunnel *t = c->tunnels[i];
+		if(!t || !pubsub_queued(&t->pub)) continue;
+		uint8_t hdr[2] = { i, pubsub_queued(&t->pub) };
+		hbuf_put(b, hdr, sizeof(hdr));
+		for(int k = 0; k < hdr[1]; ++k){
+			pubsub_msg_t *m = pubsub_peek(&t->pub, k);
+			hbuf_put(b, &m->channel, sizeof(m->channel));
+			hbuf_put(b, &m->size, sizeof(m->size));
+			hbuf_put(b, m->wire, m->size);
+		}
+	}
+	uint8_t end = 0xFF;
+	hbuf_put(b, &end, 1);
+}
+
+int pubsub_client_restore(client_t *c, handoff_buf_t *b){
+	uint8_t n, rec[4];
+	if(hbuf_get(b, &n, 1) < 0) return -1;
+	while(n--){
+		if(hbuf_get(b, rec, sizeof(rec)) < 0 || rec[2] >= MAX_SERVICE_TUNNELS) return -1;
+		room_subscribe(c, rec[0] << 8 | rec[1], rec[2], rec[3]);
+	}
+	for(;;){
+		uint8_t hdr[2];
+		if(hbuf_get(b, hdr, 1) < 0) return -1;
+		if(hdr[0] == 0xFF) return 0;
+		if(hdr[0] >= MAX_SERVICE_TUNNELS || hbuf_get(b, hdr + 1, 1) < 0) return -1;
+		struct service_tunnel *t = room_tunnel(c, hdr[0]);
+		for(int k = 0; k < hdr[1]; ++k){
+			pubsub_msg_t *m = pool_alloc(&msg_pool);
+			if(!m) return -1;
+			if(hbuf_get(b, &m->channel, sizeof(m->channel)) < 0 || hbuf_get(b, &m->size, sizeof(m->size)) < 0 ||
+			   m->size < 2 || m->size > sizeof(m->wire) || hbuf_get(b, m->wire, m->size) < 0 || !t){
+				pool_free(&msg_pool, m);
+				return -1;
+			}
+			m->refs = 0;
+			pubsub_push(&t->pub, m, 0);
+		}
+	}
+}
@@ -0,0 +1,74 @@
+#ifndef UZENET_ROOM_PUBSUB_H
+#define UZENET_ROOM_PUBSUB_H
+
+/* Fan-out of one published frame to many subscribers.
+ *
+ * A publish encodes the frame once, [0xFx][len] header included, into a
+ * refcounted message. Each subscriber's tunnel holds a short queue of
+ * pointers to such messages, and egress hands the message bytes straight to
+ * writev()/SSL_write(), so a chat line to a thousand players costs one
+ * buffer and a thousand pointer stores.
+ *
+ * Publishers never wait for slow subscribers. When a subscriber's queue is
+ * full the oldest frame is dropped for that subscriber; on a coalescing
+ * channel (lobby state, where only the latest snapshot matters) a new frame
+ * instead replaces the one from the same channel still queued, in place.
+ *
+ * Only the queue logic lives here; channels, subscriptions and the message
+ * pool are in uzenet-room-pubsub.c.
+ */
+
+#include <stdint.h>
+
+#define PUBSUB_QUEUE		64	// frames per subscriber tunnel, power of two <= 128
+
+typedef struct{
+	uint32_t refs;
+	uint16_t channel;
+	uint16_t size;		// wire bytes: [0xFx][len] + payload
+	uint8_t wire[2 + 255];
+} pubsub_msg_t;
+
+typedef struct{
+	pubsub_msg_t *msg[PUBSUB_QUEUE];
+	uint8_t head, tail;	// free running, masked when indexing
+} pubsub_queue_t;
+
+static inline int pubsub_queued(const pubsub_queue_t *q){
+	return (uint8_t)(q->head - q->tail);
+}
+
+// The message <skip> places behind the oldest, NULL past the end
+static inline pubsub_msg_t *pubsub_peek(const pubsub_queue_t *q, int skip){
+	return skip < pubsub_queued(q) ? q->msg[(uint8_t)(q->tail + skip) & (PUBSUB_QUEUE - 1)] : NULL;
+}
+
+// Oldest message, whose reference passes to the caller
+static inline pubsub_msg_t *pubsub_pop(pubsub_queue_t *q){
+	return pubsub_queued(q) ? q->msg[q->tail++ & (PUBSUB_QUEUE - 1)] : NULL;
+}
+
+// Queue a reference to m. Returns the message that had to make room (its
+// reference now belongs to the caller) or NULL.
+static inline pubsub_msg_t *pubsub_push(pubsub_queue_t *q, pubsub_msg_t *m, int coalesce){
+	m->refs++;
+	if(coalesce){
+		for(uint8_t i = q->tail; i != q->head; ++i){
+			pubsub_msg_t **s = &q->msg[i & (PUBSUB_QUEUE - 1)];
+			if((*s)->channel != m->channel) continue;
+			pubsub_msg_t *old = *s;
+			*s = m;
+			return old;
+		}
+	}
+	pubsub_msg_t *old = (pubsub_queued(q) == PUBSUB_QUEUE) ? pubsub_pop(q) : NULL;
+	q->msg[q->head++ & (PUBSUB_QUEUE - 1)] = m;
+	return old;
+}
+
+// Drop one reference; 1 when that was the last and m can be recycled
+static inline int pubsub_unref(pubsub_msg_t *m){
+	return --m->refs == 0;
+}
+
+#endif // UZENET_ROOM_PUBSUB_H
@@ -0,0 +1,155 @@
+/* uzenet-room-ring-bench.c
+ *
+ * Pushes data through one room tunnel queue the way the server does: a
+ * service link appends DATA payloads, flush_tunnels() cuts them into
+ * [0xFx][len][payload] frames of up to 255 bytes for the output buffer.
+ * The old byte-at-a-time queue (kept here verbatim) is compared against
+ * the power-of-two ring in uzenet-room-ring.h, and MB/s per tunnel is
+ * reported for both. No sockets are involved; this isolates queue cost.
+ *
+ *   uzenet-room-ring-bench [--mb 256] [--chunk 200]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "uzenet-room-ring.h"
+
+#define QUEUE_SIZE	4096
+#define MAX_PAYLOAD	255
+#define OUT_SIZE	8192
+
+static long total_mb = 256;
+static int chunk = 200;
+
+static uint8_t out[OUT_SIZE];
+static int out_len;
+static volatile uint8_t sink;
+
+static double now_s(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Stand-in for send_data()/flush_out(): the socket always takes everything
+static void out_drain(){
+	sink ^= out[out_len - 1];
+	out_len = 0;
+}
+
+// -----------------------------------------------------------------------------
+// Old queue (byte at a time, modulo per step, staged through frame[])
+// -----------------------------------------------------------------------------
+
+struct old_tunnel{
+	uint8_t queue[QUEUE_SIZE];
+	int head, tail;
+};
+
+static int old_queue(struct old_tunnel *t, const uint8_t *data, int len){
+	int i;
+	for(i = 0; i < len; ++i){
+		int next = (t->head + 1) % sizeof(t->queue);
+		if(next == t->tail) break;
+		t->queue[t->head] = data[i];
+		t->head = next;
+	}
+	return i;
+}
+
+static void old_flush(struct old_tunnel *t){
+	while(t->tail != t->head){
+		int avail = (t->head - t->tail + sizeof(t->queue)) % sizeof(t->queue);
+		if(avail > MAX_PAYLOAD) avail = MAX_PAYLOAD;
+		if(OUT_SIZE - out_len < avail + 2) out_drain();
+		uint8_t frame[2 + MAX_PAYLOAD];
+		int len = 0;
+		frame[len++] = 0xF5;
+		frame[len++] = 0;
+		int p = t->tail;
+		while(p != t->head && len < avail + 2){
+			frame[len++] = t->queue[p];
+			p = (p + 1) % sizeof(t->queue);
+		}
+		t->tail = p;
+		frame[1] = len - 2;
+		memcpy(out + out_len, frame, len);
+		out_len += len;
+	}
+}
+
+// -----------------------------------------------------------------------------
+// New queue
+// -----------------------------------------------------------------------------
+
+struct new_tunnel{
+	room_ring_t ring;
+	uint8_t queue[QUEUE_SIZE];
+};
+
+static void new_flush(struct new_tunnel *t){
+	uint32_t avail;
+	while((avail = ring_used(&t->ring)) != 0){
+		if(avail > MAX_PAYLOAD) avail = MAX_PAYLOAD;
+		if(OUT_SIZE - out_len < (int)avail + 2) out_drain();
+		struct iovec iov[2];
+		int n = ring_peek(&t->ring, t->queue, QUEUE_SIZE, iov, avail);
+		out[out_len++] = 0xF5;
+		out[out_len++] = (uint8_t)avail;
+		for(int i = 0; i < n; ++i){
+			memcpy(out + out_len, iov[i].iov_base, iov[i].iov_len);
+			out_len += iov[i].iov_len;
+		}
+		ring_consume(&t->ring, avail);
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+static double run(int use_new, const uint8_t *payload){
+	static struct old_tunnel ot;
+	static struct new_tunnel nt;
+	long total = total_mb << 20;
+	long moved = 0;
+	out_len = 0;
+
+	double t0 = now_s();
+	while(moved < total){
+		// Fill the queue as a service link would, then drain it like a wakeup does
+		int taken;
+		do{
+			taken = use_new ? (int)ring_write(&nt.ring, nt.queue, QUEUE_SIZE, payload, chunk)
+			                : old_queue(&ot, payload, chunk);
+			moved += taken;
+		}while(taken == chunk);
+		if(use_new) new_flush(&nt); else old_flush(&ot);
+	}
+	double dt = now_s() - t0;
+	return moved / dt / (1 << 20);
+}
+
+static void usage(const char *prog){
+	fprintf(stderr, "usage: %s [--mb n] [--chunk n]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[]){
+	for(int i = 1; i < argc; ++i){
+		if(strcmp(argv[i], "--mb") == 0 && i + 1 < argc) total_mb = atol(argv[++i]);
+		else if(strcmp(argv[i], "--chunk") == 0 && i + 1 < argc) chunk = atoi(argv[++i]);
+		else usage(argv[0]);
+	}
+	if(total_mb <= 0 || chunk <= 0 || chunk >= QUEUE_SIZE) usage(argv[0]);
+
+	uint8_t *payload = malloc(chunk);
+	for(int i = 0; i < chunk; ++i) payload[i] = (uint8_t)i;
+
+	double old_rate = run(0, payload);
+	double new_rate = run(1, payload);
+	printf("old byte queue: %9.1f MB/s per tunnel\n", old_rate);
+	printf("pow2 SPSC ring: %9.1f MB/s per tunnel (%.1fx)\n", new_rate, new_rate / old_rate);
+	free(payload);
+	return 0;
+}
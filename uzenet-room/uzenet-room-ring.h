@@ -0,0 +1,91 @@
+#ifndef UZENET_ROOM_RING_H
+#define UZENET_ROOM_RING_H
+
+/* Single-producer/single-consumer byte ring.
+ *
+ * head and tail run freely and are masked only when indexing, so a ring of
+ * <size> bytes (a power of two) holds exactly <size> bytes and "used" is a
+ * plain subtraction. Copies in and out are at most two memcpy calls, and
+ * ring_peek() exposes the queued bytes as one or two spans that can be
+ * handed to writev()/SSL_write() without staging them anywhere.
+ *
+ * The producer only stores head and the consumer only stores tail, so the
+ * two sides may live on different threads (or processes, for a ring in
+ * shared memory).
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+
+typedef struct{
+	uint32_t head;		// next byte written, owned by the producer
+	uint32_t tail;		// next byte read, owned by the consumer
+} room_ring_t;
+
+static inline uint32_t ring_used(const room_ring_t *r){
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t ring_space(const room_ring_t *r, uint32_t size){
+	return size - ring_used(r);
+}
+
+// Copy up to len bytes in; returns the number taken.
+static inline uint32_t ring_write(room_ring_t *r, uint8_t *buf, uint32_t size, const void *data, uint32_t len){
+	uint32_t head = r->head;
+	uint32_t space = size - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+	if(len > space) len = space;
+	uint32_t off = head & (size - 1);
+	uint32_t first = size - off;
+	if(first > len) first = len;
+	memcpy(buf + off, data, first);
+	memcpy(buf, (const uint8_t *)data + first, len - first);
+	__atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+	return len;
+}
+
+// Describe up to max queued bytes, starting skip bytes past the tail, as
+// iov[0] and, if they wrap, iov[1]. Returns the number of spans filled (0 when
+// nothing is left). Nothing is released until ring_consume().
+static inline int ring_peek_at(const room_ring_t *r, uint8_t *buf, uint32_t size, struct iovec iov[2], uint32_t skip, uint32_t max){
+	uint32_t tail = r->tail + skip;
+	uint32_t used = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail;
+	if((int32_t)used <= 0) return 0;
+	if(used > max) used = max;
+	if(!used) return 0;
+	uint32_t off = tail & (size - 1);
+	uint32_t first = size - off;
+	iov[0].iov_base = buf + off;
+	if(first >= used){
+		iov[0].iov_len = used;
+		return 1;
+	}
+	iov[0].iov_len = first;
+	iov[1].iov_base = buf;
+	iov[1].iov_len = used - first;
+	return 2;
+}
+
+static inline int ring_peek(const room_ring_t *r, uint8_t *buf, uint32_t size, struct iovec iov[2], uint32_t max){
+	return ring_peek_at(r, buf, size, iov, 0, max);
+}
+
+static inline void ring_consume(room_ring_t *r, uint32_t n){
+	__atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+}
+
+// Copy up to len bytes out; returns the number copied.
+static inline uint32_t ring_read(room_ring_t *r, uint8_t *buf, uint32_t size, void *dst, uint32_t len){
+	struct iovec iov[2];
+	int n = ring_peek(r, buf, size, iov, len);
+	uint32_t got = 0;
+	for(int i = 0; i < n; ++i){
+		memcpy((uint8_t *)dst + got, iov[i].iov_base, iov[i].iov_len);
+		got += iov[i].iov_len;
+	}
+	ring_consume(r, got);
+	return got;
+}
+
+#endif // UZENET_ROOM_RING_H
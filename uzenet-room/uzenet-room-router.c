@@ -0,0 +1,1030 @@
+#define _GNU_SOURCE
+#include "uzenet-room-server.h"
+#include "../uzenet-tunnel/uzenet-tunnel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+
+// -----------------------------------------------------------------------------
+// Service router
+//
+// Tunnel frames from a Uzebox are forwarded to the service that owns the
+// tunnel id over an AF_UNIX connection speaking uzenet-tunnel frames, and
+// DATA frames coming back are queued on the same tunnel toward the Uzebox.
+// A link is one (session, tunnel) pair's route to its service.
+//
+// By default every link has a connection of its own (LOGIN once, then DATA)
+// and the service binds one user per connection; a couple of pre-connected
+// spares per service keep connect() off the login path. A route marked "mux"
+// instead has all of this worker's links share one connection: it opens with
+// MUX, every header carries a session id, and OPEN and CLOSE start and end a
+// session. The service then accepts once per room worker instead of once per
+// user and can serve sessions from a fixed pool of threads.
+//
+// A shared connection marked "shm" as well moves its byte stream into a pair
+// of rings in shared memory once the service answers SHM: frames cross with
+// a memcpy each way, and the eventfd doorbell only rings when the other end
+// sleeps. Per-user connections stay on the socket, they don't live long
+// enough to pay for the mapping. The socket stays to tell us the service
+// went away and to hand over on a hot restart.
+//
+// LOGIN (MUX) also tells the service the largest payload the room takes per
+// frame; a service that wants another size answers with LIMIT, and DATA
+// toward it is cut to that size. The room takes DATA frames of up to
+// UTUN_BULK_PAYLOAD, so bulk services pay one header and one write per
+// 64 KiB rather than per 256 bytes. Their payload is streamed into the
+// tunnel queue as it arrives instead of being held whole, and is cut into
+// 0xF0 frames only on the way to the Uzebox.
+//
+// Both directions are non-blocking. Ingress is written straight from the
+// client's input buffer with writev() and only copied when the socket is
+// full; when even the connection's buffer is full the client stops reading
+// until it drains. Egress stops reading a connection while the tunnel queue
+// of the client its DATA is for is full, which on a multiplexed connection
+// holds up every session on it.
+//
+// Services that speak WINDOW avoid that: every link grants its service the
+// free space of its tunnel queue, topped up as the pacer drains it, so DATA
+// always fits and a slow Uzebox only holds up its own session. A service
+// that grants us windows in turn has each link wait for credit on its own,
+// the client stops reading, rather than the room filling the connection.
+// -----------------------------------------------------------------------------
+
+#define LINK_SPARES		2	// pre-connected direct connections parked per service
+#define LINK_RX_SIZE		4096
+#define LINK_TX_SIZE		4096
+#define CONN_SLAB_COUNT		64
+#define LINK_SLAB_COUNT		256
+#define MUX_SESSIONS		0x10000	// session ids per connection, 0 is not used
+#define SERVICE_RETRY_US	1000000	// back-off after a failed connect
+#define LINK_SEND_FRAMES	((MAX_FRAME_PAYLOAD + UTUN_MIN_PAYLOAD - 1) / UTUN_MIN_PAYLOAD)
+#define LINK_WINDOW_STEP	(TUNNEL_QUEUE_SIZE / 4)	// smallest WINDOW we send once the first is out
+
+typedef struct room_service_s room_service_t;
+typedef struct room_conn_s room_conn_t;
+
+// One AF_UNIX connection to a service
+struct room_conn_s{
+	int ev_kind;		// EV_LINK
+	int fd;
+	room_service_t *svc;
+	int mux;		// shared by sessions, headers carry their id
+	int hdr;		// UTUN_HDR_SIZE or UTUN_MUX_HDR_SIZE
+	UtunShm shm;		// map set once we offered SHM
+	int shm_rx;		// the service's SHM came, it sends through shm now
+	int epollout;
+	int tx_max;		// largest DATA payload the service takes (its LIMIT)
+	int rx_blocked;		// rx_link's tunnel queue full, stop reading
+	room_link_t *rx_link;	// owner of the DATA frame being streamed, NULL: dropped
+	int rx_data;		// payload still to come of that frame
+	uint8_t rx[LINK_RX_SIZE];
+	int rx_len;
+	uint8_t tx[LINK_TX_SIZE];	// only used once the socket would block
+	int tx_off, tx_len;
+	room_link_t *tx_wait;	// links whose client stopped reading on a full tx
+	room_link_t *link;	// direct: its link, NULL while parked as a spare
+	room_link_t **sessions;	// mux: by session id, &closing_link until CLOSE is out
+	int num_sessions, closing, next_sid;
+	int handed;		// given to a new process, see "Hot restart"
+	room_conn_t *next;	// spare list
+};
+
+struct room_link_s{
+	room_conn_t *conn;
+	client_t *client;	// NULL: came with a handed-over connection, not claimed yet
+	int tunnel;
+	uint16_t sid;		// session id on a multiplexed connection
+	uint8_t opened;		// LOGIN / OPEN went out
+	uint8_t waiting;	// on conn->tx_wait
+	uint8_t tx_flow;	// the service sent WINDOW: DATA toward it takes tx_credit
+	uint8_t credited;	// on credited, for router_flush()
+	uint32_t tx_credit;	// DATA the service still takes from us
+	uint32_t rx_window;	// DATA we still take from the service
+	room_link_t *wait_next;
+	room_link_t *credit_next;
+};
+
+struct room_service_s{
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	int mux;		// route marked "mux"
+	int shm;		// and "shm"
+	room_conn_t *shared;	// mux: this worker's connection, opened with the first session
+	room_conn_t *spares;
+	int num_spares;
+	uint64_t retry_after;
+	int down;
+};
+
+static room_service_t services[MAX_SERVICE_TUNNELS];	// indexed by tunnel id, empty path = no route
+static pool_t conn_pool = { .size = sizeof(room_conn_t), .per_slab = CONN_SLAB_COUNT };
+static pool_t link_pool = { .size = sizeof(room_link_t), .per_slab = LINK_SLAB_COUNT };
+static room_link_t closing_link;	// session slot whose CLOSE found the connection full
+static room_conn_t *handed[MAX_SERVICE_TUNNELS];	// old process, until router_handoff_done()
+static room_link_t *credited;	// waited for credit and got some in this batch
+
+// Radio still speaks its line protocol on the socket, so it is not routed by
+// default; add "1 /run/uzenet/radio.sock" to the routes file once it unwraps frames.
+static const struct{
+	int tunnel;
+	const char *path;
+	int mux, shm;
+} default_routes[] = {
+	{ TUNNEL_FATFS,     "/run/uzenet/fatfs.sock",           0, 0 },
+	{ TUNNEL_LICHESS,   "/run/uzenet/lichess.sock",         0, 0 },
+	{ TUNNEL_ZIPSTREAM, "/run/uzenet/zipstream.sock",       0, 0 },
+	{ TUNNEL_SSH,       "/run/uzenet/ssh.sock",             0, 0 },
+	{ TUNNEL_FUJINET,   "/run/uzenet/virtual-fujinet.sock", 1, 1 },
+};
+
+// -----------------------------------------------------------------------------
+// Connections
+// -----------------------------------------------------------------------------
+
+static int conn_read(room_conn_t *k);
+
+static void conn_update_events(room_conn_t *k){
+	int want = k->tx_len > k->tx_off;
+	if(want == k->epollout || k->shm.map) return;	// shm: the doorbell says when
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLET | (want ? EPOLLOUT : 0), .data.ptr = k };
+	epoll_ctl(room_epfd, EPOLL_CTL_MOD, k->fd, &ev);
+	k->epollout = want;
+}
+
+static void link_unwait(room_link_t *l){
+	if(!l->waiting) return;
+	room_link_t **pp = &l->conn->tx_wait;
+	while(*pp != l) pp = &(*pp)->wait_next;
+	*pp = l->wait_next;
+	l->waiting = 0;
+}
+
+static void link_uncredit(room_link_t *l){
+	if(!l->credited) return;
+	room_link_t **pp = &credited;
+	while(*pp != l) pp = &(*pp)->credit_next;
+	*pp = l->credit_next;
+	l->credited = 0;
+}
+
+// Forget a link on the room's side; telling the service is up to the caller.
+// Freed after the batch, so a waiter list being walked stays intact.
+static void link_free(room_link_t *l){
+	room_conn_t *k = l->conn;
+	link_unwait(l);
+	link_uncredit(l);
+	if(l->client) l->client->links[l->tunnel] = NULL;
+	if(k->rx_link == l){
+		k->rx_link = NULL;	// the rest of its DATA is dropped
+		k->rx_blocked = 0;
+	}
+	room_defer_free(&link_pool, l);
+}
+
+static int link_grant(room_link_t *l);
+
+// Clients that stopped reading on a full connection: let them go on, which
+// may close them, or the connection. A WINDOW that found it full goes first.
+static void resume_waiters(room_link_t *w){
+	while(w){
+		room_link_t *next = w->wait_next;
+		if(w->client){
+			if(w->client->links[w->tunnel] == w) link_grant(w);
+			room_client_resume(w->client);
+		}
+		w = next;
+	}
+}
+
+static void conn_close(room_conn_t *k){
+	room_service_t *svc = k->svc;
+	room_link_t *waiters = k->tx_wait;
+	k->tx_wait = NULL;
+	for(room_link_t *w = waiters; w; w = w->wait_next) w->waiting = 0;
+
+	if(k->mux){
+		if(svc->shared == k) svc->shared = NULL;
+		for(int sid = 1; k->sessions && k->num_sessions && sid < MUX_SESSIONS; ++sid){
+			room_link_t *l = k->sessions[sid];
+			if(!l || l == &closing_link) continue;
+			link_free(l);	// service sees EOF: every user on it gone
+			k->num_sessions--;
+		}
+		free(k->sessions);
+		k->sessions = NULL;
+	}else if(k->link){
+		link_free(k->link);
+	}else{
+		room_conn_t **pp = &svc->spares;
+		while(*pp && *pp != k) pp = &(*pp)->next;
+		if(*pp){
+			*pp = k->next;
+			svc->num_spares--;
+		}
+	}
+	if(k->shm.map){
+		epoll_ctl(room_epfd, EPOLL_CTL_DEL, k->shm.rx_efd, NULL);
+		utun_shm_close(&k->shm);
+	}
+	epoll_ctl(room_epfd, EPOLL_CTL_DEL, k->fd, NULL);
+	close(k->fd);
+	k->ev_kind = EV_DEAD;
+	room_defer_free(&conn_pool, k);
+	resume_waiters(waiters);	// they open a new link on their next frame
+}
+
+// The socket, or the rings: tx from our SHM on, rx from the service's. Like
+// the socket they fail with EAGAIN when full or empty.
+static ssize_t conn_writev(room_conn_t *k, const struct iovec *iov, int cnt){
+	if(!k->shm.map) return writev(k->fd, iov, cnt);
+	size_t w = utun_shm_write(&k->shm, iov, cnt);
+	if(w) return w;
+	errno = EAGAIN;
+	return -1;
+}
+
+static ssize_t conn_recv(room_conn_t *k, void *buf, size_t len){
+	if(!k->shm_rx) return read(k->fd, buf, len);
+	size_t r = utun_shm_read(&k->shm, buf, len);
+	if(r) return r;
+	errno = EAGAIN;
+	return -1;
+}
+
+// Returns 0 when the frame was taken, -1 when the connection is congested
+// and -2 when it is broken. DATA is cut to the service's LIMIT; all of it is
+// taken or none.
+static int conn_send(room_conn_t *k, uint16_t sid, uint8_t type, const uint8_t *data, int len){
+	uint8_t hdr[LINK_SEND_FRAMES][UTUN_MUX_HDR_SIZE];
+	struct iovec iov[LINK_SEND_FRAMES * 2];
+	int chunk = type == UTUN_TYPE_DATA ? k->tx_max : len;
+	int cnt = 0, total = 0;
+
+	for(int i = 0, off = 0; i < LINK_SEND_FRAMES; ++i){
+		int n = len - off < chunk ? len - off : chunk;
+		hdr[i][0] = type;
+		hdr[i][1] = 0;
+		hdr[i][2] = (uint8_t)(n >> 8);
+		hdr[i][3] = (uint8_t)n;
+		hdr[i][4] = (uint8_t)(sid >> 8);
+		hdr[i][5] = (uint8_t)sid;
+		iov[cnt++] = (struct iovec){ .iov_base = hdr[i], .iov_len = k->hdr };
+		if(n) iov[cnt++] = (struct iovec){ .iov_base = (void *)(data + off), .iov_len = n };
+		total += k->hdr + n;
+		off += n;
+		if(off == len) break;
+	}
+
+	ssize_t w = 0;
+	if(k->tx_off == k->tx_len){
+		// Nothing queued: write straight from the caller's buffer
+		do{
+			w = conn_writev(k, iov, cnt);
+		}while(w < 0 && errno == EINTR);
+		if(w < 0){
+			if(errno != EAGAIN && errno != EWOULDBLOCK) return -2;
+			w = 0;
+		}
+		if(w == total) return 0;
+		k->tx_off = k->tx_len = 0;
+	}else{
+		if(LINK_TX_SIZE - k->tx_len < total && k->tx_off > 0){
+			memmove(k->tx, k->tx + k->tx_off, k->tx_len - k->tx_off);
+			k->tx_len -= k->tx_off;
+			k->tx_off = 0;
+		}
+		if(LINK_TX_SIZE - k->tx_len < total) return -1;
+	}
+	// Keep whatever the socket didn't take
+	for(int i = 0; i < cnt; ++i){
+		size_t n = iov[i].iov_len;
+		if((size_t)w >= n){
+			w -= n;
+			continue;
+		}
+		memcpy(k->tx + k->tx_len, (uint8_t *)iov[i].iov_base + w, n - w);
+		k->tx_len += n - w;
+		w = 0;
+	}
+	conn_update_events(k);
+	return 0;
+}
+
+static int conn_flush_tx(room_conn_t *k){
+	while(k->tx_off < k->tx_len){
+		struct iovec iov = { .iov_base = k->tx + k->tx_off, .iov_len = k->tx_len - k->tx_off };
+		ssize_t w = conn_writev(k, &iov, 1);
+		if(w < 0){
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return -1;
+		}
+		k->tx_off += w;
+	}
+	if(k->tx_off == k->tx_len) k->tx_off = k->tx_len = 0;
+	conn_update_events(k);
+	return 0;
+}
+
+// Send the CLOSEs that found tx full, until it fills up again
+static int conn_flush_closing(room_conn_t *k){
+	for(int sid = 1; k->closing && sid < MUX_SESSIONS; ++sid){
+		if(k->sessions[sid] != &closing_link) continue;
+		int r = conn_send(k, sid, UTUN_TYPE_CLOSE, NULL, 0);
+		if(r == -2) return -1;
+		if(r == -1) return 0;
+		k->sessions[sid] = NULL;
+		k->closing--;
+	}
+	return 0;
+}
+
+// Our last frame on the socket: SHM with the memfd and doorbells attached.
+// Without shared memory the connection just stays on the socket.
+static int conn_offer_shm(room_conn_t *k){
+	if(utun_shm_create(&k->shm, UTUN_SHM_RING_SIZE) < 0){
+		syslog(LOG_WARNING, "room: %s: no shared memory (%s), staying on the socket", k->svc->path, strerror(errno));
+		return 0;
+	}
+	uint8_t hdr[UTUN_MUX_HDR_SIZE] = { UTUN_TYPE_SHM };
+	struct iovec iov = { .iov_base = hdr, .iov_len = sizeof(hdr) };
+	union{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * UTUN_SHM_FDS)];
+	} cm;
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cm.buf, .msg_controllen = sizeof(cm.buf) };
+	struct cmsghdr *h = CMSG_FIRSTHDR(&msg);
+	h->cmsg_level = SOL_SOCKET;
+	h->cmsg_type = SCM_RIGHTS;
+	h->cmsg_len = CMSG_LEN(sizeof(int) * UTUN_SHM_FDS);
+	memcpy(CMSG_DATA(h), k->shm.fds, sizeof(int) * UTUN_SHM_FDS);
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = k };
+	if(epoll_ctl(room_epfd, EPOLL_CTL_ADD, k->shm.rx_efd, &ev) < 0){
+		utun_shm_close(&k->shm);
+		return 0;
+	}
+	return sendmsg(k->fd, &msg, MSG_NOSIGNAL) == sizeof(hdr) ? 0 : -1;
+}
+
+static room_conn_t *conn_connect(room_service_t *svc){
+	uint64_t now = room_now_us();
+	if(now < svc->retry_after) return NULL;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0) return NULL;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	memcpy(addr.sun_path, svc->path, sizeof(addr.sun_path));
+	// AF_UNIX connect completes immediately or fails (EAGAIN: backlog full)
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0){
+		if(!svc->down)
+			syslog(LOG_WARNING, "room: service %s unavailable: %s", svc->path, strerror(errno));
+		svc->down = 1;
+		svc->retry_after = now + SERVICE_RETRY_US;
+		close(fd);
+		return NULL;
+	}
+	if(svc->down){
+		syslog(LOG_INFO, "room: service %s reachable again", svc->path);
+		svc->down = 0;
+	}
+
+	room_conn_t *k = pool_alloc(&conn_pool);
+	if(!k){
+		close(fd);
+		return NULL;
+	}
+	k->ev_kind = EV_LINK;
+	k->fd = fd;
+	k->svc = svc;
+	k->hdr = UTUN_HDR_SIZE;
+	k->tx_max = UTUN_MAX_PAYLOAD;
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = k };
+	if(epoll_ctl(room_epfd, EPOLL_CTL_ADD, fd, &ev) < 0){
+		close(fd);
+		pool_free(&conn_pool, k);
+		return NULL;
+	}
+	if(svc->mux){
+		// A fresh socket takes it whole or is broken
+		static const uint8_t hello[2] = { UTUN_BULK_PAYLOAD >> 8, UTUN_BULK_PAYLOAD & 0xFF };
+		if(conn_send(k, 0, UTUN_TYPE_MUX, hello, sizeof(hello)) < 0){
+			conn_close(k);
+			return NULL;
+		}
+		k->mux = 1;
+		k->hdr = UTUN_MUX_HDR_SIZE;
+		if(svc->shm && conn_offer_shm(k) < 0){
+			conn_close(k);
+			return NULL;
+		}
+		svc->shared = k;
+	}
+	return k;
+}
+
+static void fill_spares(room_service_t *svc){
+	while(!svc->mux && svc->num_spares < LINK_SPARES){
+		room_conn_t *k = conn_connect(svc);
+		if(!k) return;
+		k->next = svc->spares;
+		svc->spares = k;
+		svc->num_spares++;
+	}
+}
+
+static room_conn_t *conn_take(room_service_t *svc){
+	if(svc->mux) return svc->shared ? svc->shared : conn_connect(svc);
+	room_conn_t *k = svc->spares;
+	if(k){
+		svc->spares = k->next;
+		svc->num_spares--;
+		k->next = NULL;
+	}else{
+		k = conn_connect(svc);
+	}
+	fill_spares(svc);
+	return k;
+}
+
+// -----------------------------------------------------------------------------
+// Links
+// -----------------------------------------------------------------------------
+
+static int session_alloc(room_conn_t *k, room_link_t *l){
+	// calloc'd pages stay untouched until their ids are in use
+	if(!k->sessions && !(k->sessions = calloc(MUX_SESSIONS, sizeof(*k->sessions)))) return -1;
+	if(k->num_sessions + k->closing >= MUX_SESSIONS - 1) return -1;
+	int sid = k->next_sid;
+	while(!sid || k->sessions[sid]) sid = (sid + 1) & (MUX_SESSIONS - 1);
+	k->sessions[sid] = l;
+	k->num_sessions++;
+	k->next_sid = (sid + 1) & (MUX_SESSIONS - 1);	// don't hand a fresh id straight back
+	l->sid = sid;
+	return 0;
+}
+
+static room_link_t *link_open(client_t *c, int tunnel){
+	room_service_t *svc = &services[tunnel];
+	room_conn_t *k = conn_take(svc);
+	if(!k) return NULL;
+	room_link_t *l = pool_alloc(&link_pool);
+	if(!l || (k->mux && session_alloc(k, l) < 0)){
+		if(l) pool_free(&link_pool, l);
+		if(!k->mux) conn_close(k);
+		return NULL;
+	}
+	l->conn = k;
+	l->client = c;
+	l->tunnel = tunnel;
+	if(!k->mux) k->link = l;
+	c->links[tunnel] = l;
+	return l;
+}
+
+// LOGIN on a connection of its own, OPEN on a shared one; returns as conn_send()
+static int link_login(room_link_t *l){
+	uint16_t uid = l->client->ident.user_id;
+	int r;
+	if(l->conn->mux){
+		uint8_t open[2] = { (uint8_t)(uid >> 8), (uint8_t)uid };
+		r = conn_send(l->conn, l->sid, UTUN_TYPE_OPEN, open, sizeof(open));
+	}else{
+		uint8_t meta[UTUN_LOGIN_SIZE] = { (uint8_t)(uid >> 8), (uint8_t)uid, UTUN_BULK_PAYLOAD >> 8, UTUN_BULK_PAYLOAD & 0xFF };
+		r = conn_send(l->conn, 0, UTUN_TYPE_LOGIN, meta, sizeof(meta));
+	}
+	if(r == 0){
+		l->opened = 1;
+		link_grant(l);
+	}
+	return r;
+}
+
+static void link_wait(room_link_t *l){
+	if(l->waiting) return;
+	l->waiting = 1;
+	l->wait_next = l->conn->tx_wait;
+	l->conn->tx_wait = l;
+}
+
+// Top the service's window on the link back up to the free space in its
+// tunnel queue, in steps so a stream doesn't cost a WINDOW per 0xF0 frame.
+// One that finds tx full goes out when it drains. Returns as conn_send().
+static int link_grant(room_link_t *l){
+	uint32_t space = room_tunnel_space(l->client, l->tunnel);
+	if(!l->opened || l->conn->handed || space < l->rx_window + LINK_WINDOW_STEP) return 0;
+	uint32_t add = space - l->rx_window;
+	uint8_t p[4] = { (uint8_t)(add >> 24), (uint8_t)(add >> 16), (uint8_t)(add >> 8), (uint8_t)add };
+	int r = conn_send(l->conn, l->sid, UTUN_TYPE_WINDOW, p, sizeof(p));
+	if(r == 0) l->rx_window = space;
+	if(r == -1) link_wait(l);
+	return r;
+}
+
+// The room is done with the link: its own connection closes, a session on a
+// shared one gets a CLOSE
+static void link_close(room_link_t *l){
+	room_conn_t *k = l->conn;
+	if(!k->mux){
+		link_unwait(l);	// its client is going, don't resume it
+		conn_close(k);
+		return;
+	}
+	int r = 0, resume = k->rx_blocked && k->rx_link == l;
+	k->sessions[l->sid] = NULL;
+	k->num_sessions--;
+	if(l->opened && !k->handed){
+		r = conn_send(k, l->sid, UTUN_TYPE_CLOSE, NULL, 0);
+		if(r == -1){
+			k->sessions[l->sid] = &closing_link;
+			k->closing++;
+		}
+	}
+	link_free(l);
+	if(k->handed) return;
+	if(r == -2 || (resume && conn_read(k) < 0)) conn_close(k);
+}
+
+// The link DATA (or a control frame) with header h is for; NULL if its
+// session is gone
+static room_link_t *conn_link(room_conn_t *k, const uint8_t *h){
+	if(!k->mux) return k->link;
+	room_link_t *l = k->sessions ? k->sessions[h[4] << 8 | h[5]] : NULL;
+	return l == &closing_link || (l && !l->client) ? NULL : l;
+}
+
+// Parse buffered frames into the clients' tunnel queues, then read more until
+// the socket is drained or a queue is full. Returns -1 if the connection died.
+static int conn_read(room_conn_t *k){
+	for(;;){
+		int off = 0;
+		while(k->rx_len > off){
+			if(k->rx_data){
+				// DATA payload goes out as it comes; the tunnel is a byte stream
+				room_link_t *l = k->rx_link;
+				int n = k->rx_len - off;
+				if(n > k->rx_data) n = k->rx_data;
+				if(l){
+					int space = room_tunnel_space(l->client, l->tunnel);
+					if(n > space) n = space;
+					if(!n){
+						k->rx_blocked = 1;
+						break;
+					}
+					room_queue_tunnel(l->client, l->tunnel, k->rx + off, n);
+					room_client_output(l->client);
+				}
+				k->rx_data -= n;
+				off += n;
+				continue;
+			}
+			if(k->rx_len - off < k->hdr) break;
+			uint8_t *h = k->rx + off;
+			int len = (h[2] << 8) | h[3];
+			room_link_t *l = conn_link(k, h);
+			if(h[0] == UTUN_TYPE_DATA){
+				k->rx_link = l;
+				k->rx_data = len;
+				if(l) l->rx_window -= (uint32_t)len < l->rx_window ? (uint32_t)len : l->rx_window;
+				off += k->hdr;
+				continue;
+			}
+			if(len > LINK_RX_SIZE - k->hdr){
+				syslog(LOG_WARNING, "room: oversized frame (%d) from %s", len, k->svc->path);
+				return -1;
+			}
+			if(k->rx_len - off < k->hdr + len) break;
+			uint8_t *p = h + k->hdr;
+			if(h[0] == UTUN_TYPE_PING){
+				conn_send(k, k->mux ? h[4] << 8 | h[5] : 0, UTUN_TYPE_PONG, NULL, 0);
+			}else if(h[0] == UTUN_TYPE_LIMIT && len >= 2){
+				int max = p[0] << 8 | p[1];
+				k->tx_max = max < UTUN_MIN_PAYLOAD ? UTUN_MIN_PAYLOAD : max;
+			}else if(h[0] == UTUN_TYPE_PUBLISH && len >= 2){
+				room_publish(p[0] << 8 | p[1], p + 2, len - 2);
+			}else if(h[0] == UTUN_TYPE_SHM && k->shm.map && !k->shm_rx){
+				// The service's last frame on the socket, which from now on
+				// only tells us when it closes
+				struct epoll_event ev = { .events = EPOLLRDHUP | EPOLLET, .data.ptr = k };
+				epoll_ctl(room_epfd, EPOLL_CTL_MOD, k->fd, &ev);
+				k->shm_rx = 1;
+			}else if(h[0] == UTUN_TYPE_CLOSE && k->mux){
+				// The service ended the session; the client's next frame opens another
+				int sid = h[4] << 8 | h[5];
+				room_link_t *s = k->sessions ? k->sessions[sid] : NULL;
+				if(s == &closing_link){
+					k->sessions[sid] = NULL;
+					k->closing--;
+				}else if(s){
+					k->sessions[sid] = NULL;
+					k->num_sessions--;
+					link_free(s);
+				}
+			}else if(!l){
+				// session gone
+			}else if(h[0] == UTUN_TYPE_SUBSCRIBE && len >= 2){
+				if(room_subscribe(l->client, p[0] << 8 | p[1], l->tunnel, len > 2 ? p[2] : 0) < 0)
+					syslog(LOG_WARNING, "room: %s: cannot subscribe to channel %u", k->svc->path, p[0] << 8 | p[1]);
+			}else if(h[0] == UTUN_TYPE_UNSUBSCRIBE && len >= 2){
+				room_unsubscribe(l->client, p[0] << 8 | p[1]);
+			}else if(h[0] == UTUN_TYPE_WINDOW && len >= 4){
+				// The client may be waiting for it; it goes on after the batch,
+				// not in the middle of this read
+				l->tx_credit += (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+				l->tx_flow = 1;
+				if(l->waiting && !l->credited){
+					link_unwait(l);
+					l->credited = 1;
+					l->credit_next = credited;
+					credited = l;
+				}
+			}
+			off += k->hdr + len;
+		}
+		if(off){
+			memmove(k->rx, k->rx + off, k->rx_len - off);
+			k->rx_len -= off;
+		}
+		if(k->rx_blocked) return 0;
+
+		ssize_t r = conn_recv(k, k->rx + k->rx_len, LINK_RX_SIZE - k->rx_len);
+		if(r > 0){
+			k->rx_len += r;
+			continue;
+		}
+		if(r == 0) return -1;
+		if(errno == EINTR) continue;
+		if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+		return -1;
+	}
+}
+
+void router_event(void *conn, uint32_t events){
+	room_conn_t *k = conn;
+
+	if(!k->mux && !k->link){
+		// A spare only hears from its service when the service goes away
+		conn_close(k);
+		return;
+	}
+	if(k->shm.map){
+		// One doorbell for both rings; the socket only hangs up
+		uint64_t rings;
+		if(k->shm_rx && (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))){
+			conn_close(k);
+			return;
+		}
+		ssize_t r = read(k->shm.rx_efd, &rings, sizeof(rings));
+		(void)r;
+		events |= EPOLLIN | EPOLLOUT;
+	}
+	if(events & EPOLLOUT){
+		if(conn_flush_tx(k) < 0 || (k->closing && conn_flush_closing(k) < 0)){
+			conn_close(k);
+			return;
+		}
+		if(k->tx_off == k->tx_len && k->tx_wait){
+			room_link_t *w = k->tx_wait;
+			k->tx_wait = NULL;
+			for(room_link_t *n = w; n; n = n->wait_next) n->waiting = 0;
+			resume_waiters(w);
+			if(k->ev_kind == EV_DEAD) return;
+		}
+	}
+	if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+		if(conn_read(k) < 0) conn_close(k);
+	}
+}
+
+void router_tunnel_drained(client_t *c, int tunnel){
+	room_link_t *l = c->links[tunnel];
+	if(!l || l->conn->handed) return;
+	room_conn_t *k = l->conn;
+	int r = link_grant(l);
+	if(r != -2 && (!k->rx_blocked || k->rx_link != l)) return;
+	k->rx_blocked = 0;
+	// The caller is mid-flush and will pick up whatever we queue
+	if(r == -2 || conn_read(k) < 0) conn_close(k);
+}
+
+void router_flush(void){
+	while(credited){
+		room_link_t *l = credited;
+		credited = l->credit_next;
+		l->credited = 0;
+		link_grant(l);	// it may have been waiting to send one
+		room_client_resume(l->client);
+	}
+}
+
+void router_client_closed(client_t *c){
+	for(int i = 0; i < MAX_SERVICE_TUNNELS; ++i)
+		if(c->links[i]) link_close(c->links[i]);	// service sees EOF or CLOSE: user gone
+}
+
+int dispatch_tunnel_data(client_t *c, int tunnel_id, const uint8_t *data, int len){
+	if(!services[tunnel_id].path[0]) return 0;	// no route: drop
+
+	room_link_t *l = c->links[tunnel_id];
+	if(!l && !(l = link_open(c, tunnel_id))) return 0;	// service down: drop, like a lost UART byte
+
+	room_conn_t *k = l->conn;
+	int r = l->opened ? 0 : link_login(l);
+	if(r == 0 && l->tx_flow && l->tx_credit < (uint32_t)len) r = -1;	// only this user waits
+	if(r == 0) r = conn_send(k, l->sid, UTUN_TYPE_DATA, data, len);
+	if(r == 0 && l->tx_flow) l->tx_credit -= len;
+	if(r == -2){
+		conn_close(k);
+		return 0;
+	}
+	if(r == -1) link_wait(l);
+	return r;
+}
+
+// -----------------------------------------------------------------------------
+// Hot restart
+//
+// A connection of its own goes with its client. A shared one goes first, in
+// a record of its own with the ids of every session on it; client records
+// then name their session, and the new process closes whatever nobody
+// claimed, such as the sessions of TLS clients left behind. The old process
+// stops reading a shared connection once it is handed over and reconnects
+// if those clients need the service again.
+// -----------------------------------------------------------------------------
+
+// [tx_max][rx_data][rx_len][rx][tx_len][tx]
+static void conn_save(room_conn_t *k, handoff_buf_t *b){
+	uint16_t tx_max = k->tx_max, rx_data = k->rx_data, rx_len = k->rx_len, tx_len = k->tx_len - k->tx_off;
+	hbuf_put(b, &tx_max, sizeof(tx_max));
+	hbuf_put(b, &rx_data, sizeof(rx_data));
+	hbuf_put(b, &rx_len, sizeof(rx_len));
+	hbuf_put(b, k->rx, rx_len);
+	hbuf_put(b, &tx_len, sizeof(tx_len));
+	hbuf_put(b, k->tx + k->tx_off, tx_len);
+}
+
+// [opened][tx_flow][tx_credit][rx_window]
+static void link_save(room_link_t *l, handoff_buf_t *b){
+	hbuf_put(b, &l->opened, sizeof(l->opened));
+	hbuf_put(b, &l->tx_flow, sizeof(l->tx_flow));
+	hbuf_put(b, &l->tx_credit, sizeof(l->tx_credit));
+	hbuf_put(b, &l->rx_window, sizeof(l->rx_window));
+}
+
+static int link_restore(room_link_t *l, handoff_buf_t *b){
+	if(hbuf_get(b, &l->opened, sizeof(l->opened)) < 0 || hbuf_get(b, &l->tx_flow, sizeof(l->tx_flow)) < 0 ||
+	   hbuf_get(b, &l->tx_credit, sizeof(l->tx_credit)) < 0 || hbuf_get(b, &l->rx_window, sizeof(l->rx_window)) < 0)
+		return -1;
+	return 0;
+}
+
+static int conn_restore(room_conn_t *k, handoff_buf_t *b){
+	uint16_t tx_max, rx_data, rx_len, tx_len;
+	if(hbuf_get(b, &tx_max, sizeof(tx_max)) < 0 || hbuf_get(b, &rx_data, sizeof(rx_data)) < 0 ||
+	   hbuf_get(b, &rx_len, sizeof(rx_len)) < 0 || rx_len > LINK_RX_SIZE || hbuf_get(b, k->rx, rx_len) < 0 ||
+	   hbuf_get(b, &tx_len, sizeof(tx_len)) < 0 || tx_len > LINK_TX_SIZE || hbuf_get(b, k->tx, tx_len) < 0)
+		return -1;
+	k->tx_max = tx_max;
+	k->rx_data = rx_data;
+	k->rx_len = rx_len;
+	k->tx_len = tx_len;
+	return 0;
+}
+
+int router_link_muxed(client_t *c, int tunnel){
+	return c->links[tunnel] && c->links[tunnel]->conn->mux;
+}
+
+// Appends the link on <tunnel> and hands back the fd of its own connection,
+// or -1 for a session on a shared one, which only needs its id. The service
+// keeps the same connection, so it never sees the restart.
+int router_link_save(client_t *c, int tunnel, handoff_buf_t *b, int *fd){
+	room_link_t *l = c->links[tunnel];
+	if(!l) return -1;
+	if(l->conn->mux){
+		hbuf_put(b, &l->sid, sizeof(l->sid));
+		link_save(l, b);
+		*fd = -1;
+		return 0;
+	}
+	conn_save(l->conn, b);
+	link_save(l, b);
+	*fd = l->conn->fd;
+	return 0;
+}
+
+int router_link_restore(client_t *c, int tunnel, int fd, handoff_buf_t *b){
+	room_link_t *l;
+	if(fd < 0){
+		room_conn_t *k = services[tunnel].shared;
+		uint16_t sid;
+		if(hbuf_get(b, &sid, sizeof(sid)) < 0 || !k || !k->sessions ||
+		   !(l = k->sessions[sid]) || l == &closing_link || l->client || link_restore(l, b) < 0)
+			return -1;
+		l->client = c;
+		l->tunnel = tunnel;
+		c->links[tunnel] = l;
+		return 0;	// the connection starts in router_takeover_done()
+	}
+
+	room_conn_t *k = pool_alloc(&conn_pool);
+	if(!k) return -1;
+	if(!(l = pool_alloc(&link_pool))){
+		pool_free(&conn_pool, k);
+		return -1;
+	}
+	k->ev_kind = EV_LINK;
+	k->fd = fd;
+	k->svc = &services[tunnel];
+	k->hdr = UTUN_HDR_SIZE;
+	k->link = l;
+	k->rx_link = l;
+	l->conn = k;
+	l->client = c;
+	l->tunnel = tunnel;
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = k };
+	if(conn_restore(k, b) < 0 || link_restore(l, b) < 0 || epoll_ctl(room_epfd, EPOLL_CTL_ADD, fd, &ev) < 0){
+		pool_free(&link_pool, l);
+		pool_free(&conn_pool, k);
+		return -1;
+	}
+	c->links[tunnel] = l;
+	// Anything the old process had buffered or the socket still holds
+	if(conn_flush_tx(k) < 0 || conn_read(k) < 0) conn_close(k);
+	return 0;
+}
+
+// Old process: [tunnel][conn][shm rx][rx sid][count][sid...] for this
+// worker's shared connection on <tunnel>, if there is one. Hands back the
+// socket and, on shared memory, its fds; returns how many.
+int router_mux_save(int tunnel, handoff_buf_t *b, int *fds){
+	room_conn_t *k = services[tunnel].shared;
+	if(!k) return -1;
+	uint8_t t = tunnel, shm_rx = k->shm_rx;
+	uint16_t rx_sid = k->rx_link ? k->rx_link->sid : 0, count = k->num_sessions + k->closing;
+	b->len = 0;
+	hbuf_put(b, &t, sizeof(t));
+	conn_save(k, b);
+	hbuf_put(b, &shm_rx, sizeof(shm_rx));
+	hbuf_put(b, &rx_sid, sizeof(rx_sid));
+	hbuf_put(b, &count, sizeof(count));
+	for(int sid = 1; k->sessions && sid < MUX_SESSIONS; ++sid){
+		uint16_t s = sid;
+		if(k->sessions[sid]) hbuf_put(b, &s, sizeof(s));
+	}
+	fds[0] = k->fd;
+	if(!k->shm.map) return 1;
+	memcpy(fds + 1, k->shm.fds, sizeof(k->shm.fds));
+	return 1 + UTUN_SHM_FDS;
+}
+
+// The shared connection on <tunnel> is the new process's now: never touch
+// the socket again. Its links go as their clients are handed over.
+void router_mux_handed(int tunnel){
+	room_conn_t *k = services[tunnel].shared;
+	services[tunnel].shared = NULL;
+	k->handed = 1;
+	epoll_ctl(room_epfd, EPOLL_CTL_DEL, k->fd, NULL);
+	if(k->shm.map) epoll_ctl(room_epfd, EPOLL_CTL_DEL, k->shm.rx_efd, NULL);
+	handed[tunnel] = k;
+}
+
+// Old process, every client record sent: drop what is left of the handed
+// connections. Clients that stay reconnect on their next frame.
+void router_handoff_done(void){
+	for(int i = 0; i < MAX_SERVICE_TUNNELS; ++i){
+		if(handed[i]) conn_close(handed[i]);
+		handed[i] = NULL;
+	}
+}
+
+// New process: a shared connection, before any client on it. Its sessions
+// wait unclaimed until client records name them. Takes the fds over.
+int router_mux_restore(const int *fds, int nfds, handoff_buf_t *b){
+	uint8_t t, shm_rx;
+	uint16_t rx_sid, count, sid = 0;
+	room_conn_t *k;
+	if((nfds != 1 && nfds != 1 + UTUN_SHM_FDS) || hbuf_get(b, &t, sizeof(t)) < 0 || t >= MAX_SERVICE_TUNNELS ||
+	   !services[t].path[0] || services[t].shared || !(k = pool_alloc(&conn_pool))){
+		for(int i = 0; i < nfds; ++i) close(fds[i]);
+		return -1;
+	}
+	k->ev_kind = EV_LINK;
+	k->fd = fds[0];
+	k->svc = &services[t];
+	k->mux = 1;
+	k->hdr = UTUN_MUX_HDR_SIZE;
+	if(nfds > 1 && utun_shm_attach(&k->shm, fds + 1, 1) < 0){
+		close(fds[0]);
+		pool_free(&conn_pool, k);
+		return -1;
+	}
+	if(conn_restore(k, b) < 0 || hbuf_get(b, &shm_rx, sizeof(shm_rx)) < 0 || hbuf_get(b, &rx_sid, sizeof(rx_sid)) < 0 ||
+	   hbuf_get(b, &count, sizeof(count)) < 0 || !(k->sessions = calloc(MUX_SESSIONS, sizeof(*k->sessions))))
+		goto fail;
+	k->shm_rx = shm_rx && k->shm.map;
+	for(int i = 0; i < count; ++i){
+		room_link_t *l;
+		if(hbuf_get(b, &sid, sizeof(sid)) < 0 || !sid || k->sessions[sid] || !(l = pool_alloc(&link_pool))) goto fail;
+		l->conn = k;
+		l->sid = sid;
+		l->opened = 1;
+		k->sessions[sid] = l;
+		k->num_sessions++;
+	}
+	k->next_sid = (sid + 1) & (MUX_SESSIONS - 1);
+	if(rx_sid) k->rx_link = k->sessions[rx_sid];
+	struct epoll_event ev = { .events = (k->shm_rx ? EPOLLRDHUP : EPOLLIN) | EPOLLET, .data.ptr = k };
+	if(epoll_ctl(room_epfd, EPOLL_CTL_ADD, k->fd, &ev) < 0) goto fail;
+	// A doorbell rung while nobody listened is still pending and shows up now
+	ev.events = EPOLLIN | EPOLLET;
+	if(k->shm.map && epoll_ctl(room_epfd, EPOLL_CTL_ADD, k->shm.rx_efd, &ev) < 0){
+		epoll_ctl(room_epfd, EPOLL_CTL_DEL, k->fd, NULL);
+		goto fail;
+	}
+	services[t].shared = k;
+	return 0;
+
+fail:
+	for(int i = 1; k->sessions && i < MUX_SESSIONS; ++i)
+		if(k->sessions[i]) pool_free(&link_pool, k->sessions[i]);
+	free(k->sessions);
+	utun_shm_close(&k->shm);
+	close(k->fd);
+	pool_free(&conn_pool, k);
+	return -1;
+}
+
+// New process, all records in: close the sessions nobody claimed and carry
+// on with whatever the old process left buffered
+void router_takeover_done(void){
+	for(int i = 0; i < MAX_SERVICE_TUNNELS; ++i){
+		room_conn_t *k = services[i].shared;
+		if(!k) continue;
+		for(int sid = 1; sid < MUX_SESSIONS; ++sid){
+			room_link_t *l = k->sessions[sid];
+			if(!l || l == &closing_link || l->client) continue;
+			k->sessions[sid] = &closing_link;
+			k->num_sessions--;
+			k->closing++;
+			link_free(l);
+		}
+		if(conn_flush_tx(k) < 0 || conn_flush_closing(k) < 0 || conn_read(k) < 0) conn_close(k);
+	}
+}
+
+// -----------------------------------------------------------------------------
+// Routes
+// -----------------------------------------------------------------------------
+
+// Routes file: one "<tunnel id> <socket path> [mux [shm]]" per line, '#'
+// comments. A path of "-" removes a default route; "mux" shares one
+// connection per worker among all users, for services that take MUX, and
+// "shm" moves it into shared memory, for those that also take SHM.
+int router_init(const char *conf_path){
+	for(size_t i = 0; i < sizeof(default_routes) / sizeof(default_routes[0]); ++i){
+		snprintf(services[default_routes[i].tunnel].path, sizeof(services[0].path), "%s", default_routes[i].path);
+		services[default_routes[i].tunnel].mux = default_routes[i].mux;
+		services[default_routes[i].tunnel].shm = default_routes[i].shm;
+	}
+
+	FILE *f = fopen(conf_path, "r");
+	if(f){
+		char line[256], path[256], mode[8], transport[8];
+		int tunnel, n;
+		while(fgets(line, sizeof(line), f)){
+			if(line[0] == '#' || (n = sscanf(line, "%d %255s %7s %7s", &tunnel, path, mode, transport)) < 2) continue;
+			if(tunnel < 0 || tunnel >= MAX_SERVICE_TUNNELS - 2){
+				syslog(LOG_WARNING, "room: ignoring route for tunnel %d", tunnel);
+				continue;
+			}
+			size_t len = strlen(path);
+			if(len >= sizeof(services[0].path)){
+				syslog(LOG_WARNING, "room: socket path for tunnel %d is too long, ignoring its route", tunnel);
+				continue;
+			}
+			if(strcmp(path, "-") == 0) services[tunnel].path[0] = 0;
+			else memcpy(services[tunnel].path, path, len + 1);
+			services[tunnel].mux = n >= 3 && strcmp(mode, "mux") == 0;
+			services[tunnel].shm = services[tunnel].mux && n == 4 && strcmp(transport, "shm") == 0;
+		}
+		fclose(f);
+	}
+
+	int routes = 0;
+	for(int i = 0; i < MAX_SERVICE_TUNNELS; ++i){
+		if(!services[i].path[0]) continue;
+		syslog(LOG_INFO, "room: tunnel %d -> %s%s", i, services[i].path,
+		       services[i].shm ? " (mux, shm)" : services[i].mux ? " (mux)" : "");
+		fill_spares(&services[i]);
+		routes++;
+	}
+	return routes;
+}
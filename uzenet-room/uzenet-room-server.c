@@ -1,6 +1,6 @@
 #define _GNU_SOURCE
 #include "uzenet-room-server.h"
-#include "../uzenet-identity/uzenet-identity-client.h"
+#include "../uzenet-metrics/uzenet-metrics-client.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,276 +8,1883 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include <pthread.h>
 #include <syslog.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <signal.h>
+#include <sys/wait.h>
 #include <sys/un.h>
+#include <limits.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#define SSL_CTX_set_tlsext_ticket_key_evp_cb SSL_CTX_set_tlsext_ticket_key_cb
+#endif
 
 #define PORT 9470
-#define MAX_CLIENTS 64
+#define HANDSHAKE_TIMEOUT_US 5000000
 #define IDENTITY_TIMEOUT_US 3000000
-#define IDENTITY_PATH "/run/uzenet/identity.sock"
+#define IDLE_TIMEOUT_US 3600000000ULL	// no traffic from the client for an hour, keepalives aside
+#define HIBERNATE_US 20000000
 #define CERT_FILE "/etc/uzenet/server.crt"
 #define KEY_FILE "/etc/uzenet/server.key"
+#define TICKET_KEY_FILE "/etc/uzenet/ticket.keys"
+#define ROUTES_FILE "/etc/uzenet/room-routes.conf"
+#define EGRESS_FILE "/etc/uzenet/room-egress.conf"
+#define METRICS_PATH "/run/uzenet/metrics.sock"
+#define STATS_INTERVAL_US 1000000
 
-typedef struct {
-	int fd;
-	SSL *ssl;
-	int using_tls;
-	struct sockaddr_in addr;
-	pthread_t thread;
-	char ip[64];
-	struct uzenet_identity ident;
-	int flow_hold;
-	uint64_t tokens;
-	uint64_t last_refill;
-	uint64_t last_activity_us;
-	struct service_tunnel {
-		uint8_t queue[4096];
-		int head, tail;
-	} tunnels[MAX_SERVICE_TUNNELS];
-} client_t;
-
-static client_t clients[MAX_CLIENTS];
+#define MAX_EVENTS	256
+
+#define CLIENT_SLAB_COUNT	64	// sessions carved out per slab
+#define TUNNEL_SLAB_COUNT	128	// tunnel queues carved out per slab
+#define BUF_SLAB_COUNT		64	// input/output buffers carved out per slab
+
+#define KEEPALIVE_IDLE_S	60	// TCP keepalive finds peers that vanished from a quiet session
+#define KEEPALIVE_INTVL_S	15
+#define KEEPALIVE_CNT		4
+
+#define SESSION_CACHE_SIZE	20000	// server-side session-ID cache entries
+#define SESSION_TIMEOUT_S	7200
+#define MAX_TICKET_KEYS		4	// current key + keys still accepted for decryption
+
+#define HANDOFF_NAME		"uzenet-room-handoff-%d"	// abstract AF_UNIX name per shard
+#define HANDOFF_TIMEOUT_US	5000000
+#define HANDOFF_DRAIN_US	600000000ULL	// how long sessions left behind may linger
+#define HANDOFF_RECORD_MAX	(640 * 1024)	// one client with every tunnel and link full
+
+#define EGRESS_MAX_FRAMES	32	// tunnel frames gathered into one write
+
+#define PACE_US_PER_BYTE	100	// token bucket rate toward the Uzebox UART
+#define PACE_BURST		65536	// bucket depth in bytes
+#define PACE_TICK_US		1000	// pacing wheel resolution
+#define PACE_WHEEL_SLOTS	1024	// power of two; later deadlines wrap and wait out extra turns
+
+#define ROOM_PING_INTERVAL_US	5000000	// RTT probes, see uzenet-room-command.c
+
+static pool_t client_pool = { .size = sizeof(client_t), .per_slab = CLIENT_SLAB_COUNT };
+static pool_t tunnel_pool = { .size = sizeof(struct service_tunnel), .per_slab = TUNNEL_SLAB_COUNT };
+static pool_t in_pool = { .size = IN_BUF_SIZE, .per_slab = BUF_SLAB_COUNT };
+static pool_t out_pool = { .size = OUT_BUF_SIZE, .per_slab = BUF_SLAB_COUNT };
+static int max_clients = DEFAULT_MAX_CLIENTS;
 static volatile int quitting = 0;
+static volatile sig_atomic_t reload_pending = 0;
+static volatile sig_atomic_t upgrade_pending = 0;
+static int supervised = 0;		// a worker under the --workers supervisor
+static int takeover = 0;		// started by a hot restart, ask for sessions
+static int use_ktls = 0;		// --ktls: hand record encryption to the kernel
+static char exe_path[PATH_MAX];
+static char **saved_argv;
 static SSL_CTX *tls_ctx = NULL;
+int room_epfd = -1;
+static int listen_fd = -1;
+static int listen_tag = EV_LISTEN;
+
+// Objects closed during an epoll batch; a later event in the same batch may
+// still point at them, so they go back to their pool once the batch is done.
+static struct deferred_free{
+	pool_t *pool;
+	void *obj;
+} *deferred = NULL;
+static int num_deferred = 0, max_deferred = 0;
+
+static client_list_t handshake_list, login_list, idle_list;
+static client_t *hibernate_next;	// oldest on idle_list not yet looked at for hibernation
+
+// Clients waiting for token refill, hashed by the tick their next frame fits.
+// busy[] mirrors the non-empty slots so the next deadline is a bit scan.
+static struct{
+	client_t *slot[PACE_WHEEL_SLOTS];
+	uint64_t busy[PACE_WHEEL_SLOTS / 64];
+	uint64_t tick;			// next tick not yet run
+	int count;
+} pace_wheel;
+static client_t *pace_due = NULL;	// pulled off the wheel, flushed this tick
+static client_t *output_head = NULL;	// clients with tunnel data queued this batch
+static uint64_t next_ping_us;
+
+// Handshake latency buckets: bucket i counts handshakes that took < 2^i ms,
+// the last one catches everything slower.
+#define HS_HIST_BUCKETS 14
+
+// Counters are accumulated here and pushed to uzenet-metrics at most once
+// per STATS_INTERVAL_US, so a reconnect storm does not turn into a metrics storm.
+static struct{
+	int hs_inflight;		// accepted, not yet past the handshake
+	int hibernating;
+	uint32_t hs_ok, hs_resumed, hs_failed, hs_timeout, hs_ktls;
+	uint32_t hs_hist[HS_HIST_BUCKETS];
+	uint32_t tx_records;		// client writes (TLS records) since the last flush
+	uint64_t tx_bytes;
+	int dirty;
+	uint64_t next_flush_us, last_flush_us;
+} stats;
+
+static void stats_egress(client_t *c, size_t bytes){
+	c->tx_records++;
+	c->tx_bytes += bytes;
+	stats.tx_records++;
+	stats.tx_bytes += bytes;
+	stats.dirty = 1;
+}
 
 static void signal_handler(int sig){
 	quitting = 1;
 }
 
-static uint64_t now_us(){
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	return (uint64_t)tv.tv_sec * 1000000ULL + tv.tv_usec;
+static void reload_handler(int sig){
+	reload_pending = 1;
+}
+
+static void upgrade_handler(int sig){
+	upgrade_pending = 1;
+}
+
+// Monotonic so deadlines survive wall clock steps
+uint64_t room_now_us(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void set_nonblock(int fd){
+	int fl = fcntl(fd, F_GETFL, 0);
+	if(fl >= 0) fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
+// -----------------------------------------------------------------------------
+// Pools
+// -----------------------------------------------------------------------------
+
+void *pool_alloc(pool_t *p){
+	if(!p->free){
+		if(p->max && p->used >= p->max) return NULL;
+		size_t sz = (p->size + 15) & ~(size_t)15;
+		pool_slab_t *slab = calloc(1, 16 + sz * p->per_slab);
+		if(!slab) return NULL;
+		slab->next = p->slabs;
+		p->slabs = slab;
+		uint8_t *obj = (uint8_t *)slab + 16;
+		for(int i = p->per_slab - 1; i >= 0; --i){
+			*(void **)(obj + i * sz) = p->free;
+			p->free = obj + i * sz;
+		}
+	}
+	void *o = p->free;
+	p->free = *(void **)o;
+	memset(o, 0, p->size);
+	p->used++;
+	return o;
 }
 
+void pool_free(pool_t *p, void *o){
+	*(void **)o = p->free;
+	p->free = o;
+	p->used--;
+}
+
+void room_defer_free(pool_t *p, void *o){
+	if(num_deferred == max_deferred){
+		int n = max_deferred ? max_deferred * 2 : 256;
+		struct deferred_free *d = realloc(deferred, n * sizeof(*d));
+		if(!d){
+			syslog(LOG_ERR, "room: out of memory, leaking closed object");
+			return;
+		}
+		deferred = d;
+		max_deferred = n;
+	}
+	deferred[num_deferred].pool = p;
+	deferred[num_deferred].obj = o;
+	num_deferred++;
+}
+
+static void flush_deferred(){
+	for(int i = 0; i < num_deferred; ++i)
+		pool_free(deferred[i].pool, deferred[i].obj);
+	num_deferred = 0;
+}
+
+// -----------------------------------------------------------------------------
+// Timeout lists
+// -----------------------------------------------------------------------------
+
+static void list_remove(client_t *c){
+	client_list_t *l = c->tlist;
+	if(!l) return;
+	if(c == hibernate_next) hibernate_next = c->tnext;
+	if(c->tprev) c->tprev->tnext = c->tnext; else l->head = c->tnext;
+	if(c->tnext) c->tnext->tprev = c->tprev; else l->tail = c->tprev;
+	c->tprev = c->tnext = NULL;
+	c->tlist = NULL;
+}
+
+static void list_append(client_list_t *l, client_t *c){
+	list_remove(c);
+	c->tlist = l;
+	c->tprev = l->tail;
+	c->tnext = NULL;
+	if(l->tail) l->tail->tnext = c; else l->head = c;
+	l->tail = c;
+}
+
+static void idle_append(client_t *c){
+	list_append(&idle_list, c);
+	if(!hibernate_next) hibernate_next = c;
+}
+
+// Login keeps its accept-time deadline; only active sessions are refreshed.
+// Keepalives don't count, or the room's own PING would keep every session
+// that answers it awake and connected for good.
+static void touch_client(client_t *c){
+	if(c->state != CLIENT_ACTIVE) return;
+	c->last_traffic_us = room_now_us();
+	idle_append(c);
+}
+
+// -----------------------------------------------------------------------------
+// Hibernation
+//
+// Most sessions sit in a menu most of the time. After HIBERNATE_US without
+// traffic from the client, a session with nothing buffered hands its input and
+// output buffers and its empty tunnel queues back to their pools; OpenSSL
+// does the same with the TLS record buffers (SSL_MODE_RELEASE_BUFFERS). What
+// stays is client_t itself, and the first byte either way takes the buffers
+// it needs again. The pools keep the slabs, so a session waking up reuses
+// memory another one just gave back.
+//
+// hibernate_next walks idle_list, which is in last-traffic order, so a
+// session is looked at once per idle spell; one that still had data queued
+// goes down once flush_tunnels() has drained it, and one a keepalive woke
+// goes back down once it is read. The room doesn't probe hibernating
+// sessions, which would hand them a fresh output buffer every time.
+// -----------------------------------------------------------------------------
+
+static void wake_client(client_t *c){
+	if(!c->hibernating) return;
+	c->hibernating = 0;
+	stats.hibernating--;
+	stats.dirty = 1;
+}
+
+static int want_in(client_t *c){
+	if(!c->in && !(c->in = pool_alloc(&in_pool))) return -1;
+	wake_client(c);
+	return 0;
+}
+
+static int want_out(client_t *c){
+	if(!c->out && !(c->out = pool_alloc(&out_pool))) return -1;
+	wake_client(c);
+	return 0;
+}
+
+static void release_buffers(client_t *c){
+	if(c->in) pool_free(&in_pool, c->in);
+	if(c->out) pool_free(&out_pool, c->out);
+	c->in = c->out = NULL;
+}
+
+static void hibernate_client(client_t *c){
+	if(c->hibernating || c->state != CLIENT_ACTIVE || c->in_len || c->out_len || c->in_blocked ||
+	   c->pace_until || c->out_queued || room_now_us() - c->last_traffic_us < HIBERNATE_US)
+		return;
+	for(int i = 0; i < MAX_SERVICE_TUNNELS; ++i){
+		struct service_tunnel *t = c->tunnels[i];
+		if(t && (ring_used(&t->ring) || pubsub_queued(&t->pub))) return;
+	}
+	for(int i = 0; i < MAX_SERVICE_TUNNELS; ++i){
+		if(!c->tunnels[i]) continue;
+		pool_free(&tunnel_pool, c->tunnels[i]);
+		c->tunnels[i] = NULL;
+	}
+	release_buffers(c);
+	c->hibernating = 1;
+	stats.hibernating++;
+	stats.dirty = 1;
+}
+
+static void pace_link(client_t **head, client_t *c){
+	c->pace_list = head;
+	c->pprev = NULL;
+	c->pnext = *head;
+	if(*head) (*head)->pprev = c;
+	*head = c;
+}
+
+static void pace_unlink(client_t *c){
+	client_t **head = c->pace_list;
+	if(c->pprev) c->pprev->pnext = c->pnext; else *head = c->pnext;
+	if(c->pnext) c->pnext->pprev = c->pprev;
+	c->pprev = c->pnext = NULL;
+	c->pace_list = NULL;
+	if(!*head && head != &pace_due){
+		int s = head - pace_wheel.slot;
+		pace_wheel.busy[s / 64] &= ~(1ULL << (s % 64));
+	}
+}
+
+static void pace_remove(client_t *c){
+	if(!c->pace_until) return;
+	pace_unlink(c);
+	pace_wheel.count--;
+	c->pace_until = 0;
+}
+
+// Park the client until <when>, the moment its next frame fits the bucket.
+// Deadlines round up to a tick so a client never wakes short of tokens.
+static void pace_client(client_t *c, uint64_t when){
+	if(c->pace_until){
+		if(when >= c->pace_until) return;
+		pace_remove(c);
+	}
+	uint64_t tick = (when + PACE_TICK_US - 1) / PACE_TICK_US;
+	if(tick < pace_wheel.tick) tick = pace_wheel.tick;
+	int s = tick & (PACE_WHEEL_SLOTS - 1);
+	c->pace_until = when;
+	pace_link(&pace_wheel.slot[s], c);
+	pace_wheel.busy[s / 64] |= 1ULL << (s % 64);
+	pace_wheel.count++;
+}
+
+// Tick the wheel up to <now> and queue everyone whose deadline passed on
+// pace_due. Clients a full turn or more out stay in their slot.
+static void pace_advance(uint64_t now){
+	uint64_t now_tick = now / PACE_TICK_US;
+	uint64_t t = pace_wheel.tick;
+	if(now_tick >= t + PACE_WHEEL_SLOTS) t = now_tick - PACE_WHEEL_SLOTS + 1;
+	for(; t <= now_tick && pace_wheel.count; ++t){
+		client_t *c = pace_wheel.slot[t & (PACE_WHEEL_SLOTS - 1)];
+		while(c){
+			client_t *next = c->pnext;
+			if(c->pace_until <= now){
+				pace_unlink(c);
+				pace_link(&pace_due, c);
+			}
+			c = next;
+		}
+	}
+	if(now_tick + 1 > pace_wheel.tick) pace_wheel.tick = now_tick + 1;
+}
+
+// Start of the first non-empty slot, or UINT64_MAX when nobody is paced
+static uint64_t pace_next_us(){
+	if(!pace_wheel.count) return UINT64_MAX;
+	int start = pace_wheel.tick & (PACE_WHEEL_SLOTS - 1);
+	for(int i = 0; i <= PACE_WHEEL_SLOTS / 64; ++i){
+		int w = (start / 64 + i) % (PACE_WHEEL_SLOTS / 64);
+		uint64_t bits = pace_wheel.busy[w];
+		if(i == 0) bits &= ~0ULL << (start % 64);
+		else if(i == PACE_WHEEL_SLOTS / 64) bits &= ~(~0ULL << (start % 64));
+		if(!bits) continue;
+		int s = w * 64 + __builtin_ctzll(bits);
+		uint64_t ahead = (s - start) & (PACE_WHEEL_SLOTS - 1);
+		return (pace_wheel.tick + ahead) * PACE_TICK_US;
+	}
+	return UINT64_MAX;
+}
+
+// -----------------------------------------------------------------------------
+// Socket I/O
+// -----------------------------------------------------------------------------
+
+static void update_events(client_t *c){
+	int want = (c->out_len > c->out_off) || c->read_wants_write;
+	if(want == c->epollout) return;
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLET | (want ? EPOLLOUT : 0), .data.ptr = c };
+	epoll_ctl(room_epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->epollout = want;
+}
+
+// Also used to let go of a session handed to a new process: closing our copy
+// of each fd leaves the connections open.
+static void release_client(client_t *c){
+	if(c->state == CLIENT_ACTIVE) shard_user_offline(c);
+	if(c->state < CLIENT_LOGIN){
+		stats.hs_inflight--;
+		stats.dirty = 1;
+	}
+	epoll_ctl(room_epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	list_remove(c);
+	pace_remove(c);
+	identity_client_closed(c);
+	pubsub_client_closed(c);
+	router_client_closed(c);
+	if(c->using_tls && c->ssl) SSL_free(c->ssl);
+	close(c->fd);
+	for(int i = 0; i < MAX_SERVICE_TUNNELS; ++i)
+		if(c->tunnels[i]) pool_free(&tunnel_pool, c->tunnels[i]);
+	release_buffers(c);
+	wake_client(c);
+	c->ev_kind = EV_DEAD;
+	room_defer_free(&client_pool, c);
+}
+
+static void close_client(client_t *c){
+	if(c->state == CLIENT_ACTIVE)
+		syslog(LOG_INFO, "room: user %s disconnected", c->ident.name13);
+	// Not for a hand-over, which keeps players and queued users here
+	lockstep_client_closed(c);
+	matchmaking_client_closed(c);
+	release_client(c);
+}
+
+// A HOLD from the bridge takes a round trip to stop us, and the UART keeps
+// draining at the paced rate meanwhile, so the bucket leaves that much of the
+// bridge's buffer free. Unmeasured clients get the full depth.
+static uint32_t pace_burst(const client_t *c){
+	uint32_t rtt_bytes = c->rtt_us / PACE_US_PER_BYTE;
+	return PACE_BURST - (rtt_bytes < PACE_BURST / 2 ? rtt_bytes : PACE_BURST / 2);
+}
+
+// last_refill only advances by whole tokens, so the fraction carries over and
+// the deadline pace_client() computes from it is exact.
 static void refill_tokens(client_t *c){
-	uint64_t now = now_us();
-	uint64_t elapsed = now - c->last_refill;
-	if(elapsed > 0){
-		c->tokens += elapsed / 100;
-		if(c->tokens > 65536) c->tokens = 65536;
+	uint64_t now = room_now_us();
+	uint64_t earned = (now - c->last_refill) / PACE_US_PER_BYTE;
+	uint32_t burst = pace_burst(c);
+	c->tokens += earned;
+	c->last_refill += earned * PACE_US_PER_BYTE;
+	if(c->tokens >= burst){
+		c->tokens = burst;
 		c->last_refill = now;
 	}
 }
 
-static int send_data(client_t *c, const void *buf, size_t len){
-	refill_tokens(c);
-	if(c->tokens < len && c->flow_hold) return 0;
-	if(c->tokens < len) usleep((len - c->tokens) * 100);
-	c->tokens -= len;
-	if(c->using_tls) return SSL_write(c->ssl, buf, len);
-	else return send(c->fd, buf, len, 0);
+// Push buffered output until the socket would block. Returns -1 on a fatal error.
+static int flush_out(client_t *c){
+	while(c->out_off < c->out_len){
+		int n = c->out_len - c->out_off;
+		int w;
+		if(c->using_tls && !c->ktls_tx){
+			w = SSL_write(c->ssl, c->out + c->out_off, n);
+			if(w <= 0){
+				int e = SSL_get_error(c->ssl, w);
+				if(e == SSL_ERROR_WANT_WRITE || e == SSL_ERROR_WANT_READ) break;
+				return -1;
+			}
+		}else{
+			w = send(c->fd, c->out + c->out_off, n, MSG_NOSIGNAL);
+			if(w < 0){
+				if(errno == EINTR) continue;
+				if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+				return -1;
+			}
+		}
+		c->out_off += w;
+		stats_egress(c, w);
+	}
+	if(c->out_off == c->out_len){
+		c->out_off = c->out_len = 0;
+	}else if(c->out_off > OUT_BUF_SIZE / 2){
+		// SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER allows the retry from a new address
+		memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+		c->out_len -= c->out_off;
+		c->out_off = 0;
+	}
+	update_events(c);
+	return 0;
 }
 
+// Free space once the buffer is compacted
+static int out_space(const client_t *c){
+	return OUT_BUF_SIZE - (c->out_len - c->out_off);
+}
+
+// Returns >0 bytes read, 0 on EOF, -1 on error and -2 when drained.
 static int recv_data(client_t *c, void *buf, size_t len){
-	if(c->using_tls) return SSL_read(c->ssl, buf, len);
-	else return recv(c->fd, buf, len, 0);
+	if(c->using_tls){
+		int r = SSL_read(c->ssl, buf, len);
+		if(r > 0) return r;
+		int e = SSL_get_error(c->ssl, r);
+		if(e == SSL_ERROR_WANT_READ) return -2;
+		if(e == SSL_ERROR_WANT_WRITE){
+			c->read_wants_write = 1;
+			return -2;
+		}
+		if(e == SSL_ERROR_ZERO_RETURN) return 0;
+		return -1;
+	}
+	for(;;){
+		int r = recv(c->fd, buf, len, 0);
+		if(r >= 0) return r;
+		if(errno == EINTR) continue;
+		if(errno == EAGAIN || errno == EWOULDBLOCK) return -2;
+		return -1;
+	}
 }
 
-static void queue_tunnel(client_t *c, int tunnel, const uint8_t *data, int len){
-	struct service_tunnel *t = &c->tunnels[tunnel];
-	for(int i = 0; i < len; ++i){
-		int next = (t->head + 1) % sizeof(t->queue);
-		if(next == t->tail) break;
-		t->queue[t->head] = data[i];
-		t->head = next;
+// -----------------------------------------------------------------------------
+// Service tunnels
+// -----------------------------------------------------------------------------
+
+int room_tunnel_space(client_t *c, int tunnel){
+	struct service_tunnel *t = c->tunnels[tunnel];
+	if(!t) return TUNNEL_QUEUE_SIZE;
+	return ring_space(&t->ring, TUNNEL_QUEUE_SIZE);
+}
+
+struct service_tunnel *room_tunnel(client_t *c, int tunnel){
+	if(!c->tunnels[tunnel]) c->tunnels[tunnel] = pool_alloc(&tunnel_pool);
+	wake_client(c);
+	return c->tunnels[tunnel];
+}
+
+int room_queue_tunnel(client_t *c, int tunnel, const uint8_t *data, int len){
+	struct service_tunnel *t = room_tunnel(c, tunnel);
+	if(!t) return 0;
+	return ring_write(&t->ring, t->queue, TUNNEL_QUEUE_SIZE, data, len);
+}
+
+// Priority class and DRR weight per tunnel, overridable from EGRESS_FILE.
+// Latency-bound traffic first, interactive next, bulk transfers last.
+static egress_policy_t egress_policy = {
+	.prio = {
+		[TUNNEL_GAMEPLAY] = 0, [TUNNEL_AUDIO] = 0,
+		[TUNNEL_CHAT] = 1, [TUNNEL_MATCHMAKING] = 1, [TUNNEL_SSH] = 1,
+		[TUNNEL_LICHESS] = 1, [TUNNEL_FUJINET] = 1,
+		[TUNNEL_SIDELOAD] = 2, [TUNNEL_FATFS] = 2, [TUNNEL_ZIPSTREAM] = 2,
+		[10 ... MAX_SERVICE_TUNNELS - 1] = 2,
+	},
+	.weight = {
+		[0 ... MAX_SERVICE_TUNNELS - 1] = 1,
+		[TUNNEL_FATFS] = 2,	// block reads are latency-bound on the Uzebox
+	},
+	.backlog = { 0, 4096, 2 * EGRESS_QUANTUM, 2 * EGRESS_QUANTUM },
+};
+
+// Egress file: one "<tunnel id> <class> [weight]" per line, '#' comments.
+// Class 0 is served first; weight is frames per round within a class.
+// "backlog <class> <bytes>" caps what a class may have in flight (0 = no cap).
+static void load_egress_policy(const char *path){
+	FILE *f = fopen(path, "r");
+	if(f){
+		char line[128];
+		int tunnel, prio, weight;
+		while(fgets(line, sizeof(line), f)){
+			weight = 1;
+			if(sscanf(line, "backlog %d %d", &prio, &weight) == 2){
+				if(prio < 0 || prio >= EGRESS_CLASSES || weight < 0 || (weight && weight < EGRESS_QUANTUM)){
+					syslog(LOG_WARNING, "room: ignoring egress backlog for class %d", prio);
+					continue;
+				}
+				egress_policy.backlog[prio] = weight;
+				continue;
+			}
+			if(line[0] == '#' || sscanf(line, "%d %d %d", &tunnel, &prio, &weight) < 2) continue;
+			if(tunnel < 0 || tunnel >= MAX_SERVICE_TUNNELS || prio < 0 || prio >= EGRESS_CLASSES || weight < 1 || weight > 255){
+				syslog(LOG_WARNING, "room: ignoring egress class for tunnel %d", tunnel);
+				continue;
+			}
+			egress_policy.prio[tunnel] = prio;
+			egress_policy.weight[tunnel] = weight;
+		}
+		fclose(f);
 	}
+	egress_policy_build(&egress_policy);
 }
 
-static void flush_tunnels(client_t *c){
-	for(int i = 0; i < MAX_SERVICE_TUNNELS; ++i){
-		struct service_tunnel *t = &c->tunnels[i];
-		if(t->tail != t->head){
-			uint8_t frame[260];
-			int len = 0;
-			frame[len++] = 0xF0 | (i & 0x0F);
-			frame[len++] = 0;
-			int p = t->tail;
-			while(p != t->head && len < 256 + 2){
-				frame[len++] = t->queue[p];
-				p = (p + 1) % sizeof(t->queue);
+// One egress batch: every frame ready on every tunnel, gathered as
+// [0xFx][len] headers plus ring spans, or published frames as they are,
+// so they can leave in a single write.
+typedef struct{
+	struct iovec iov[1 + EGRESS_MAX_FRAMES * 3];
+	uint8_t hdr[EGRESS_MAX_FRAMES][2];
+	uint32_t taken[MAX_SERVICE_TUNNELS];
+	uint8_t pub_taken[MAX_SERVICE_TUNNELS];
+	int cnt, frames;
+	size_t bytes;
+} egress_batch_t;
+
+// Wire size of the next frame on <tunnel> past what the batch already took
+static uint16_t egress_head(client_t *c, egress_batch_t *b, int tunnel){
+	struct service_tunnel *t = c->tunnels[tunnel];
+	if(!t) return 0;
+	uint32_t used = ring_used(&t->ring) - b->taken[tunnel];
+	if(used) return 2 + (used > MAX_FRAME_PAYLOAD ? MAX_FRAME_PAYLOAD : used);
+	pubsub_msg_t *m = pubsub_peek(&t->pub, b->pub_taken[tunnel]);
+	return m ? m->size : 0;
+}
+
+// Collect frames in scheduler order up to the output buffer's free space (so
+// whatever the socket does not take can always be buffered) and the token
+// bucket. A frame that does not fit ends the batch rather than letting a
+// lower class slip past it. Returns 1 if the bucket ran dry and the client
+// was paced.
+static int egress_gather(client_t *c, egress_batch_t *b){
+	size_t budget = out_space(c);
+	uint32_t burst = pace_burst(c);
+	uint16_t head[MAX_SERVICE_TUNNELS];
+	for(int i = 0; i < MAX_SERVICE_TUNNELS; ++i)
+		head[i] = egress_head(c, b, i);
+	while(b->frames < EGRESS_MAX_FRAMES){
+		int i = egress_pick(&egress_policy, &c->drr, head);
+		if(i < 0) break;
+		uint32_t wire = head[i];
+		uint64_t need = b->bytes + wire + egress_reserve(&egress_policy, i, burst);
+		if(b->bytes + wire > budget) return 0;	// EPOLLOUT brings us back
+		if(c->tokens < need){
+			pace_client(c, c->last_refill + (need - c->tokens) * PACE_US_PER_BYTE);
+			return 1;
+		}
+		struct service_tunnel *t = c->tunnels[i];
+		if(ring_used(&t->ring) > b->taken[i]){
+			struct iovec span[2];
+			int n = ring_peek_at(&t->ring, t->queue, TUNNEL_QUEUE_SIZE, span, b->taken[i], wire - 2);
+			uint8_t *h = b->hdr[b->frames++];
+			h[0] = FRAME_TUNNEL_PREFIX | (i & 0x0F);
+			h[1] = (uint8_t)(wire - 2);
+			b->iov[b->cnt].iov_base = h;
+			b->iov[b->cnt++].iov_len = 2;
+			for(int k = 0; k < n; ++k) b->iov[b->cnt++] = span[k];
+			b->taken[i] += wire - 2;
+		}else{
+			// Already encoded, shared with every other subscriber
+			pubsub_msg_t *m = pubsub_peek(&t->pub, b->pub_taken[i]++);
+			b->frames++;
+			b->iov[b->cnt].iov_base = m->wire;
+			b->iov[b->cnt++].iov_len = m->size;
+		}
+		b->bytes += wire;
+		egress_charge(&c->drr, i, wire);
+		head[i] = egress_head(c, b, i);
+	}
+	return 0;
+}
+
+// Put a gathered batch on the wire. Plain sockets get one writev() covering
+// anything already buffered plus the new frames, and only the unwritten tail
+// is copied into c->out. kTLS sessions take the same path, the kernel cuts
+// the records. Userspace TLS copies the frames behind the buffered bytes and
+// writes them with a single SSL_write(), i.e. one record per flush.
+static int egress_send(client_t *c, egress_batch_t *b){
+	size_t skip = 0;
+	c->tokens -= (b->bytes < c->tokens) ? b->bytes : c->tokens;
+
+	if(!c->using_tls || c->ktls_tx){
+		struct iovec *iov = b->iov + 1;
+		int cnt = b->cnt - 1;
+		size_t pending = c->out_len - c->out_off;
+		if(pending){
+			b->iov[0].iov_base = c->out + c->out_off;
+			b->iov[0].iov_len = pending;
+			iov--;
+			cnt++;
+		}
+		ssize_t w;
+		do w = writev(c->fd, iov, cnt); while(w < 0 && errno == EINTR);
+		if(w < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+		if(w > 0){
+			stats_egress(c, w);
+			if((size_t)w < pending){
+				c->out_off += w;
+			}else{
+				c->out_off = c->out_len = 0;
+				skip = w - pending;
 			}
-			t->tail = p;
-			frame[1] = len - 2;
-			send_data(c, frame, len);
 		}
 	}
+	if(skip < b->bytes && want_out(c) < 0) return -1;
+	if(c->out_off && c->out_len + b->bytes - skip > OUT_BUF_SIZE){
+		memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+		c->out_len -= c->out_off;
+		c->out_off = 0;
+	}
+	for(int i = 1; i < b->cnt; ++i){
+		size_t n = b->iov[i].iov_len;
+		if(skip >= n){
+			skip -= n;
+			continue;
+		}
+		memcpy(c->out + c->out_len, (uint8_t *)b->iov[i].iov_base + skip, n - skip);
+		c->out_len += n - skip;
+		skip = 0;
+	}
+	return flush_out(c);
 }
 
-static int do_login(client_t *c){
-	uint8_t pw[6];
-	int got = 0;
-	uint64_t start = now_us();
-	while(got < 6){
-		uint8_t b;
-		int r = recv_data(c, &b, 1);
-		if(r == 1){
-			pw[got++] = b;
-		}else if(r <= 0){
-			if(now_us() - start > IDENTITY_TIMEOUT_US) return 0;
-			usleep(1000);
+// Drain tunnel queues toward the client as far as the token bucket and socket
+// allow; anything left over stays queued for the next wakeup. Frames over
+// budget stay in their ring and the pacing wheel brings the client back on
+// the tick they fit. A held client is off the wheel until it resumes.
+static int flush_tunnels(client_t *c){
+	if(c->flow_hold) return 0;
+	refill_tokens(c);
+	for(;;){
+		egress_batch_t b;
+		b.cnt = 1;	// iov[0] is reserved for bytes already in c->out
+		b.frames = 0;
+		b.bytes = 0;
+		memset(b.taken, 0, sizeof(b.taken));
+		memset(b.pub_taken, 0, sizeof(b.pub_taken));
+		int paced = egress_gather(c, &b);
+		if(!b.frames){
+			hibernate_client(c);	// drained, in case it went idle with data queued
+			return 0;
 		}
+		if(egress_send(c, &b) < 0) return -1;
+		// Release ring space only now: a drained link refills it right away
+		for(int i = 0; i < MAX_SERVICE_TUNNELS; ++i){
+			for(int k = 0; k < b.pub_taken[i]; ++k) pubsub_release(pubsub_pop(&c->tunnels[i]->pub));
+			if(!b.taken[i]) continue;
+			ring_consume(&c->tunnels[i]->ring, b.taken[i]);
+			if(c->links[i]) router_tunnel_drained(c, i);
+		}
+		shard_tunnel_drained();
+		if(paced || c->out_len > c->out_off) return 0;
 	}
+}
 
-	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
-	struct sockaddr_un addr = { .sun_family = AF_UNIX };
-	strcpy(addr.sun_path, IDENTITY_PATH);
-	if(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0){
-		close(sock);
-		return 0;
+// -----------------------------------------------------------------------------
+// Login
+// -----------------------------------------------------------------------------
+
+static void login_ok(client_t *c){
+	c->state = CLIENT_ACTIVE;
+	shard_user_online(c);
+	syslog(LOG_INFO, "room: user %s (id %04x) logged in", c->ident.name13, c->ident.user_id);
+	touch_client(c);
+}
+
+// -----------------------------------------------------------------------------
+// Client input
+// -----------------------------------------------------------------------------
+
+// Consume complete commands/frames from c->in. Returns -1 to drop the client.
+static int process_input(client_t *c){
+	int i = 0, traffic = 0;
+
+	if(c->state == CLIENT_AUTH) return 0;	// frames wait in c->in for the answer
+	if(c->state == CLIENT_LOGIN){
+		while(c->pw_got < 6 && i < c->in_len)
+			c->pw[c->pw_got++] = c->in[i++];
+		if(c->pw_got < 6) goto done;
+		int r = identity_lookup(c);
+		if(r < 0){
+			syslog(LOG_WARNING, "room: failed login from %s", c->ip);
+			return -1;
+		}
+		if(r == 0){
+			c->state = CLIENT_AUTH;
+			goto done;
+		}
+		login_ok(c);
 	}
-	send(sock, pw, 6, 0);
-	uint8_t reply[2];
-	int r = recv(sock, reply, 2, MSG_WAITALL);
-	close(sock);
-	if(r != 2) return 0;
 
-	uint16_t uid = (reply[0] << 8) | reply[1];
-	c->ident.user_id = uid;
-	snprintf(c->ident.name13, 14, "%06u", (uid == 0xFFFF ? 0 : uid));
-	snprintf(c->ident.name8, 9,  "%s", c->ident.name13);
-	snprintf(c->ident.name6, 7,  "%s", c->ident.name13);
-	c->ident.flags = (uid == 0xFFFF ? 'R' : 'G');
-	return 1;
+	while(i < c->in_len){
+		uint8_t cmd = c->in[i];
+		if(cmd == FRAME_HOLD_TRANSMISSION){
+			c->flow_hold = 1;
+			pace_remove(c);		// 0xFE flushes again from client_event()
+			i++;
+			traffic = 1;
+		}else if(cmd == FRAME_RESUME_TRANSMISSION){
+			c->flow_hold = 0;
+			i++;
+			traffic = 1;
+		}else if((cmd & FRAME_TUNNEL_MASK) == FRAME_TUNNEL_PREFIX){
+			int tunnel = cmd & 0x0F;
+			if(i + 1 >= c->in_len) break;
+			int len = c->in[i + 1];
+			if(i + 2 + len > c->in_len) break;	// rest arrives with the next read
+			if(tunnel == TUNNEL_GAMEPLAY){
+				lockstep_client_data(c, &c->in[i + 2], len);
+			}else if(tunnel == TUNNEL_MATCHMAKING){
+				matchmaking_client_data(c, &c->in[i + 2], len);
+			}else if(dispatch_tunnel_data(c, tunnel, &c->in[i + 2], len) < 0){
+				c->in_blocked = 1;		// keep the frame, the link resumes us
+				break;
+			}
+			i += 2 + len;
+			traffic = 1;
+		}else{
+			int n = dispatch_room_command(c, &c->in[i], c->in_len - i);
+			if(n < 0) return -1;
+			if(n == 0) break;	// rest arrives with the next read
+			i += n;
+			if(cmd != ROOM_CMD_NULL && cmd != ROOM_CMD_PONG) traffic = 1;
+		}
+	}
+	if(traffic) touch_client(c);
+done:
+	if(i > 0){
+		memmove(c->in, c->in + i, c->in_len - i);
+		c->in_len -= i;
+	}
+	return 0;
+}
+
+// Edge triggered: read until the socket (and the SSL buffer) is drained.
+static int client_readable(client_t *c){
+	c->read_wants_write = 0;
+	if(want_in(c) < 0) return -1;
+	for(;;){
+		if(c->in_blocked || c->in_len == IN_BUF_SIZE) break;
+		int r = recv_data(c, c->in + c->in_len, IN_BUF_SIZE - c->in_len);
+		if(r == -2) break;
+		if(r <= 0) return -1;
+		c->in_len += r;
+		if(process_input(c) < 0) return -1;
+	}
+	hibernate_client(c);	// back down if that was only a keepalive
+	return 0;
+}
+
+// -----------------------------------------------------------------------------
+// TLS session resumption
+// -----------------------------------------------------------------------------
+
+// Ticket keys shared across restarts, one per line as 160 hex digits
+// (16 byte name, 32 byte HMAC key, 32 byte AES key). The first line
+// encrypts new tickets; the rest are still accepted so rotation does not
+// force every bridge back to a full handshake. Without the file OpenSSL
+// uses random per-process keys and resumption only spans one process.
+typedef struct{
+	uint8_t name[16];
+	uint8_t hmac[32];
+	uint8_t aes[32];
+} ticket_key_t;
+
+static ticket_key_t ticket_keys[MAX_TICKET_KEYS];
+static int num_ticket_keys = 0;
+
+static int hexval(int ch){
+	if(ch >= '0' && ch <= '9') return ch - '0';
+	if(ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+	if(ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+	return -1;
+}
+
+static int load_ticket_keys(){
+	FILE *f = fopen(TICKET_KEY_FILE, "r");
+	if(!f) return 0;
+
+	ticket_key_t keys[MAX_TICKET_KEYS];
+	char line[256];
+	int n = 0;
+	while(n < MAX_TICKET_KEYS && fgets(line, sizeof(line), f)){
+		uint8_t *k = (uint8_t *)&keys[n];
+		int i;
+		if(line[0] == '#' || line[0] == '\n') continue;
+		for(i = 0; i < (int)sizeof(ticket_key_t); ++i){
+			int hi = hexval(line[2 * i]), lo = (hi < 0) ? -1 : hexval(line[2 * i + 1]);
+			if(hi < 0 || lo < 0) break;
+			k[i] = (uint8_t)(hi << 4 | lo);
+		}
+		if(i == (int)sizeof(ticket_key_t)) n++;
+		else syslog(LOG_WARNING, "room: skipping malformed key in %s", TICKET_KEY_FILE);
+	}
+	fclose(f);
+	if(!n) return 0;
+
+	memcpy(ticket_keys, keys, n * sizeof(ticket_key_t));
+	num_ticket_keys = n;
+	OPENSSL_cleanse(keys, sizeof(keys));
+	syslog(LOG_INFO, "room: loaded %d TLS ticket key(s) from %s", n, TICKET_KEY_FILE);
+	return n;
+}
+
+static const ticket_key_t *find_ticket_key(const unsigned char *name){
+	for(int i = 0; i < num_ticket_keys; ++i)
+		if(memcmp(name, ticket_keys[i].name, 16) == 0) return &ticket_keys[i];
+	return NULL;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int ticket_key_cb(SSL *s, unsigned char key_name[16], unsigned char *iv,
+                         EVP_CIPHER_CTX *ectx, EVP_MAC_CTX *hctx, int enc){
+#else
+static int ticket_key_cb(SSL *s, unsigned char key_name[16], unsigned char *iv,
+                         EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc){
+#endif
+	const ticket_key_t *k;
+	if(enc){
+		k = &ticket_keys[0];
+		if(RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0) return -1;
+		memcpy(key_name, k->name, 16);
+		if(!EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, k->aes, iv)) return -1;
+	}else{
+		k = find_ticket_key(key_name);
+		if(!k) return 0;	// unknown or retired key: fall back to a full handshake
+		if(!EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, k->aes, iv)) return -1;
+	}
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	OSSL_PARAM params[3];
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, (void *)k->hmac, sizeof(k->hmac));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	if(!EVP_MAC_CTX_set_params(hctx, params)) return -1;
+#else
+	if(!HMAC_Init_ex(hctx, k->hmac, sizeof(k->hmac), EVP_sha256(), NULL)) return -1;
+#endif
+	// 2 = valid, issue a fresh ticket: TLS 1.3 clients treat tickets as single
+	// use, and it moves bridges off retired keys
+	return enc ? 1 : 2;
 }
 
-static void *client_thread(void *arg){
-	client_t *c = (client_t *)arg;
-	uint8_t buf[1024];
+static void setup_session_cache(SSL_CTX *ctx){
+	static const unsigned char sid_ctx[] = "uzenet-room";
+	SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, SESSION_CACHE_SIZE);
+	SSL_CTX_set_timeout(ctx, SESSION_TIMEOUT_S);
+	SSL_CTX_set_num_tickets(ctx, 1);	// one ticket per bridge is enough to resume
+	if(load_ticket_keys() > 0)
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+}
+
+static void reload_ticket_keys(){
+	int had_keys = num_ticket_keys;
+	if(load_ticket_keys() > 0 && !had_keys)
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(tls_ctx, ticket_key_cb);
+}
+
+// -----------------------------------------------------------------------------
+// Handshake
+// -----------------------------------------------------------------------------
+
+static void stats_handshake_done(client_t *c){
+	uint64_t ms = (room_now_us() - c->accepted_us) / 1000;
+	int b = 0;
+	while(b < HS_HIST_BUCKETS - 1 && ms >= (1ULL << b)) b++;
+	stats.hs_hist[b]++;
+	stats.hs_ok++;
+	if(c->ssl && SSL_session_reused(c->ssl)) stats.hs_resumed++;
+	stats.hs_inflight--;
+	stats.dirty = 1;
+}
+
+// With SSL_OP_ENABLE_KTLS, OpenSSL installs the session keys on the socket
+// as soon as the handshake negotiated a cipher the kernel knows. Egress then
+// skips SSL_write() and its copy into the record buffer. Reads stay on
+// SSL_read(): OpenSSL reads through the kernel when it has the receive keys
+// as well, and deals with alerts and key updates either way. If the tls
+// module is missing or the cipher isn't offloaded the session just stays in
+// userspace.
+static void ktls_check(client_t *c){
+#ifdef SSL_OP_ENABLE_KTLS
+	if(!use_ktls || !BIO_get_ktls_send(SSL_get_wbio(c->ssl))) return;
+	c->ktls_tx = 1;
+	stats.hs_ktls++;
+#endif
+}
+
+static void start_login(client_t *c){
+	c->state = CLIENT_LOGIN;
+	c->last_activity_us = room_now_us();
+	list_append(&login_list, c);
 	syslog(LOG_INFO, "room: connected from %s (%s)", c->ip, c->using_tls ? "TLS" : "plain");
+}
+
+// Sniff the first byte and run SSL_accept without blocking the loop.
+// Returns -1 to drop the client, 0 otherwise (check c->state for progress).
+static int client_handshake(client_t *c){
+	if(c->state == CLIENT_SNIFF){
+		uint8_t peek;
+		int r = recv(c->fd, &peek, 1, MSG_PEEK);
+		if(r == 0) return -1;
+		if(r < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+		if(peek != 0x16){
+			stats_handshake_done(c);
+			start_login(c);
+			return 0;
+		}
+		c->using_tls = 1;
+		c->ssl = SSL_new(tls_ctx);
+		if(!c->ssl) return -1;
+		SSL_set_fd(c->ssl, c->fd);
+		SSL_set_accept_state(c->ssl);
+		c->state = CLIENT_HANDSHAKE;
+	}
+
+	c->read_wants_write = 0;
+	int r = SSL_do_handshake(c->ssl);
+	if(r == 1){
+		ktls_check(c);
+		stats_handshake_done(c);
+		start_login(c);
+		return 0;
+	}
+	int e = SSL_get_error(c->ssl, r);
+	if(e == SSL_ERROR_WANT_READ) return 0;
+	if(e == SSL_ERROR_WANT_WRITE){
+		c->read_wants_write = 1;
+		return 0;
+	}
+	syslog(LOG_WARNING, "room: TLS handshake failed from %s", c->ip);
+	ERR_clear_error();
+	stats.hs_failed++;
+	return -1;
+}
+
+static void client_event(client_t *c, uint32_t events){
+	if(events & (EPOLLERR | EPOLLHUP)){
+		close_client(c);
+		return;
+	}
+	if(c->state < CLIENT_LOGIN){
+		if(client_handshake(c) < 0){
+			close_client(c);
+			return;
+		}
+		if(c->state < CLIENT_LOGIN){
+			update_events(c);
+			return;
+		}
+		// The password may already be sitting in the SSL buffer or socket
+		events |= EPOLLIN;
+	}
+	if((events & EPOLLIN) || (c->read_wants_write && (events & EPOLLOUT))){
+		if(client_readable(c) < 0){
+			close_client(c);
+			return;
+		}
+	}
+	if((events & EPOLLOUT) && flush_out(c) < 0){
+		close_client(c);
+		return;
+	}
+	if(c->state == CLIENT_ACTIVE && flush_tunnels(c) < 0){
+		close_client(c);
+		return;
+	}
+	update_events(c);
+}
 
-	if(!do_login(c)){
+int room_client_reply(client_t *c, const uint8_t *data, int len){
+	if(c->ev_kind != EV_CLIENT || c->state != CLIENT_ACTIVE) return -1;
+	if(out_space(c) < len) return 0;
+	if(want_out(c) < 0) return -1;
+	if(c->out_len + len > OUT_BUF_SIZE){
+		memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+		c->out_len -= c->out_off;
+		c->out_off = 0;
+	}
+	memcpy(c->out + c->out_len, data, len);
+	c->out_len += len;
+	return flush_out(c) < 0 ? -1 : len;
+}
+
+void room_client_output(client_t *c){
+	if(c->ev_kind != EV_CLIENT || c->state != CLIENT_ACTIVE || c->out_queued) return;
+	c->out_queued = 1;
+	c->out_next = output_head;
+	output_head = c;
+}
+
+// End of batch: one egress pass per client that had tunnel data queued
+static void flush_output(){
+	while(output_head){
+		client_t *c = output_head;
+		output_head = c->out_next;
+		c->out_queued = 0;
+		if(c->ev_kind != EV_CLIENT) continue;	// closed in this batch
+		if(flush_tunnels(c) < 0){
+			close_client(c);
+			continue;
+		}
+		update_events(c);
+	}
+}
+
+void room_login_done(client_t *c, int ok){
+	if(c->ev_kind != EV_CLIENT || c->state != CLIENT_AUTH) return;
+	if(!ok){
 		syslog(LOG_WARNING, "room: failed login from %s", c->ip);
-		if(c->using_tls && c->ssl) SSL_free(c->ssl);
-		close(c->fd);
-		c->fd = -1;
-		return NULL;
+		close_client(c);
+		return;
 	}
+	login_ok(c);
+	if(process_input(c) < 0){
+		close_client(c);
+		return;
+	}
+	// Edge triggered: whatever arrived during the lookup has no new edge
+	if(!c->in_blocked) client_event(c, EPOLLIN);
+}
 
-	syslog(LOG_INFO, "room: user %s (id %04x) logged in", c->ident.name13, c->ident.user_id);
-	c->last_activity_us = now_us();
+void room_client_resume(client_t *c){
+	if(c->ev_kind != EV_CLIENT || !c->in_blocked) return;
+	c->in_blocked = 0;
+	if(process_input(c) < 0){
+		close_client(c);
+		return;
+	}
+	// Edge triggered: anything that arrived while blocked has no new edge
+	if(!c->in_blocked) client_event(c, EPOLLIN);
+}
 
-	while(!quitting){
-		int r = recv_data(c, buf, sizeof(buf));
-		if(r == 0 || (r < 0 && (!c->using_tls || SSL_get_error(c->ssl, r) != SSL_ERROR_WANT_READ))) break;
-		if(r > 0){
-			c->last_activity_us = now_us();
-			for(int i = 0; i < r; ++i){
-				uint8_t cmd = buf[i];
-				if(cmd == 0xFF){
-					c->flow_hold = 1;
-				}else if(cmd == 0xFE){
-					c->flow_hold = 0;
-				}else if((cmd & 0xF0) == 0xF0){
-					int tunnel = cmd & 0x0F;
-					if(i + 1 >= r) break;
-					int len = buf[++i];
-					if(i + len >= r) break;
-					queue_tunnel(c, tunnel, &buf[i + 1], len);
-					i += len;
-				}else{
-					// TODO: room command dispatch
-				}
-			}
+// -----------------------------------------------------------------------------
+// Accept
+// -----------------------------------------------------------------------------
+
+// Accept never touches the payload: sniffing and the TLS handshake run as
+// per-client states, so a slow peer cannot stall the connections behind it.
+static void accept_clients(){
+	for(;;){
+		struct sockaddr_in cli;
+		socklen_t slen = sizeof(cli);
+		int fd = accept4(listen_fd, (struct sockaddr *)&cli, &slen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd < 0){
+			if(errno == EINTR) continue;
+			return;	// EAGAIN: backlog drained
 		}
-		if(now_us() - c->last_activity_us > 30000000ULL) break;
-		flush_tunnels(c);
-		usleep(1000);
+
+		client_t *c = pool_alloc(&client_pool);
+		if(!c){
+			syslog(LOG_WARNING, "room: session table full (%d), refusing %s", max_clients, inet_ntoa(cli.sin_addr));
+			close(fd);
+			continue;
+		}
+
+		// Egress is coalesced here, so Nagle would only add latency to each batch
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		// A session may stay quiet for up to IDLE_TIMEOUT_US; find dead peers sooner
+		int idle = KEEPALIVE_IDLE_S, intvl = KEEPALIVE_INTVL_S, cnt = KEEPALIVE_CNT;
+		setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+		setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+		setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+		setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+
+		c->ev_kind = EV_CLIENT;
+		c->fd = fd;
+		c->addr = cli;
+		snprintf(c->ip, sizeof(c->ip), "%s", inet_ntoa(cli.sin_addr));
+		c->last_refill = room_now_us();
+		c->tokens = PACE_BURST;
+		c->state = CLIENT_SNIFF;
+		c->accepted_us = room_now_us();
+		list_append(&handshake_list, c);
+		stats.hs_inflight++;
+		stats.dirty = 1;
+
+		struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = c };
+		if(epoll_ctl(room_epfd, EPOLL_CTL_ADD, fd, &ev) < 0){
+			close_client(c);
+			continue;
+		}
+		// The ClientHello often arrives with the SYN's ACK; don't wait for another edge
+		client_event(c, EPOLLIN);
 	}
-	syslog(LOG_INFO, "room: user %s disconnected", c->ident.name13);
-	if(c->using_tls && c->ssl) SSL_free(c->ssl);
-	close(c->fd);
-	c->fd = -1;
-	return NULL;
 }
 
-int main(){
-	signal(SIGINT, signal_handler);
-	openlog("uzenet-room", LOG_PID | LOG_NDELAY, LOG_DAEMON);
+// -----------------------------------------------------------------------------
+// Hot restart
+//
+// SIGUSR2 starts the binary found at our original path with --takeover. Its
+// worker for shard k connects to our abstract socket HANDOFF_NAME(k) and we
+// pass it, over SCM_RIGHTS, the listening socket (so nothing queued in the
+// accept backlog is lost), our multiplexed service connections and every
+// logged-in plain session: the client fd and the fds of its own service
+// links, plus identity, token bucket, flow control,
+// egress state and every byte still buffered or queued. The new process
+// carries on mid-stream and services never see their links drop.
+//
+// TLS state cannot leave OpenSSL, so TLS sessions, and anyone still in the
+// handshake or login, stay here while we drain: no more accepts, exit once
+// the last of them is gone or after HANDOFF_DRAIN_US. Players in a lockstep
+// match and users in the matchmaking queue stay too, since the match and
+// the queue live in this process; they move on a later restart.
+//
+// Records: [type u32][len u32] with the fds attached, then len bytes.
+// -----------------------------------------------------------------------------
 
-	SSL_library_init();
-	OpenSSL_add_all_algorithms();
-	SSL_load_error_strings();
-	tls_ctx = SSL_CTX_new(TLS_server_method());
-	if(!tls_ctx ||
-	   !SSL_CTX_use_certificate_file(tls_ctx, CERT_FILE, SSL_FILETYPE_PEM) ||
-	   !SSL_CTX_use_PrivateKey_file(tls_ctx, KEY_FILE, SSL_FILETYPE_PEM)){
-		ERR_print_errors_fp(stderr);
-		exit(1);
+enum{
+	HANDOFF_LISTEN = 1,	// fd: listening socket
+	HANDOFF_CLIENT,		// fds: client, then links in tunnel order
+	HANDOFF_DONE,
+	HANDOFF_MUX,		// fds: a multiplexed service connection and its shared memory, before any client
+};
+
+typedef struct{
+	struct sockaddr_in addr;
+	struct uzenet_identity ident;
+	int32_t flow_hold;
+	uint64_t tokens, last_refill, last_traffic_us;	// CLOCK_MONOTONIC is system wide
+	uint32_t rtt_us, rtt_var_us;
+	int32_t clock_offset_ms;
+	uint8_t speaks_cmds;
+	egress_drr_t drr;
+	uint16_t in_len, out_len;
+	uint16_t tunnel_mask, link_mask, mux_mask;	// mux: a session, no fd of its own
+} handoff_client_t;
+
+static int handoff_fd = -1;
+static int handoff_tag = EV_HANDOFF;
+static int draining = 0;
+static uint64_t drain_deadline;
+
+static socklen_t handoff_addr(struct sockaddr_un *a, int shard){
+	memset(a, 0, sizeof(*a));
+	a->sun_family = AF_UNIX;
+	int n = snprintf(a->sun_path + 1, sizeof(a->sun_path) - 1, HANDOFF_NAME, shard);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + n;
+}
+
+static void handoff_listen(int shard){
+	struct sockaddr_un a;
+	socklen_t alen = handoff_addr(&a, shard);
+	handoff_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(handoff_fd < 0) return;
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &handoff_tag };
+	if(bind(handoff_fd, (struct sockaddr *)&a, alen) < 0 || listen(handoff_fd, 1) < 0 ||
+	   epoll_ctl(room_epfd, EPOLL_CTL_ADD, handoff_fd, &ev) < 0){
+		syslog(LOG_WARNING, "room: hot restart unavailable for shard %d: %s", shard, strerror(errno));
+		close(handoff_fd);
+		handoff_fd = -1;
 	}
+}
 
-	int sock = socket(AF_INET, SOCK_STREAM, 0);
-	int opt = 1;
-	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+static void set_timeouts(int fd, uint64_t us){
+	struct timeval tv = { .tv_sec = us / 1000000, .tv_usec = us % 1000000 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int send_record(int sock, uint32_t type, const handoff_buf_t *b, const int *fds, int nfds){
+	uint32_t hdr[2] = { type, b ? b->len : 0 };
+	struct iovec iov = { .iov_base = hdr, .iov_len = sizeof(hdr) };
+	union{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * (1 + MAX_SERVICE_TUNNELS))];
+	} cm;
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	if(nfds){
+		msg.msg_control = cm.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		struct cmsghdr *h = CMSG_FIRSTHDR(&msg);
+		h->cmsg_level = SOL_SOCKET;
+		h->cmsg_type = SCM_RIGHTS;
+		h->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(h), fds, sizeof(int) * nfds);
+	}
+	if(sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(hdr)) return -1;
+	for(size_t off = 0; b && off < b->len; ){
+		ssize_t w = send(sock, b->p + off, b->len - off, MSG_NOSIGNAL);
+		if(w <= 0) return -1;
+		off += w;
+	}
+	return 0;
+}
 
-	struct sockaddr_in addr = {
-		.sin_family = AF_INET,
-		.sin_port = htons(PORT),
-		.sin_addr.s_addr = INADDR_ANY,
+// Returns the record type, -1 on error. The header is read on its own so the
+// fds that came with it are never mixed up with the next record's.
+static int recv_record(int sock, handoff_buf_t *b, int *fds, int *nfds){
+	uint32_t hdr[2];
+	struct iovec iov = { .iov_base = hdr, .iov_len = sizeof(hdr) };
+	union{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * (1 + MAX_SERVICE_TUNNELS))];
+	} cm;
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cm.buf, .msg_controllen = sizeof(cm.buf) };
+	*nfds = 0;
+	if(recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(hdr)) return -1;
+	for(struct cmsghdr *h = CMSG_FIRSTHDR(&msg); h; h = CMSG_NXTHDR(&msg, h)){
+		if(h->cmsg_level != SOL_SOCKET || h->cmsg_type != SCM_RIGHTS) continue;
+		*nfds = (h->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(h), sizeof(int) * *nfds);
+	}
+	if(hdr[1] > b->cap) return -1;
+	b->len = b->off = 0;
+	while(b->len < hdr[1]){
+		ssize_t r = recv(sock, b->p + b->len, hdr[1] - b->len, 0);
+		if(r <= 0) return -1;
+		b->len += r;
+	}
+	return hdr[0];
+}
+
+// Returns the number of fds to pass, or 0 if the session has to stay
+static int client_save(client_t *c, handoff_buf_t *b, int *fds){
+	if(c->state != CLIENT_ACTIVE || c->using_tls || c->in_match || c->mm_queued) return 0;
+	handoff_client_t h = {
+		.addr = c->addr,
+		.ident = c->ident,
+		.flow_hold = c->flow_hold,
+		.tokens = c->tokens,
+		.last_refill = c->last_refill,
+		.last_traffic_us = c->last_traffic_us,
+		.rtt_us = c->rtt_us,
+		.rtt_var_us = c->rtt_var_us,
+		.clock_offset_ms = c->clock_offset_ms,
+		.speaks_cmds = c->speaks_cmds,
+		.drr = c->drr,
+		.in_len = c->in_len,
+		.out_len = c->out_len - c->out_off,
 	};
-	if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0){
-		perror("bind");
+	for(int i = 0; i < MAX_SERVICE_TUNNELS; ++i){
+		if(c->tunnels[i] && ring_used(&c->tunnels[i]->ring)) h.tunnel_mask |= 1 << i;
+		if(c->links[i]) h.link_mask |= 1 << i;
+		if(c->links[i] && router_link_muxed(c, i)) h.mux_mask |= 1 << i;
+	}
+	b->len = 0;
+	hbuf_put(b, &h, sizeof(h));
+	if(c->in_len) hbuf_put(b, c->in, c->in_len);
+	if(h.out_len) hbuf_put(b, c->out + c->out_off, h.out_len);
+	for(int i = 0; i < MAX_SERVICE_TUNNELS; ++i){
+		if(!(h.tunnel_mask & (1 << i))) continue;
+		struct service_tunnel *t = c->tunnels[i];
+		struct iovec span[2];
+		int n = ring_peek(&t->ring, t->queue, TUNNEL_QUEUE_SIZE, span, TUNNEL_QUEUE_SIZE);
+		uint16_t used = ring_used(&t->ring);
+		hbuf_put(b, &used, sizeof(used));
+		for(int k = 0; k < n; ++k) hbuf_put(b, span[k].iov_base, span[k].iov_len);
+	}
+	pubsub_client_save(c, b);
+	int nfds = 0;
+	fds[nfds++] = c->fd;
+	for(int i = 0; i < MAX_SERVICE_TUNNELS; ++i){
+		int fd;
+		if((h.link_mask & (1 << i)) && router_link_save(c, i, b, &fd) == 0 && fd >= 0) fds[nfds++] = fd;
+	}
+	return nfds;
+}
+
+static int client_restore(handoff_buf_t *b, const int *fds, int nfds){
+	handoff_client_t h;
+	client_t *c;
+	int used_fds = 1;
+	if(hbuf_get(b, &h, sizeof(h)) < 0 || h.in_len > IN_BUF_SIZE || h.out_len > OUT_BUF_SIZE ||
+	   1 + __builtin_popcount(h.link_mask & ~h.mux_mask) != nfds || !(c = pool_alloc(&client_pool)))
+		goto fail;
+
+	c->ev_kind = EV_CLIENT;
+	c->fd = fds[0];
+	c->addr = h.addr;
+	snprintf(c->ip, sizeof(c->ip), "%s", inet_ntoa(h.addr.sin_addr));
+	c->ident = h.ident;
+	c->flow_hold = h.flow_hold;
+	c->tokens = h.tokens;
+	c->last_refill = h.last_refill;
+	c->last_traffic_us = h.last_traffic_us;
+	c->last_activity_us = h.last_traffic_us;
+	c->accepted_us = h.last_traffic_us;
+	c->rtt_us = h.rtt_us;
+	c->rtt_var_us = h.rtt_var_us;
+	c->clock_offset_ms = h.clock_offset_ms;
+	c->speaks_cmds = h.speaks_cmds;
+	c->drr = h.drr;
+	c->in_len = h.in_len;
+	c->out_len = h.out_len;
+	c->state = CLIENT_ACTIVE;
+	if(h.in_len && (want_in(c) < 0 || hbuf_get(b, c->in, h.in_len) < 0)) goto fail_client;
+	if(h.out_len && (want_out(c) < 0 || hbuf_get(b, c->out, h.out_len) < 0)) goto fail_client;
+	for(int i = 0; i < MAX_SERVICE_TUNNELS; ++i){
+		if(!(h.tunnel_mask & (1 << i))) continue;
+		uint16_t len;
+		uint8_t tmp[TUNNEL_QUEUE_SIZE];
+		if(hbuf_get(b, &len, sizeof(len)) < 0 || len > TUNNEL_QUEUE_SIZE || hbuf_get(b, tmp, len) < 0) goto fail_client;
+		room_queue_tunnel(c, i, tmp, len);
+	}
+	if(pubsub_client_restore(c, b) < 0) goto fail_client;
+
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = c };
+	if(epoll_ctl(room_epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) goto fail_client;
+	idle_append(c);
+	shard_user_online(c);
+	for(int i = 0; i < MAX_SERVICE_TUNNELS; ++i){
+		if(!(h.link_mask & (1 << i))) continue;
+		int fd = h.mux_mask & (1 << i) ? -1 : fds[used_fds++];
+		if(router_link_restore(c, i, fd, b) < 0 && fd >= 0) close(fd);
+	}
+	// Leftover input, buffered output and queued tunnel data all move on now
+	if(process_input(c) < 0){
+		close_client(c);
+		return 0;
+	}
+	client_event(c, EPOLLIN | EPOLLOUT);
+	return 0;
+
+fail_client:
+	pubsub_client_closed(c);
+	for(int i = 0; i < MAX_SERVICE_TUNNELS; ++i)
+		if(c->tunnels[i]) pool_free(&tunnel_pool, c->tunnels[i]);
+	release_buffers(c);
+	pool_free(&client_pool, c);
+fail:
+	for(int i = 0; i < nfds; ++i) close(fds[i]);
+	return -1;
+}
+
+// Old process: a new binary connected, give it everything it can take
+static void handoff_event(){
+	int sock = accept4(handoff_fd, NULL, NULL, SOCK_CLOEXEC);
+	if(sock < 0) return;
+	set_timeouts(sock, HANDOFF_TIMEOUT_US);
+	// The new process binds the name for the next restart
+	epoll_ctl(room_epfd, EPOLL_CTL_DEL, handoff_fd, NULL);
+	close(handoff_fd);
+	handoff_fd = -1;
+
+	handoff_buf_t b = { .p = malloc(HANDOFF_RECORD_MAX), .cap = HANDOFF_RECORD_MAX };
+	int moved = 0, kept = 0, fds[1 + MAX_SERVICE_TUNNELS];
+	if(!b.p || send_record(sock, HANDOFF_LISTEN, NULL, &listen_fd, 1) < 0){
+		syslog(LOG_ERR, "room: hot restart failed, keeping all sessions");
+		free(b.p);
+		close(sock);
+		return;
+	}
+	epoll_ctl(room_epfd, EPOLL_CTL_DEL, listen_fd, NULL);
+	close(listen_fd);
+	listen_fd = -1;
+	for(int i = 0; i < MAX_SERVICE_TUNNELS; ++i){
+		int n = router_mux_save(i, &b, fds);
+		if(n < 0 || send_record(sock, HANDOFF_MUX, &b, fds, n) < 0) continue;
+		router_mux_handed(i);
+	}
+
+	client_t *next;
+	for(client_t *c = idle_list.head; c; c = next){
+		next = c->tnext;
+		int n = client_save(c, &b, fds);
+		if(!n){
+			kept++;
+			continue;
+		}
+		if(send_record(sock, HANDOFF_CLIENT, &b, fds, n) < 0) break;
+		release_client(c);
+		moved++;
+	}
+	send_record(sock, HANDOFF_DONE, NULL, NULL, 0);
+	close(sock);
+	free(b.p);
+	router_handoff_done();
+
+	draining = 1;
+	drain_deadline = room_now_us() + HANDOFF_DRAIN_US;
+	syslog(LOG_INFO, "room: handed %d session(s) to the new process, draining %d (%d of them TLS, playing or queued)",
+	       moved, client_pool.used - moved, kept);
+}
+
+// New process: take over shard <shard> from a running room, if there is one.
+// Returns the inherited listening socket or -1 to open our own.
+static int handoff_receive(int shard){
+	struct sockaddr_un a;
+	socklen_t alen = handoff_addr(&a, shard);
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sock < 0) return -1;
+	if(connect(sock, (struct sockaddr *)&a, alen) < 0){
+		close(sock);
+		return -1;
+	}
+	set_timeouts(sock, HANDOFF_TIMEOUT_US);
+
+	handoff_buf_t b = { .p = malloc(HANDOFF_RECORD_MAX), .cap = HANDOFF_RECORD_MAX };
+	int lfd = -1, sessions = 0, fds[1 + MAX_SERVICE_TUNNELS], nfds = 0;
+	for(;;){
+		int type = b.p ? recv_record(sock, &b, fds, &nfds) : -1;
+		if(type == HANDOFF_LISTEN && nfds == 1 && lfd < 0){
+			lfd = fds[0];
+		}else if(type == HANDOFF_MUX && nfds >= 1){
+			router_mux_restore(fds, nfds, &b);
+		}else if(type == HANDOFF_CLIENT){
+			if(client_restore(&b, fds, nfds) == 0) sessions++;
+		}else{
+			for(int i = 0; i < nfds; ++i) close(fds[i]);
+			if(type != HANDOFF_DONE) syslog(LOG_WARNING, "room: hot restart cut short");
+			break;
+		}
+	}
+	close(sock);
+	free(b.p);
+	router_takeover_done();
+	syslog(LOG_INFO, "room: took over shard %d with %d session(s)", shard, sessions);
+	return lfd;
+}
+
+// Re-exec the binary at our original path, keeping the pid systemd watches.
+// A lone worker forks first and the child stays behind to hand off and drain;
+// under --workers the existing workers do that and only the supervisor execs.
+static void hot_restart(){
+	if(access(exe_path, X_OK) != 0){
+		syslog(LOG_ERR, "room: hot restart: %s: %s", exe_path, strerror(errno));
+		return;
+	}
+	if(!supervised && room_shard_count() == 1){
+		pid_t pid = fork();
+		if(pid < 0){
+			syslog(LOG_ERR, "room: hot restart: fork: %s", strerror(errno));
+			return;
+		}
+		if(pid == 0) return;	// the old room, until the new one connects
+	}
+	int argc = 0;
+	while(saved_argv[argc]) argc++;
+	char **argv = calloc(argc + 2, sizeof(char *));
+	int n = 0;
+	for(int i = 0; i < argc; ++i)
+		if(strcmp(saved_argv[i], "--takeover") != 0) argv[n++] = saved_argv[i];
+	argv[n++] = "--takeover";
+	execv(exe_path, argv);
+	syslog(LOG_ERR, "room: hot restart: exec %s: %s", exe_path, strerror(errno));
+	_exit(1);
+}
+
+// -----------------------------------------------------------------------------
+// Timers
+// -----------------------------------------------------------------------------
+
+static void stats_flush(uint64_t now){
+	if(!stats.dirty || now < stats.next_flush_us) return;
+	stats.dirty = 0;
+	stats.next_flush_us = now + STATS_INTERVAL_US;
+	// uzenet-metrics serves one connection at a time, so don't hold one open
+	if(metrics_init(METRICS_PATH) != 0) return;
+	if(room_shard_count() > 1){
+		char name[64];
+		snprintf(name, sizeof(name), "room_tls_handshakes_inflight{shard=\"%d\"}", room_shard_id());
+		metrics_gauge(name, stats.hs_inflight);
+		snprintf(name, sizeof(name), "room_sessions_hibernating{shard=\"%d\"}", room_shard_id());
+		metrics_gauge(name, stats.hibernating);
+	}else{
+		metrics_gauge("room_tls_handshakes_inflight", stats.hs_inflight);
+		metrics_gauge("room_sessions_hibernating", stats.hibernating);
+	}
+	if(stats.hs_ok) metrics_counter("room_tls_handshakes_ok", stats.hs_ok);
+	if(stats.hs_resumed) metrics_counter("room_tls_handshakes_resumed", stats.hs_resumed);
+	if(stats.hs_ktls) metrics_counter("room_tls_handshakes_ktls", stats.hs_ktls);
+	if(stats.hs_failed) metrics_counter("room_tls_handshakes_failed", stats.hs_failed);
+	if(stats.hs_timeout) metrics_counter("room_tls_handshakes_timeout", stats.hs_timeout);
+	// Prometheus-style cumulative buckets
+	uint32_t cum = 0;
+	for(int b = 0; b < HS_HIST_BUCKETS; ++b){
+		char name[64];
+		cum += stats.hs_hist[b];
+		if(b == HS_HIST_BUCKETS - 1)
+			snprintf(name, sizeof(name), "room_tls_handshake_ms_bucket{le=\"+Inf\"}");
+		else
+			snprintf(name, sizeof(name), "room_tls_handshake_ms_bucket{le=\"%u\"}", 1u << b);
+		if(cum) metrics_counter(name, cum);
+	}
+	if(stats.tx_records){
+		metrics_counter("room_egress_records", stats.tx_records);
+		metrics_counter("room_egress_bytes", (int)stats.tx_bytes);
+	}
+	// Per client: writes per second (one TLS record each for TLS clients) and
+	// the average record size. A client that went quiet gets one last 0.
+	double secs = stats.last_flush_us ? (now - stats.last_flush_us) / 1e6 : STATS_INTERVAL_US / 1e6;
+	for(client_t *c = idle_list.head; c; c = c->tnext){
+		if(!c->tx_records && !c->tx_reported) continue;
+		char name[96];
+		snprintf(name, sizeof(name), "room_client_records_per_sec{user=\"%s\"}", c->ident.name13);
+		metrics_gauge(name, c->tx_records / secs);
+		snprintf(name, sizeof(name), "room_client_bytes_per_record{user=\"%s\"}", c->ident.name13);
+		metrics_gauge(name, c->tx_records ? (double)c->tx_bytes / c->tx_records : 0);
+		c->tx_reported = c->tx_records != 0;
+		if(c->tx_reported) stats.dirty = 1;
+		c->tx_records = c->tx_bytes = 0;
+	}
+	metrics_close();
+	stats.last_flush_us = now;
+	stats.hs_ok = stats.hs_resumed = stats.hs_failed = stats.hs_timeout = stats.hs_ktls = 0;
+	stats.tx_records = 0;
+	stats.tx_bytes = 0;
+	memset(stats.hs_hist, 0, sizeof(stats.hs_hist));
+}
+
+static void run_timers(){
+	uint64_t now = room_now_us();
+
+	while(handshake_list.head && now - handshake_list.head->accepted_us > HANDSHAKE_TIMEOUT_US){
+		syslog(LOG_WARNING, "room: handshake timeout from %s", handshake_list.head->ip);
+		stats.hs_timeout++;
+		close_client(handshake_list.head);
+	}
+
+	while(login_list.head && now - login_list.head->last_activity_us > IDENTITY_TIMEOUT_US){
+		syslog(LOG_WARNING, "room: failed login from %s", login_list.head->ip);
+		close_client(login_list.head);
+	}
+	while(idle_list.head && now - idle_list.head->last_traffic_us > IDLE_TIMEOUT_US)
+		close_client(idle_list.head);
+	while(hibernate_next && now - hibernate_next->last_traffic_us >= HIBERNATE_US){
+		client_t *c = hibernate_next;
+		hibernate_next = c->tnext;
+		hibernate_client(c);
+	}
+
+	// pace_due is re-read each pass: a flush can close any client, not just
+	// the one being flushed
+	lockstep_timers(now);
+	matchmaking_timers(now);
+
+	pace_advance(now);
+	while(pace_due){
+		client_t *c = pace_due;
+		pace_remove(c);
+		if(flush_tunnels(c) < 0) close_client(c);
+	}
+
+	if(now >= next_ping_us){
+		next_ping_us = now + ROOM_PING_INTERVAL_US;
+		for(client_t *c = idle_list.head, *next; c; c = next){
+			next = c->tnext;
+			if(!c->hibernating && room_ping(c, now) < 0) close_client(c);
+		}
+	}
+
+	stats_flush(now);
+}
+
+// Milliseconds until the earliest deadline, or -1 to sleep until I/O.
+static int next_timeout_ms(){
+	uint64_t now = room_now_us();
+	uint64_t next = UINT64_MAX;
+
+	if(handshake_list.head) next = handshake_list.head->accepted_us + HANDSHAKE_TIMEOUT_US;
+	if(login_list.head && login_list.head->last_activity_us + IDENTITY_TIMEOUT_US < next)
+		next = login_list.head->last_activity_us + IDENTITY_TIMEOUT_US;
+	if(idle_list.head && idle_list.head->last_traffic_us + IDLE_TIMEOUT_US < next)
+		next = idle_list.head->last_traffic_us + IDLE_TIMEOUT_US;
+	if(hibernate_next && hibernate_next->last_traffic_us + HIBERNATE_US < next)
+		next = hibernate_next->last_traffic_us + HIBERNATE_US;
+	uint64_t pace = pace_next_us();
+	if(pace < next) next = pace;
+	uint64_t lockstep = lockstep_next_us();
+	if(lockstep < next) next = lockstep;
+	uint64_t matchmaking = matchmaking_next_us();
+	if(matchmaking < next) next = matchmaking;
+	if(idle_list.head && next_ping_us < next) next = next_ping_us;
+
+	if(stats.dirty && stats.next_flush_us < next)
+		next = stats.next_flush_us;
+	if(draining && drain_deadline < next)
+		next = drain_deadline;
+
+	if(next == UINT64_MAX) return -1;
+	if(next <= now) return 0;
+	return (int)((next - now + 999) / 1000);
+}
+
+static void usage(const char *prog){
+	fprintf(stderr, "usage: %s [--max-clients N] [--workers N] [--ktls] [--takeover]\n", prog);
+	exit(1);
+}
+
+// One event loop over this worker's share of the sessions. Every worker binds
+// the port itself with SO_REUSEPORT so the kernel balances accepts.
+static int run_worker(int shard){
+	room_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(room_epfd < 0){
+		perror("epoll_create1");
 		exit(1);
 	}
-	if(listen(sock, 16) < 0){
-		perror("listen");
+
+	// These register their links with the loop
+	if(shard_attach(shard) < 0){
+		perror("shard_attach");
 		exit(1);
 	}
+	router_init(ROUTES_FILE);
+	identity_init();
+	pubsub_init();
+	lockstep_init();
 
-	printf("Uzenet Room Server listening on port %d (TLS+plain)\n", PORT);
+	listen_fd = takeover ? handoff_receive(shard) : -1;
+	if(listen_fd < 0){
+		listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int opt = 1;
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
 
-	for(int i = 0; i < MAX_CLIENTS; ++i)
-		clients[i].fd = -1;
+		struct sockaddr_in addr = {
+			.sin_family = AF_INET,
+			.sin_port = htons(PORT),
+			.sin_addr.s_addr = INADDR_ANY,
+		};
+		if(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+			perror("bind");
+			exit(1);
+		}
+		if(listen(listen_fd, 128) < 0){
+			perror("listen");
+			exit(1);
+		}
+	}
+	set_nonblock(listen_fd);
+	struct epoll_event lev = { .events = EPOLLIN, .data.ptr = &listen_tag };
+	epoll_ctl(room_epfd, EPOLL_CTL_ADD, listen_fd, &lev);
+	handoff_listen(shard);
 
+	pace_wheel.tick = room_now_us() / PACE_TICK_US;
+
+	struct epoll_event events[MAX_EVENTS];
 	while(!quitting){
-		struct sockaddr_in cli;
-		socklen_t slen = sizeof(cli);
-		int fd = accept(sock, (struct sockaddr *)&cli, &slen);
-		if(fd < 0){
-			if(errno == EINTR) break;
-			continue;
+		if(reload_pending){
+			reload_pending = 0;
+			reload_ticket_keys();
+		}
+		if(upgrade_pending){
+			upgrade_pending = 0;
+			if(!draining && !supervised) hot_restart();
+		}
+		if(draining && (!client_pool.used || room_now_us() >= drain_deadline)) break;
+		int n = epoll_wait(room_epfd, events, MAX_EVENTS, next_timeout_ms());
+		if(n < 0){
+			if(errno == EINTR) continue;
+			perror("epoll_wait");
+			break;
 		}
+		for(int i = 0; i < n; ++i){
+			switch(*(int *)events[i].data.ptr){
+			case EV_LISTEN: accept_clients(); break;
+			case EV_CLIENT: client_event(events[i].data.ptr, events[i].events); break;
+			case EV_LINK:   router_event(events[i].data.ptr, events[i].events); break;
+			case EV_IDENTITY: identity_event(events[i].data.ptr, events[i].events); break;
+			case EV_SHARD:  shard_event(); break;
+			case EV_HANDOFF: handoff_event(); break;
+			default: break;	// closed earlier in this batch
+			}
+		}
+		run_timers();
+		router_flush();
+		flush_output();
+		shard_flush();
+		flush_deferred();
+	}
 
-		uint8_t peek;
-		recv(fd, &peek, 1, MSG_PEEK);
-
-		for(int i = 0; i < MAX_CLIENTS; ++i){
-			if(clients[i].fd < 0){
-				clients[i].fd = fd;
-				clients[i].addr = cli;
-				snprintf(clients[i].ip, sizeof(clients[i].ip), "%s", inet_ntoa(cli.sin_addr));
-				struct timeval now;
-				gettimeofday(&now, NULL);
-				clients[i].last_refill = (uint64_t)now.tv_sec * 1000000ULL + now.tv_usec;
-				clients[i].tokens = 65536;
-				clients[i].using_tls = (peek == 0x16);
-				clients[i].ssl = NULL;
-				if(clients[i].using_tls){
-					SSL *ssl = SSL_new(tls_ctx);
-					SSL_set_fd(ssl, fd);
-					if(SSL_accept(ssl) <= 0){
-						ERR_print_errors_fp(stderr);
-						close(fd);
-						clients[i].fd = -1;
-						continue;
-					}
-					clients[i].ssl = ssl;
-				}
-				pthread_create(&clients[i].thread, NULL, client_thread, &clients[i]);
-				break;
+	while(handshake_list.head) close_client(handshake_list.head);
+	while(login_list.head) close_client(login_list.head);
+	while(idle_list.head) close_client(idle_list.head);
+	flush_deferred();
+	close(room_epfd);
+	if(listen_fd >= 0) close(listen_fd);
+	return 0;
+}
+
+// Fork one worker per shard, forward signals to them and replace any that
+// die. A replacement resumes its shard's rings and directory slots.
+static int supervise(int workers){
+	pid_t pids[MAX_WORKERS];
+
+	for(int k = 0; k < workers; ++k){
+		pids[k] = fork();
+		if(pids[k] < 0){
+			perror("fork");
+			exit(1);
+		}
+		if(pids[k] == 0){
+			supervised = 1;
+			exit(run_worker(k));
+		}
+	}
+
+	while(!quitting){
+		if(reload_pending){
+			reload_pending = 0;
+			for(int k = 0; k < workers; ++k) kill(pids[k], SIGHUP);
+		}
+		if(upgrade_pending){
+			upgrade_pending = 0;
+			hot_restart();	// the workers stay behind and hand off to the new ones
+		}
+		int status;
+		pid_t pid = wait(&status);
+		if(pid < 0){
+			if(errno == EINTR) continue;
+			break;
+		}
+		for(int k = 0; k < workers; ++k){
+			if(pids[k] != pid || quitting) continue;
+			syslog(LOG_ERR, "room: worker %d (pid %d) exited with status %d, restarting", k, pid, status);
+			sleep(1);
+			pids[k] = fork();
+			if(pids[k] == 0){
+				supervised = 1;
+				exit(run_worker(k));
 			}
 		}
 	}
 
-	close(sock);
-	closelog();
+	for(int k = 0; k < workers; ++k)
+		if(pids[k] > 0) kill(pids[k], SIGTERM);
+	while(wait(NULL) > 0 || errno == EINTR);
 	return 0;
 }
+
+int main(int argc, char *argv[]){
+	int workers = 1;
+	for(int i = 1; i < argc; ++i){
+		if(strcmp(argv[i], "--max-clients") == 0 && i + 1 < argc){
+			max_clients = atoi(argv[++i]);
+			if(max_clients <= 0) usage(argv[0]);
+		}else if(strcmp(argv[i], "--workers") == 0 && i + 1 < argc){
+			workers = atoi(argv[++i]);
+			if(workers <= 0 || workers > MAX_WORKERS) usage(argv[0]);
+		}else if(strcmp(argv[i], "--ktls") == 0){
+			use_ktls = 1;
+		}else if(strcmp(argv[i], "--takeover") == 0){
+			takeover = 1;
+		}else{
+			usage(argv[0]);
+		}
+	}
+	client_pool.max = (max_clients + workers - 1) / workers;
+
+	// SA_RESTART off so wait() in the supervisor sees signals
+	struct sigaction sa = { .sa_handler = signal_handler };
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = reload_handler;
+	sigaction(SIGHUP, &sa, NULL);
+	sa.sa_handler = upgrade_handler;
+	sigaction(SIGUSR2, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	// A lone worker's predecessor is our child after a hot restart; nobody waits for it
+	if(workers == 1) signal(SIGCHLD, SIG_IGN);
+
+	saved_argv = argv;
+	ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+	if(len > 0){
+		exe_path[len] = 0;
+		// After an upgrade the old inode shows up as "path (deleted)"
+		char *del = strstr(exe_path, " (deleted)");
+		if(del) *del = 0;
+	}
+	openlog("uzenet-room", LOG_PID | LOG_NDELAY, LOG_DAEMON);
+
+	SSL_library_init();
+	OpenSSL_add_all_algorithms();
+	SSL_load_error_strings();
+	tls_ctx = SSL_CTX_new(TLS_server_method());
+	if(!tls_ctx ||
+	   !SSL_CTX_use_certificate_file(tls_ctx, CERT_FILE, SSL_FILETYPE_PEM) ||
+	   !SSL_CTX_use_PrivateKey_file(tls_ctx, KEY_FILE, SSL_FILETYPE_PEM)){
+		ERR_print_errors_fp(stderr);
+		exit(1);
+	}
+	SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+	                          SSL_MODE_RELEASE_BUFFERS);
+#ifdef SSL_OP_ENABLE_KTLS
+	if(use_ktls) SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+#else
+	if(use_ktls) fprintf(stderr, "uzenet-room: OpenSSL built without kTLS, --ktls ignored\n");
+#endif
+	setup_session_cache(tls_ctx);
+	load_egress_policy(EGRESS_FILE);
+
+	if(shard_setup(workers) < 0){
+		perror("shard_setup");
+		exit(1);
+	}
+
+	printf("Uzenet Room Server listening on port %d (TLS+plain, max %d clients, %d worker%s)\n",
+	       PORT, max_clients, workers, workers > 1 ? "s" : "");
+	fflush(stdout);
+
+	int r = (workers == 1) ? run_worker(0) : supervise(workers);
+	closelog();
+	return r;
+}
@@ -2,11 +2,20 @@
 #define UZENET_ROOM_SERVER_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <openssl/ssl.h>
 
-#define MAX_CLIENTS 64
-#define MAX_SERVICE_TUNNELS 16
+#include "../uzenet-identity/uzenet-identity-client.h"
+#include "uzenet-room-ring.h"
+#include "uzenet-room-egress.h"
+#include "uzenet-room-pubsub.h"
+
+#define DEFAULT_MAX_CLIENTS 4096	// override with --max-clients
+#define MAX_SERVICE_TUNNELS EGRESS_TUNNELS	// 16
+#define MAX_WORKERS 64		// --workers, one shard each
 
 // Framing control
 #define FRAME_HOLD_TRANSMISSION   0xFF  // client: stop sending until further notice
@@ -19,51 +28,295 @@
 // Frame format: [0xFx][len][payload...]
 #define MAX_FRAME_PAYLOAD         255
 
-// Room commands (non-framed legacy commands)
-#define ROOM_CMD_NULL             0x00
-#define ROOM_CMD_PING             0x01
-#define ROOM_CMD_GET_TIME         0x02
+// Room commands: bytes outside a frame, both directions (see uzenet-room-command.c)
+#define ROOM_CMD_NULL             0x00  // [0x00] keepalive
+#define ROOM_CMD_PING             0x01  // [0x01][seq]
+#define ROOM_CMD_GET_TIME         0x02  // [0x02] -> [0x02][unix time u32][ms u16]
+#define ROOM_CMD_PONG             0x03  // [0x03][seq][sender's clock, ms u32]
 // ... Add more room commands as needed
 
 // Service tunnel types (defined by client and server convention)
 #define TUNNEL_CHAT               0
-#define TUNNEL_AUDIO              1
+#define TUNNEL_AUDIO              1	// -> uzenet-radio
 #define TUNNEL_GAMEPLAY           2
-#define TUNNEL_MATCHMAKING        3
+#define TUNNEL_MATCHMAKING        3	// handled in the room, uzenet-room-matchmaking.c
 #define TUNNEL_SIDELOAD           4
-// ... Up to 15 total
-
-// Functions to be implemented in other modules if needed
-void dispatch_room_command(int client_index, uint8_t cmd);
-void dispatch_tunnel_data(int client_index, int tunnel_id, const uint8_t *data, int len);
+#define TUNNEL_FATFS              5	// -> uzenet-fatfs
+#define TUNNEL_LICHESS            6	// -> uzenet-lichess
+#define TUNNEL_ZIPSTREAM          7	// -> uzenet-zipstream
+#define TUNNEL_SSH                8	// -> uzenet-ssh
+#define TUNNEL_FUJINET            9	// -> uzenet-virtual-fujinet
+// ... Up to 13 total (0xFE/0xFF are flow control)
 
 /* ────────────────────────────────────────────── */
-/* Tunnel framing helpers for services           */
-/* (room <-> service over AF_UNIX socket)        */
+/* Room internals shared by the uzenet-room-*.c  */
+/* modules. Everything runs on the event loop    */
+/* thread, so none of this is locked.            */
 /* ────────────────────────────────────────────── */
-/* Returns 0 on success, non-zero on EOF/error.
- *  - sock      : AF_UNIX socket connected to uzenet-room
- *  - out_uid   : user id for this frame
- *  - tunnel_id : which logical tunnel (0..15)
- *  - buf       : payload buffer
- *  - inout_len : on entry, size of buf; on return, actual payload length
- */
-int ReadTunnelFramed(int sock,
-                     uint16_t *out_uid,
-                     uint8_t  *tunnel_id,
-                     uint8_t  *buf,
-                     uint16_t *inout_len);
-
-/* Returns 0 on success, non-zero on error.
- *  - sock      : AF_UNIX socket to room
- *  - uid       : user id
- *  - tunnel_id : which tunnel (0..15)
- *  - buf/len   : payload to send
- */
-int WriteTunnelFramed(int sock,
-                      uint16_t uid,
-                      uint8_t  tunnel_id,
-                      const uint8_t *buf,
-                      uint16_t len);
+
+#define IN_BUF_SIZE		1024	// must hold at least one full [0xFx][len][255] frame
+#define OUT_BUF_SIZE		8192
+#define TUNNEL_QUEUE_SIZE	4096	// power of two, see uzenet-room-ring.h
+
+// First member of every object registered with epoll, so the loop can tell
+// what an event's data.ptr points at.
+enum{
+	EV_DEAD = 0,		// closed this iteration, freed once the batch is done
+	EV_LISTEN,
+	EV_CLIENT,
+	EV_LINK,		// room <-> service AF_UNIX link
+	EV_IDENTITY,		// room <-> uzenet-identity link
+	EV_SHARD,		// another worker queued records for this shard
+	EV_HANDOFF,		// a new room binary asking for our sessions
+};
+
+enum{
+	CLIENT_FREE = 0,
+	CLIENT_SNIFF,		// waiting for the first byte: 0x16 means TLS
+	CLIENT_HANDSHAKE,	// non-blocking SSL_accept in progress
+	CLIENT_LOGIN,		// waiting for the 6 byte password
+	CLIENT_AUTH,		// password sent to uzenet-identity, waiting for the answer
+	CLIENT_ACTIVE,
+};
+
+typedef struct client_s client_t;
+typedef struct room_link_s room_link_t;
+typedef struct room_id_request_s room_id_request_t;
+typedef struct room_sub_s room_sub_t;
+
+// Intrusive FIFO of clients ordered by deadline. Every list holds clients
+// sharing the same timeout, so appending on activity keeps it sorted and the
+// head is always the next one to expire.
+typedef struct{
+	client_t *head, *tail;
+} client_list_t;
+
+// Producer: the service link; consumer: flush_tunnels() toward the Uzebox
+struct service_tunnel{
+	room_ring_t ring;
+	uint8_t queue[TUNNEL_QUEUE_SIZE];
+	pubsub_queue_t pub;		// channel frames, sent while the ring is empty
+};
+
+struct client_s{
+	int ev_kind;			// EV_CLIENT
+	int fd;
+	SSL *ssl;
+	int using_tls;
+	int ktls_tx;			// kernel encrypts egress: plain send()/writev() past the handshake
+	int state;
+	struct sockaddr_in addr;
+	char ip[64];
+	struct uzenet_identity ident;
+	int flow_hold;
+	uint64_t tokens;
+	uint64_t last_refill;
+	uint64_t last_activity_us;
+	uint64_t last_traffic_us;	// last byte other than a keepalive: hibernation, IDLE_TIMEOUT_US
+
+	uint8_t pw[6];
+	int pw_got;
+	room_id_request_t *id_req;	// in flight on an identity link
+	uint32_t session_id;		// per shard, published in the user directory
+	client_t *session_next;		// session id hash chain
+	room_sub_t *subs;		// channels this client listens on
+	uint16_t match_id;		// lockstep match joined, valid while in_match
+	uint8_t in_match;
+	uint8_t mm_queued, mm_home;	// matchmaking queue joined, and its shard
+
+	uint8_t speaks_cmds;		// sent a room command, so it may be probed
+	uint8_t ping_seq;
+	uint64_t ping_sent_us;		// probe outstanding, 0 = none
+	uint32_t rtt_us, rtt_var_us;	// smoothed round trip, 0 = not measured yet
+	int32_t clock_offset_ms;	// client clock minus room clock, valid once rtt_us is
+
+	uint8_t *in;			// IN_BUF_SIZE, partial frames carried across reads; NULL while hibernating
+	int in_len;
+	int in_blocked;			// a service link is full; stop reading
+	int read_wants_write;		// SSL_read/SSL_accept hit WANT_WRITE
+
+	uint8_t *out;			// OUT_BUF_SIZE, bytes accepted but not yet on the wire; NULL while hibernating
+	int out_off, out_len;
+	int hibernating;		// buffers and empty tunnels handed back, see uzenet-room-server.c
+	int epollout;			// EPOLLOUT currently armed
+	uint32_t tx_records, tx_bytes;	// writes (TLS records) and bytes since the last stats flush
+	int tx_reported;		// last flush published a non-zero rate
+	int out_queued;			// on the end-of-batch egress list
+	client_t *out_next;
+
+	uint64_t accepted_us;
+	client_list_t *tlist;		// handshake_list, login_list or idle_list
+	client_t *tprev, *tnext;
+	uint64_t pace_until;		// 0 = not waiting on tokens
+	client_t **pace_list;		// pacing wheel slot holding this client
+	client_t *pprev, *pnext;
+
+	egress_drr_t drr;		// where tunnel scheduling left off
+	struct service_tunnel *tunnels[MAX_SERVICE_TUNNELS];	// egress to the Uzebox, NULL until first used
+	room_link_t *links[MAX_SERVICE_TUNNELS];		// ingress to services, NULL until first used
+};
+
+// Fixed-size object pool. Objects are carved out of calloc'd slabs and
+// recycled through an intrusive free-list, so allocation and release are
+// O(1) and slabs are never returned to libc.
+typedef struct pool_slab_s{
+	struct pool_slab_s *next;
+} pool_slab_t;
+
+typedef struct{
+	size_t size;		// object size, rounded up to 16
+	int per_slab;
+	int used, max;		// max == 0: unbounded
+	void *free;
+	pool_slab_t *slabs;
+} pool_t;
+
+void *pool_alloc(pool_t *p);
+void pool_free(pool_t *p, void *o);
+// For objects that may still have an event queued in the current epoll batch:
+// set ev_kind = EV_DEAD and let the loop free it after the batch.
+void room_defer_free(pool_t *p, void *o);
+
+extern int room_epfd;
+uint64_t room_now_us(void);
+
+// Append payload to the client's egress queue for <tunnel>. Returns the bytes
+// taken, which is less than len when the queue is full.
+int room_queue_tunnel(client_t *c, int tunnel, const uint8_t *data, int len);
+int room_tunnel_space(client_t *c, int tunnel);
+// The client's egress state for <tunnel>, allocated on first use (NULL if
+// the pool is exhausted).
+struct service_tunnel *room_tunnel(client_t *c, int tunnel);
+// Push queued tunnel data toward the client socket (respects pacing and flow
+// hold). Deferred to the end of the epoll batch so that data from several
+// services leaves in one write.
+void room_client_output(client_t *c);
+// Bytes for the client outside any tunnel (room command replies), written
+// right away and not paced. Returns len, 0 when the output buffer is full,
+// -1 when the client has to be dropped.
+int room_client_reply(client_t *c, const uint8_t *data, int len);
+// Re-run input processing after a full service link drained.
+void room_client_resume(client_t *c);
+// Identity answered a CLIENT_AUTH client; ok == 0 drops it.
+void room_login_done(client_t *c, int ok);
+
+/* uzenet-room-shard.c */
+int shard_setup(int workers);		// before forking
+int shard_attach(int shard);		// in the worker, after room_epfd exists
+void shard_user_online(client_t *c);
+void shard_user_offline(client_t *c);
+void shard_event(void);
+void shard_tunnel_drained(void);
+void shard_flush(void);			// end of batch: wake shards we queued for
+int room_shard_id(void);
+int room_shard_count(void);
+// Queue payload on <tunnel> of user <uid>, whichever shard holds them.
+// Returns len when taken, 0 when the path is full, -1 when the user is offline.
+int room_send_to_user(uint16_t uid, int tunnel, const uint8_t *data, int len);
+// Same for one session, guests included; handle = room_session_handle(c).
+int room_send_to_session(uint32_t handle, int tunnel, const uint8_t *data, int len);
+uint32_t room_session_handle(client_t *c);
+// Hand a channel frame to every other shard; dropped for a shard whose ring is full.
+void shard_publish(uint16_t channel, const uint8_t *data, int len);
+// Lockstep traffic for the shard that runs <match>
+int shard_lockstep(int shard, uint16_t match, const uint8_t *data, int len);
+// Matchmaking traffic for the shard that holds a game's queues
+int shard_matchmaking(int shard, uint16_t uid, const uint8_t *data, int len);
+
+/* uzenet-room-identity.c */
+void identity_init(void);
+// 1: c->ident is filled (cache hit), 0: asked, room_login_done() follows,
+// -1: identity is unreachable or the token is known bad.
+int identity_lookup(client_t *c);
+void identity_event(void *link, uint32_t events);
+void identity_client_closed(client_t *c);
+
+// Byte buffer for hot restart records (see "Hot restart" in uzenet-room-server.c)
+typedef struct{
+	uint8_t *p;
+	size_t len, cap, off;	// off: read position
+} handoff_buf_t;
+
+static inline void hbuf_put(handoff_buf_t *b, const void *data, size_t n){
+	if(b->len + n > b->cap) return;		// sized for the largest record up front
+	memcpy(b->p + b->len, data, n);
+	b->len += n;
+}
+
+static inline int hbuf_get(handoff_buf_t *b, void *data, size_t n){
+	if(b->off + n > b->len) return -1;
+	memcpy(data, b->p + b->off, n);
+	b->off += n;
+	return 0;
+}
+
+/* uzenet-room-pubsub.c */
+#define ROOM_CHAN_COALESCE	0x01	// a new frame replaces the queued one (state, not events)
+void pubsub_init(void);
+// Subscribe c to <channel> on <tunnel>. A channel is bound to the tunnel of
+// its first subscriber; -1 for a different tunnel or when out of memory.
+int room_subscribe(client_t *c, uint16_t channel, int tunnel, int flags);
+void room_unsubscribe(client_t *c, uint16_t channel);
+// Fan a frame out to every subscriber on every shard. Never blocks: slow
+// subscribers lose their oldest frame (or get it coalesced).
+int room_publish(uint16_t channel, const uint8_t *data, int len);
+void pubsub_deliver(uint16_t channel, const uint8_t *data, int len);	// this shard only
+void pubsub_release(pubsub_msg_t *m);
+void pubsub_client_closed(client_t *c);
+void pubsub_client_save(client_t *c, handoff_buf_t *b);
+int pubsub_client_restore(client_t *c, handoff_buf_t *b);
+
+/* uzenet-room-lockstep.c */
+void lockstep_init(void);
+// Gameplay tunnel payload from a client: lockstep control and input
+void lockstep_client_data(client_t *c, const uint8_t *data, int len);
+void lockstep_forwarded(uint16_t match, const uint8_t *data, int len);
+void lockstep_client_closed(client_t *c);
+void lockstep_timers(uint64_t now);
+uint64_t lockstep_next_us(void);	// UINT64_MAX when no match is waiting
+int lockstep_match_busy(uint16_t match);	// on the match's shard
+
+/* uzenet-room-matchmaking.c */
+void matchmaking_client_data(client_t *c, const uint8_t *data, int len);
+void matchmaking_forwarded(uint16_t uid, const uint8_t *data, int len);
+void matchmaking_client_closed(client_t *c);
+void matchmaking_timers(uint64_t now);
+uint64_t matchmaking_next_us(void);	// UINT64_MAX when nobody is queued
+
+/* uzenet-room-router.c */
+int router_init(const char *conf_path);
+void router_event(void *conn, uint32_t events);	// an EV_LINK connection
+void router_client_closed(client_t *c);
+// The client drained tunnel <tunnel>: its service gets a WINDOW, and a link
+// parked on a full queue may continue.
+void router_tunnel_drained(client_t *c, int tunnel);
+// End of batch: clients held back for want of service credit that got some
+void router_flush(void);
+// Hot restart: serialize / rebuild the service link on <tunnel>. A session
+// on a multiplexed connection has no fd of its own (-1) and is claimed from
+// the connection router_mux_restore() rebuilt.
+int router_link_muxed(client_t *c, int tunnel);
+int router_link_save(client_t *c, int tunnel, handoff_buf_t *b, int *fd);
+int router_link_restore(client_t *c, int tunnel, int fd, handoff_buf_t *b);
+// Multiplexed connections go first: save, then mark handed so the old
+// process leaves the socket alone; router_handoff_done() once every client
+// record is out, router_takeover_done() once every record is in.
+int router_mux_save(int tunnel, handoff_buf_t *b, int *fds);	// fds: 1 + shared memory's
+void router_mux_handed(int tunnel);
+void router_handoff_done(void);
+int router_mux_restore(const int *fds, int nfds, handoff_buf_t *b);
+void router_takeover_done(void);
+
+/* uzenet-room-command.c */
+// Run the room command at p[0]. Returns the bytes it took, 0 when it is not
+// complete yet, -1 to drop the client.
+int dispatch_room_command(client_t *c, const uint8_t *p, int len);
+// Probe the client's round trip; a no-op for clients that never sent a command
+int room_ping(client_t *c, uint64_t now);
+
+// Functions to be implemented in other modules if needed
+// Returns 0 when the frame was taken, -1 when the route is congested and the
+// caller must keep it and stop reading until room_client_resume().
+int dispatch_tunnel_data(client_t *c, int tunnel_id, const uint8_t *data, int len);
 
 #endif // UZENET_ROOM_SERVER_H
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include "uzenet-room-server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+// -----------------------------------------------------------------------------
+// Shards
+//
+// With --workers N the room forks N worker processes that each bind port 9470
+// with SO_REUSEPORT, so the kernel spreads connections and every worker runs
+// its own event loop over its own sessions. What has to be shared lives in
+// one MAP_SHARED mapping created before the fork:
+//
+//  - the user directory, user_id -> (shard, session id), so a service that
+//    wants to reach a user does not care which worker holds the connection;
+//  - one SPSC ring (uzenet-room-ring.h) per ordered pair of shards carrying
+//    [uid][session][tunnel][len][payload] records to the owning shard.
+//    A "tunnel" of SHARD_REC_* instead marks a record for a room subsystem,
+//    with its own key in the session field.
+//
+// A session is addressed as shard << 24 | session id (room_session_handle()),
+// which also reaches guests, who all share one user id.
+//
+// Each shard has an eventfd for "your inbound rings have data". Producers
+// only raise it once per epoll batch per target, in shard_flush().
+// With a single worker nothing is mapped and every delivery is local.
+// -----------------------------------------------------------------------------
+
+#define SHARD_RING_SIZE		16384	// per shard pair, power of two
+#define SHARD_REC_HDR		8	// uid(2) session(4) tunnel(1) len(1)
+#define DIRECTORY_SIZE		65536	// one slot per user id
+#define SESSION_BUCKETS		4096	// power of two
+
+// Record kinds beyond the tunnel ids
+#define SHARD_REC_MATCHMAKING	0xFD	// key: none, uid set
+#define SHARD_REC_LOCKSTEP	0xFE	// key: match id
+#define SHARD_REC_CHANNEL	0xFF	// key: channel
+
+typedef struct{
+	room_ring_t ring;
+	uint8_t buf[SHARD_RING_SIZE];
+} shard_ring_t;
+
+// Directory entry: shard << 24 | session, 0 = offline
+typedef struct{
+	uint32_t entry[DIRECTORY_SIZE];
+} shard_dir_t;
+
+static int num_shards = 1;
+static int my_shard = 0;
+static shard_dir_t *dir = NULL;
+static shard_ring_t *rings = NULL;	// rings[from * num_shards + to]
+static int efd[MAX_WORKERS];
+static int efd_tag = EV_SHARD;
+static uint8_t wake[MAX_WORKERS];	// targets to signal at the end of this batch
+static uint32_t next_session = 0;
+static int inbound_blocked = 0;		// a record waits for a full tunnel to drain
+
+static client_t **local_users = NULL;	// this shard's sessions by user id
+static client_t *sessions[SESSION_BUCKETS];	// all of them by session id, chained
+
+int room_shard_id(void){
+	return my_shard;
+}
+
+int room_shard_count(void){
+	return num_shards;
+}
+
+uint32_t room_session_handle(client_t *c){
+	return (uint32_t)my_shard << 24 | c->session_id;
+}
+
+static client_t *session_find(uint32_t session){
+	client_t *c = sessions[session & (SESSION_BUCKETS - 1)];
+	while(c && c->session_id != session) c = c->session_next;
+	return c;
+}
+
+static shard_ring_t *ring_to(int from, int to){
+	return &rings[from * num_shards + to];
+}
+
+int shard_setup(int n){
+	num_shards = n;
+	if(n == 1) return 0;
+	size_t sz = sizeof(shard_dir_t) + (size_t)n * n * sizeof(shard_ring_t);
+	void *m = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(m == MAP_FAILED) return -1;
+	dir = m;
+	rings = (shard_ring_t *)((uint8_t *)m + sizeof(shard_dir_t));
+	for(int i = 0; i < n; ++i){
+		efd[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(efd[i] < 0) return -1;
+	}
+	return 0;
+}
+
+// In the worker, once room_epfd exists. A respawned worker takes over the
+// rings where its predecessor stopped and clears the directory entries it
+// left behind.
+int shard_attach(int shard){
+	my_shard = shard;
+	local_users = calloc(DIRECTORY_SIZE, sizeof(client_t *));
+	if(!local_users) return -1;
+	if(num_shards == 1) return 0;
+	for(int u = 0; u < DIRECTORY_SIZE; ++u){
+		uint32_t e = __atomic_load_n(&dir->entry[u], __ATOMIC_RELAXED);
+		if(e && (int)(e >> 24) == shard)
+			__atomic_compare_exchange_n(&dir->entry[u], &e, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	}
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &efd_tag };
+	return epoll_ctl(room_epfd, EPOLL_CTL_ADD, efd[shard], &ev);
+}
+
+void shard_user_online(client_t *c){
+	uint16_t uid = c->ident.user_id;
+	next_session = (next_session + 1) & 0xFFFFFF;	// 24 bits, 0 means offline
+	if(!next_session) next_session = 1;
+	c->session_id = next_session;
+	client_t **b = &sessions[c->session_id & (SESSION_BUCKETS - 1)];
+	c->session_next = *b;
+	*b = c;
+	if(uid == IDENTITY_UID_GUEST) return;	// guests share an id: by session only
+	local_users[uid] = c;
+	if(dir) __atomic_store_n(&dir->entry[uid], (uint32_t)my_shard << 24 | c->session_id, __ATOMIC_RELEASE);
+}
+
+void shard_user_offline(client_t *c){
+	uint16_t uid = c->ident.user_id;
+	client_t **pp = &sessions[c->session_id & (SESSION_BUCKETS - 1)];
+	while(*pp && *pp != c) pp = &(*pp)->session_next;
+	if(*pp) *pp = c->session_next;
+	if(uid == IDENTITY_UID_GUEST || local_users[uid] != c) return;
+	local_users[uid] = NULL;
+	if(!dir) return;
+	// Only if it is still ours: the user may already be on another shard
+	uint32_t e = (uint32_t)my_shard << 24 | c->session_id;
+	__atomic_compare_exchange_n(&dir->entry[uid], &e, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+// By session when there is one, else by user id
+static int deliver_local(uint16_t uid, uint32_t session, int tunnel, const uint8_t *data, int len){
+	client_t *c = session ? session_find(session) : local_users[uid];
+	if(!c) return -1;
+	if(room_tunnel_space(c, tunnel) < len) return 0;
+	room_queue_tunnel(c, tunnel, data, len);
+	room_client_output(c);
+	return len;
+}
+
+// One record per ring_write() so the consumer never sees half of it.
+// Returns len, or 0 when the ring is full.
+static int shard_record(int shard, uint16_t uid, uint32_t session, int kind, const uint8_t *data, int len){
+	shard_ring_t *r = ring_to(my_shard, shard);
+	if(ring_space(&r->ring, SHARD_RING_SIZE) < (uint32_t)(SHARD_REC_HDR + len)) return 0;
+	uint8_t rec[SHARD_REC_HDR + MAX_FRAME_PAYLOAD];
+	rec[0] = uid >> 8;
+	rec[1] = uid;
+	rec[2] = session >> 24;
+	rec[3] = session >> 16;
+	rec[4] = session >> 8;
+	rec[5] = session;
+	rec[6] = kind;
+	rec[7] = len;
+	memcpy(rec + SHARD_REC_HDR, data, len);
+	ring_write(&r->ring, r->buf, SHARD_RING_SIZE, rec, SHARD_REC_HDR + len);
+	wake[shard] = 1;
+	return len;
+}
+
+int room_send_to_user(uint16_t uid, int tunnel, const uint8_t *data, int len){
+	if(uid == IDENTITY_UID_GUEST || len > MAX_FRAME_PAYLOAD) return -1;
+	if(!dir) return deliver_local(uid, 0, tunnel, data, len);
+
+	uint32_t e = __atomic_load_n(&dir->entry[uid], __ATOMIC_ACQUIRE);
+	if(!e) return -1;
+	int shard = e >> 24;
+	uint32_t session = e & 0xFFFFFF;
+	if(shard == my_shard) return deliver_local(uid, session, tunnel, data, len);
+
+	return shard_record(shard, uid, session, tunnel, data, len);
+}
+
+int room_send_to_session(uint32_t handle, int tunnel, const uint8_t *data, int len){
+	int shard = handle >> 24;
+	uint32_t session = handle & 0xFFFFFF;
+	if(len > MAX_FRAME_PAYLOAD) return -1;
+	if(shard == my_shard) return deliver_local(0, session, tunnel, data, len);
+	return shard_record(shard, 0, session, tunnel, data, len);
+}
+
+void shard_publish(uint16_t channel, const uint8_t *data, int len){
+	for(int shard = 0; dir && shard < num_shards; ++shard)
+		if(shard != my_shard) shard_record(shard, 0, channel, SHARD_REC_CHANNEL, data, len);
+}
+
+int shard_lockstep(int shard, uint16_t match, const uint8_t *data, int len){
+	return shard_record(shard, 0, match, SHARD_REC_LOCKSTEP, data, len);
+}
+
+int shard_matchmaking(int shard, uint16_t uid, const uint8_t *data, int len){
+	return shard_record(shard, uid, 0, SHARD_REC_MATCHMAKING, data, len);
+}
+
+// Deliver everything other shards queued for us. A record for a full tunnel
+// stays put, and the rings are read again once some tunnel drained.
+void shard_event(void){
+	uint64_t v;
+	if(read(efd[my_shard], &v, sizeof(v)) < 0 && errno != EAGAIN) return;
+	for(int from = 0; from < num_shards; ++from){
+		if(from == my_shard) continue;
+		shard_ring_t *r = ring_to(from, my_shard);
+		uint8_t rec[SHARD_REC_HDR + MAX_FRAME_PAYLOAD];
+		while(ring_used(&r->ring) >= SHARD_REC_HDR){
+			struct iovec iov[2] = { { 0 } };	// the loop test means n > 0, which the compiler can't see
+			uint8_t hdr[SHARD_REC_HDR];
+			int n = ring_peek(&r->ring, r->buf, SHARD_RING_SIZE, iov, SHARD_REC_HDR);
+			if(!n) break;
+			memcpy(hdr, iov[0].iov_base, iov[0].iov_len);
+			if(n > 1) memcpy(hdr + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+			int len = hdr[7], kind = hdr[6];
+			uint32_t session = (uint32_t)hdr[2] << 24 | hdr[3] << 16 | hdr[4] << 8 | hdr[5];
+			client_t *c = kind < MAX_SERVICE_TUNNELS ? session_find(session) : NULL;
+			if(c && room_tunnel_space(c, kind) < len){
+				inbound_blocked = 1;	// shard_tunnel_drained() looks again
+				break;
+			}
+			ring_read(&r->ring, r->buf, SHARD_RING_SIZE, rec, SHARD_REC_HDR + len);
+			if(kind == SHARD_REC_CHANNEL)
+				pubsub_deliver(session, rec + SHARD_REC_HDR, len);
+			else if(kind == SHARD_REC_LOCKSTEP)
+				lockstep_forwarded(session, rec + SHARD_REC_HDR, len);
+			else if(kind == SHARD_REC_MATCHMAKING)
+				matchmaking_forwarded(hdr[0] << 8 | hdr[1], rec + SHARD_REC_HDR, len);
+			else if(kind < MAX_SERVICE_TUNNELS)
+				deliver_local(0, session, kind, rec + SHARD_REC_HDR, len);	// stale session: dropped
+		}
+	}
+}
+
+void shard_tunnel_drained(void){
+	if(!inbound_blocked) return;
+	inbound_blocked = 0;
+	wake[my_shard] = 1;
+}
+
+// End of batch: one eventfd write per shard we queued records for
+void shard_flush(void){
+	if(!dir) return;
+	uint64_t one = 1;
+	for(int i = 0; i < num_shards; ++i){
+		if(!wake[i]) continue;
+		wake[i] = 0;
+		if(write(efd[i], &one, sizeof(one)) < 0 && errno != EAGAIN)
+			syslog(LOG_WARNING, "room: shard %d wakeup failed: %s", i, strerror(errno));
+	}
+}
@@ -0,0 +1,165 @@
+/* uzenet-room-tls-bench.c
+ *
+ * Opens N TLS sessions against a room instance, first with a full handshake
+ * each time and then resuming from the ticket of the previous connection the
+ * way a reconnecting bridge would, and reports handshakes per second for both. Run it against a local room right after a restart to see
+ * what a reconnect storm costs.
+ *
+ *   uzenet-room-tls-bench [--host 127.0.0.1] [--port 9470] [--count 500] [--procs 1]
+ *
+ * With --procs > 1 that many processes run the same loop in parallel and the
+ * rates are summed.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+static const char *host = "127.0.0.1";
+static int port = 9470;
+static int count = 500;
+static int procs = 1;
+
+static double now_s(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int tcp_connect(){
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+	inet_pton(AF_INET, host, &addr.sin_addr);
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// One handshake; optionally resumes *sess and/or waits for a fresh ticket.
+// Returns 1 if the session was resumed, 0 for a full handshake, -1 on error.
+static int handshake(SSL_CTX *ctx, SSL_SESSION **sess, int want_ticket){
+	int fd = tcp_connect();
+	if(fd < 0) return -1;
+	SSL *ssl = SSL_new(ctx);
+	SSL_set_fd(ssl, fd);
+	if(*sess) SSL_set_session(ssl, *sess);
+	if(SSL_connect(ssl) != 1){
+		ERR_print_errors_fp(stderr);
+		SSL_free(ssl);
+		close(fd);
+		return -1;
+	}
+	int reused = SSL_session_reused(ssl);
+	if(want_ticket){
+		// TLS 1.3 tickets arrive after the handshake; the room sends nothing
+		// else before login, so a short read just pulls them in.
+		struct pollfd p = { .fd = fd, .events = POLLIN };
+		char b;
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		while(poll(&p, 1, 200) > 0){
+			int r = SSL_read(ssl, &b, 1);
+			if(r <= 0 && SSL_get_error(ssl, r) != SSL_ERROR_WANT_READ) break;
+			SSL_SESSION *s = SSL_get1_session(ssl);
+			if(s && SSL_SESSION_is_resumable(s)){
+				if(*sess) SSL_SESSION_free(*sess);
+				*sess = s;
+				break;
+			}
+			SSL_SESSION_free(s);
+		}
+	}
+	SSL_shutdown(ssl);
+	SSL_free(ssl);
+	close(fd);
+	return reused;
+}
+
+static void run(int wfd){
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+	SSL_SESSION *sess = NULL;
+	double rate[2] = { 0, 0 };
+	int resumed = 0;
+
+	for(int mode = 0; mode < 2; ++mode){
+		if(mode == 1 && handshake(ctx, &sess, 1) < 0) break;
+		double t0 = now_s();
+		int ok = 0;
+		for(int i = 0; i < count; ++i){
+			SSL_SESSION *none = NULL;
+			// TLS 1.3 tickets are single use, so keep the freshest one
+			int r = handshake(ctx, mode ? &sess : &none, mode);
+			if(r < 0) continue;
+			ok++;
+			if(mode) resumed += r;
+		}
+		rate[mode] = ok / (now_s() - t0);
+	}
+	if(sess) SSL_SESSION_free(sess);
+	SSL_CTX_free(ctx);
+
+	char line[128];
+	int n = snprintf(line, sizeof(line), "%f %f %d\n", rate[0], rate[1], resumed);
+	if(write(wfd, line, n) != n) perror("write");
+}
+
+static void usage(const char *prog){
+	fprintf(stderr, "usage: %s [--host ip] [--port n] [--count n] [--procs n]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[]){
+	for(int i = 1; i < argc; ++i){
+		if(strcmp(argv[i], "--host") == 0 && i + 1 < argc) host = argv[++i];
+		else if(strcmp(argv[i], "--port") == 0 && i + 1 < argc) port = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--count") == 0 && i + 1 < argc) count = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--procs") == 0 && i + 1 < argc) procs = atoi(argv[++i]);
+		else usage(argv[0]);
+	}
+	if(count <= 0 || procs <= 0) usage(argv[0]);
+
+	int pfd[2];
+	if(pipe(pfd) < 0){
+		perror("pipe");
+		return 1;
+	}
+	for(int p = 0; p < procs; ++p){
+		if(fork() == 0){
+			close(pfd[0]);
+			run(pfd[1]);
+			_exit(0);
+		}
+	}
+	close(pfd[1]);
+
+	FILE *f = fdopen(pfd[0], "r");
+	double full = 0, res = 0, a, b;
+	int reused = 0, r;
+	while(fscanf(f, "%lf %lf %d", &a, &b, &r) == 3){
+		full += a;
+		res += b;
+		reused += r;
+	}
+	fclose(f);
+	while(wait(NULL) > 0);
+
+	printf("full handshakes:    %8.1f /s\n", full);
+	printf("resumed handshakes: %8.1f /s (%d of %d actually resumed)\n", res, reused, count * procs);
+	return 0;
+}
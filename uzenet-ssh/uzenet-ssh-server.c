@@ -1,5 +1,5 @@
 #include "uzenet-ssh-server.h"
-#include "uzenet-tunnel.h"
+#include "../uzenet-tunnel/uzenet-tunnel.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,12 +23,7 @@
 // Socket used by uzenet-room -> ssh service
 #define SSH_SOCKET_PATH "/run/uzenet/ssh.sock"
 #define MAX_CLIENTS     32
-
-// LOGIN meta payload (same as used in lichess / fatfs / virtual-fujinet)
-typedef struct{
-	uint16_t user_id;
-	uint16_t reserved;
-} TunnelLoginMeta;
+#define BRIDGE_READ_LEN UTUN_BULK_PAYLOAD	// ssh output per DATA frame, if room takes it
 
 // ----------------------------------------------------------------------------
 // Globals
@@ -103,23 +98,28 @@ static void *client_thread_main(void *arg){
 	free(cta);
 
 	int user_id = 0xFFFF;          // default "guest"
-	TunnelFrame first_fr;
+	UtunConn conn;
+	UtunFrameRef first_fr;
 	int have_first_data = 0;
 
+	utun_conn_init(&conn, tunnel_fd, 0);
+
 	// Expect first frame: LOGIN (preferred) or DATA
-	int r = ReadTunnelFramed(tunnel_fd, &first_fr);
+	int r = utun_next_frame(&conn, &first_fr);
 	if(r <= 0){
 		close(tunnel_fd);
 		return NULL;
 	}
 
-	if(first_fr.type == TUNNEL_TYPE_LOGIN &&
-	   first_fr.length >= sizeof(TunnelLoginMeta)){
-		const TunnelLoginMeta *meta = (const TunnelLoginMeta*)first_fr.data;
-		user_id = meta->user_id;
+	if(first_fr.type == UTUN_TYPE_LOGIN){
+		user_id = utun_login(&conn, &first_fr);
+		if(user_id < 0){
+			close(tunnel_fd);
+			return NULL;
+		}
 		syslog(LOG_INFO, "uzenet-ssh: LOGIN user_id=%u",
 		       (unsigned)user_id);
-	}else if(first_fr.type == TUNNEL_TYPE_DATA && first_fr.length > 0){
+	}else if(first_fr.type == UTUN_TYPE_DATA && first_fr.length > 0){
 		// Older room or no LOGIN meta: treat as initial data
 		have_first_data = 1;
 	}else{
@@ -173,27 +173,31 @@ static void *client_thread_main(void *arg){
 	for(;;){
 		fd_set rfds;
 		int maxfd = (tunnel_fd > ssh_fd ? tunnel_fd : ssh_fd) + 1;
+		// Frames already in the codec's buffer don't make tunnel_fd readable
+		int buffered = utun_conn_ready(&conn);
+		struct timeval poll_only = { 0, 0 };
 
 		FD_ZERO(&rfds);
 		FD_SET(tunnel_fd, &rfds);
 		FD_SET(ssh_fd,    &rfds);
 
-		int n = select(maxfd, &rfds, NULL, NULL, NULL);
+		int n = select(maxfd, &rfds, NULL, NULL, buffered ? &poll_only : NULL);
 		if(n < 0){
 			if(errno == EINTR) continue;
 			break;
 		}
 
-		// Tunnel -> SSH
-		if(FD_ISSET(tunnel_fd, &rfds)){
-			TunnelFrame fr;
-			int rt = ReadTunnelFramed(tunnel_fd, &fr);
+		// Tunnel -> SSH, straight from the receive buffer
+		if(buffered || FD_ISSET(tunnel_fd, &rfds)){
+			UtunFrameRef fr;
+			int rt = utun_next_frame(&conn, &fr);
+			if(rt < 0 && errno == EMSGSIZE) continue;	// oversized frame, skipped
 			if(rt <= 0){
 				// Remote closed or error; stop sending to ssh
 				shutdown(ssh_fd, SHUT_WR);
 				break;
 			}
-			if(fr.type == TUNNEL_TYPE_DATA && fr.length > 0){
+			if(fr.type == UTUN_TYPE_DATA && fr.length > 0){
 				if(write_full_stream(ssh_fd, fr.data, fr.length) < 0){
 					shutdown(ssh_fd, SHUT_WR);
 					break;
@@ -203,29 +207,15 @@ static void *client_thread_main(void *arg){
 
 		// SSH -> Tunnel
 		if(FD_ISSET(ssh_fd, &rfds)){
-			uint8_t buf[1024];
+			uint8_t buf[BRIDGE_READ_LEN];
 			ssize_t rd = read(ssh_fd, buf, sizeof(buf));
 			if(rd <= 0){
 				// ssh side closed; we're done
 				break;
 			}
-			size_t off = 0;
-			while(off < (size_t)rd){
-				size_t chunk = (size_t)rd - off;
-				if(chunk > TUNNEL_MAX_PAYLOAD)
-					chunk = TUNNEL_MAX_PAYLOAD;
-
-				TunnelFrame out;
-				out.type   = TUNNEL_TYPE_DATA;
-				out.flags  = 0;
-				out.length = (uint16_t)chunk;
-				memcpy(out.data, buf + off, chunk);
-
-				if(WriteTunnelFramed(tunnel_fd, &out) < 0){
-					// remote closed
-					break;
-				}
-				off += chunk;
+			if(utun_send(&conn, UTUN_TYPE_DATA, buf, (size_t)rd) < 0){
+				// remote closed
+				break;
 			}
 		}
 	}
@@ -1,7 +1,17 @@
+#define _GNU_SOURCE
 #include "uzenet-tunnel.h"
+#include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <poll.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
 
 int utun_read_full(int fd, void *buf, size_t len){
 	uint8_t *p = (uint8_t*)buf;
@@ -68,21 +78,607 @@ int utun_read_frame(int fd, TunnelFrame *fr){
 }
 
 int utun_write_frame(int fd, const TunnelFrame *fr){
-	uint8_t hdr[4];
-	uint16_t len;
-
 	if(!fr) return -1;
+	return utun_write_frames(fd, fr, 1);
+}
+
+/* Moves the iovec window past w bytes that went out */
+static void utun_iov_advance(struct iovec **v, int *cnt, size_t w){
+	while(*cnt && w >= (*v)->iov_len){
+		w -= (*v)->iov_len;
+		(*v)++;
+		(*cnt)--;
+	}
+	if(*cnt){
+		(*v)->iov_base = (uint8_t*)(*v)->iov_base + w;
+		(*v)->iov_len -= w;
+	}
+}
+
+/* Writes the iovecs out completely, moving the window on after a short
+ * write. A non-blocking fd waits for room in the socket buffer rather than
+ * leave a frame half written. */
+static int utun_writev_all(int fd, struct iovec *v, int cnt){
+	while(cnt){
+		ssize_t w = writev(fd, v, cnt);
+		if(w < 0){
+			if(errno == EAGAIN || errno == EWOULDBLOCK){
+				struct pollfd p = { .fd = fd, .events = POLLOUT };
+				if(poll(&p, 1, -1) >= 0) continue;
+			}
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		utun_iov_advance(&v, &cnt, (size_t)w);
+	}
+	return 0;
+}
+
+/* Header and payload of every frame go out as iovecs of one writev(), so a
+ * single frame costs one syscall and a run of them one per
+ * UTUN_WRITEV_FRAMES. */
+int utun_write_frames(int fd, const TunnelFrame *frs, int count){
+	uint8_t hdr[UTUN_WRITEV_FRAMES][4];
+	struct iovec iov[UTUN_WRITEV_FRAMES * 2];
+
+	if(!frs || count < 0) return -1;
+
+	while(count){
+		int n = (count > UTUN_WRITEV_FRAMES) ? UTUN_WRITEV_FRAMES : count;
+		int cnt = 0;
+
+		for(int i = 0; i < n; ++i){
+			uint16_t len = frs[i].length;
+			if(len > UTUN_MAX_PAYLOAD) len = UTUN_MAX_PAYLOAD;
+
+			hdr[i][0] = frs[i].type;
+			hdr[i][1] = frs[i].flags;
+			hdr[i][2] = (uint8_t)(len >> 8);
+			hdr[i][3] = (uint8_t)(len & 0xff);
+			iov[cnt].iov_base = hdr[i];
+			iov[cnt++].iov_len = sizeof(hdr[i]);
+			if(len){
+				iov[cnt].iov_base = (void*)frs[i].data;
+				iov[cnt++].iov_len = len;
+			}
+		}
+		if(utun_writev_all(fd, iov, cnt) < 0) return -1;
+		frs   += n;
+		count -= n;
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Connection codec                                                          */
+/* ------------------------------------------------------------------------- */
+
+/* 0 is the default; anything else is kept within UTUN_MIN_PAYLOAD..hi */
+static uint16_t utun_clamp_payload(unsigned max, unsigned hi){
+	if(!max) return UTUN_MAX_PAYLOAD;
+	if(max > hi) return (uint16_t)hi;
+	if(max < UTUN_MIN_PAYLOAD) return UTUN_MIN_PAYLOAD;
+	return (uint16_t)max;
+}
+
+void utun_conn_init(UtunConn *c, int fd, uint16_t max_payload){
+	c->fd          = fd;
+	c->hdr         = UTUN_HDR_SIZE;
+	c->max_payload = utun_clamp_payload(max_payload, UTUN_RBUF_SIZE - UTUN_MUX_HDR_SIZE);
+	c->peer_max    = UTUN_MAX_PAYLOAD;
+	c->off         = 0;
+	c->len         = 0;
+	c->skip        = 0;
+	c->shm_rx      = 0;
+	c->shm_tx      = 0;
+	c->nfds        = 0;
+	c->shm.map     = NULL;
+	c->flow        = 0;
+	c->credit      = 0;
+	c->credits     = NULL;
+}
+
+void utun_conn_release(UtunConn *c){
+	if(c->shm.map) utun_shm_close(&c->shm);
+	while(c->nfds) close(c->fds[--c->nfds]);
+	c->shm_rx = c->shm_tx = 0;
+	free(c->credits);
+	c->credits = NULL;
+	c->flow = 0;
+}
+
+static int utun_shm_wait(UtunConn *c, int efd);
+static void utun_flow_frame(UtunConn *c, const UtunFrameRef *fr);
+
+/* One read's worth into buf: from the rx ring once switched, else from the
+ * socket, keeping fds that come along for utun_shm_accept() */
+static ssize_t utun_conn_recv(UtunConn *c, void *buf, size_t len){
+	union{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * UTUN_SHM_FDS)];
+	} cm;
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cm.buf, .msg_controllen = sizeof(cm.buf) };
+	ssize_t r;
+
+	if(c->shm_rx){
+		for(;;){
+			size_t n = utun_shm_read(&c->shm, buf, len);
+			if(n) return (ssize_t)n;
+			r = utun_shm_wait(c, c->shm.rx_efd);
+			if(r <= 0){
+				/* the peer is gone; take what it left first */
+				n = utun_shm_read(&c->shm, buf, len);
+				return n ? (ssize_t)n : r;
+			}
+		}
+	}
+
+	r = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+	if(r < 0 && errno == ENOTSOCK) return read(c->fd, buf, len);
+	if(r < 0) return r;
+	for(struct cmsghdr *h = CMSG_FIRSTHDR(&msg); h; h = CMSG_NXTHDR(&msg, h)){
+		if(h->cmsg_level != SOL_SOCKET || h->cmsg_type != SCM_RIGHTS) continue;
+		for(size_t i = 0; i < (h->cmsg_len - CMSG_LEN(0)) / sizeof(int); ++i){
+			int fd;
+			memcpy(&fd, CMSG_DATA(h) + i * sizeof(int), sizeof(fd));
+			if(c->nfds < UTUN_SHM_FDS) c->fds[c->nfds++] = fd;
+			else close(fd);
+		}
+	}
+	return r;
+}
 
-	len = fr->length;
-	if(len > UTUN_MAX_PAYLOAD) len = UTUN_MAX_PAYLOAD;
+/* All of the iovecs, to the socket or, once switched, the tx ring */
+static int utun_conn_writev(UtunConn *c, struct iovec *v, int cnt){
+	if(!c->shm_tx) return utun_writev_all(c->fd, v, cnt);
+	while(cnt){
+		utun_iov_advance(&v, &cnt, utun_shm_write(&c->shm, v, cnt));
+		if(cnt && utun_shm_wait(c, c->shm.tx_efd) <= 0){
+			errno = EPIPE;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Bytes of the frame starting at off, header included, or 0 while its
+ * header is still incomplete. */
+static size_t utun_frame_size(const UtunConn *c, size_t off){
+	const uint8_t *p = c->buf + off;
+
+	if(c->len - off < c->hdr) return 0;
+	return c->hdr + (size_t)((p[2] << 8) | p[3]);
+}
+
+int utun_conn_ready(const UtunConn *c){
+	size_t off = (size_t)c->off + c->skip;
+	size_t need;
+
+	if(off > c->len) return 0;
+	need = utun_frame_size(c, off);
+	return need && off + need <= c->len;
+}
+
+int utun_next_frame(UtunConn *c, UtunFrameRef *fr){
+	if(!c || !fr) return -1;
+
+	for(;;){
+		/* drop what's left of an over-length frame */
+		if(c->skip){
+			uint16_t k = c->len - c->off;
+			if(k > c->skip) k = c->skip;
+			c->off  += k;
+			c->skip -= k;
+		}
+
+		if(!c->skip){
+			size_t need = utun_frame_size(c, c->off);
+			const uint8_t *p = c->buf + c->off;
+
+			/* not below UTUN_MAX_PAYLOAD: the peer may send a few frames
+			 * before our LIMIT reaches it */
+			if(need && need - c->hdr > (c->max_payload > UTUN_MAX_PAYLOAD ? c->max_payload : UTUN_MAX_PAYLOAD)){
+				c->off += c->hdr;
+				c->skip = (uint16_t)(need - c->hdr);
+				errno = EMSGSIZE;
+				return -1;
+			}
+			if(need && need <= (size_t)(c->len - c->off)){
+				fr->type    = p[0];
+				fr->flags   = p[1];
+				fr->length  = (uint16_t)(need - c->hdr);
+				fr->session = (c->hdr == UTUN_MUX_HDR_SIZE) ? (uint16_t)((p[4] << 8) | p[5]) : 0;
+				fr->data    = p + c->hdr;
+				c->off += (uint16_t)need;
+				/* the frames behind MUX carry a session id */
+				if(fr->type == UTUN_TYPE_MUX) c->hdr = UTUN_MUX_HDR_SIZE;
+				if(fr->type == UTUN_TYPE_WINDOW || fr->type == UTUN_TYPE_OPEN || fr->type == UTUN_TYPE_CLOSE)
+					utun_flow_frame(c, fr);
+				return 1;
+			}
+		}
+
+		/* keep the partial frame at the front and fill in behind it; this
+		 * is what ends the life of the last frame handed out */
+		if(c->off){
+			memmove(c->buf, c->buf + c->off, c->len - c->off);
+			c->len -= c->off;
+			c->off  = 0;
+		}
+		ssize_t r = utun_conn_recv(c, c->buf + c->len, sizeof(c->buf) - c->len);
+		if(r == 0){
+			if(!c->len) return 0;
+			errno = EPROTO;		/* EOF inside a frame */
+			return -1;
+		}
+		if(r < 0){
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		c->len += (uint16_t)r;
+	}
+}
+
+int utun_read_frames(UtunConn *c, TunnelFrame *frs, int max){
+	UtunFrameRef fr;
+	int n = 0;
+
+	if(!frs || max <= 0) return -1;
+
+	do{
+		int r = utun_next_frame(c, &fr);
+		if(r <= 0) return n ? n : r;
+		if(fr.length > sizeof(frs[n].data)){
+			/* too big to copy: dropped, like an over-length frame */
+			if(n) return n;
+			errno = EMSGSIZE;
+			return -1;
+		}
+		frs[n].type   = fr.type;
+		frs[n].flags  = fr.flags;
+		frs[n].length = fr.length;
+		memcpy(frs[n].data, fr.data, fr.length);
+		n++;
+	}while(n < max && utun_conn_ready(c));
+	return n;
+}
 
-	hdr[0] = fr->type;
-	hdr[1] = fr->flags;
-	hdr[2] = (uint8_t)(len >> 8);
-	hdr[3] = (uint8_t)(len & 0xff);
+/* Learn the room's limit from a LOGIN or MUX payload at lim and tell it ours */
+static int utun_exchange_limits(UtunConn *c, const uint8_t *lim){
+	if(lim)
+		c->peer_max = utun_clamp_payload((lim[0] << 8) | lim[1], UTUN_BULK_PAYLOAD);
+	if(c->max_payload != UTUN_MAX_PAYLOAD){
+		uint8_t own[2] = { (uint8_t)(c->max_payload >> 8), (uint8_t)c->max_payload };
+		if(utun_send(c, UTUN_TYPE_LIMIT, own, sizeof(own)) < 0) return -1;
+	}
+	return 0;
+}
 
-	if(utun_write_full(fd, hdr, sizeof(hdr)) < 0) return -1;
-	if(len && utun_write_full(fd, fr->data, len) < 0) return -1;
+int utun_login(UtunConn *c, const UtunFrameRef *fr){
+	if(fr->length < 2) return -1;
+	if(fr->type == UTUN_TYPE_LOGIN){
+		if(utun_exchange_limits(c, fr->length >= UTUN_LOGIN_SIZE ? fr->data + 2 : NULL) < 0)
+			return -1;
+	}else if(fr->type != UTUN_TYPE_OPEN){
+		return -1;
+	}
+	return (fr->data[0] << 8) | fr->data[1];
+}
 
+int utun_mux_accept(UtunConn *c, const UtunFrameRef *fr){
+	if(fr->type != UTUN_TYPE_MUX || c->hdr != UTUN_MUX_HDR_SIZE) return -1;
+	return utun_exchange_limits(c, fr->length >= 2 ? fr->data : NULL);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Flow control                                                              */
+/*                                                                           */
+/* The reader adds credit while a sender on another thread spends it, so    */
+/* both go through atomics; flow is set only once the table it announces    */
+/* is in place.                                                              */
+/* ------------------------------------------------------------------------- */
+
+/* The session's credit, NULL before the peer's first WINDOW */
+static uint32_t *utun_flow_slot(const UtunConn *c, uint16_t session){
+	uint32_t *credits;
+
+	if(!__atomic_load_n(&c->flow, __ATOMIC_ACQUIRE)) return NULL;
+	if(c->hdr != UTUN_MUX_HDR_SIZE) return (uint32_t*)&c->credit;
+	credits = __atomic_load_n(&c->credits, __ATOMIC_RELAXED);
+	return credits ? &credits[session] : NULL;
+}
+
+/* WINDOW adds to the session's credit; OPEN and CLOSE start it over */
+static void utun_flow_frame(UtunConn *c, const UtunFrameRef *fr){
+	uint32_t *slot;
+
+	if(fr->type == UTUN_TYPE_WINDOW && fr->length >= 4 && !c->flow){
+		/* calloc'd pages stay untouched until their sessions are in use */
+		if(c->hdr == UTUN_MUX_HDR_SIZE && !c->credits){
+			uint32_t *credits = calloc(0x10000, sizeof(*credits));
+			if(!credits) return;
+			__atomic_store_n(&c->credits, credits, __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&c->flow, 1, __ATOMIC_RELEASE);
+	}
+	if(!(slot = utun_flow_slot(c, fr->session))) return;
+	if(fr->type != UTUN_TYPE_WINDOW){
+		__atomic_store_n(slot, 0, __ATOMIC_RELAXED);
+	}else if(fr->length >= 4){
+		uint32_t add = (uint32_t)fr->data[0] << 24 | (uint32_t)fr->data[1] << 16 | (uint32_t)fr->data[2] << 8 | fr->data[3];
+		__atomic_fetch_add(slot, add, __ATOMIC_RELAXED);
+	}
+}
+
+/* Charge sent DATA; a sender that overran its window just ends up at none */
+static void utun_flow_spend(UtunConn *c, uint16_t session, size_t len){
+	uint32_t *slot = utun_flow_slot(c, session);
+	uint32_t have, left;
+
+	if(!slot) return;
+	have = __atomic_load_n(slot, __ATOMIC_RELAXED);
+	do{
+		left = len < have ? have - (uint32_t)len : 0;
+	}while(!__atomic_compare_exchange_n(slot, &have, left, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+size_t utun_credit(const UtunConn *c, uint16_t session){
+	uint32_t *slot = utun_flow_slot(c, session);
+
+	return slot ? __atomic_load_n(slot, __ATOMIC_RELAXED) : SIZE_MAX;
+}
+
+int utun_send(UtunConn *c, uint8_t type, const void *data, size_t len){
+	return utun_send_to(c, 0, type, data, len);
+}
+
+int utun_send_to(UtunConn *c, uint16_t session, uint8_t type, const void *data, size_t len){
+	uint8_t hdr[UTUN_WRITEV_FRAMES][UTUN_MUX_HDR_SIZE];
+	struct iovec iov[UTUN_WRITEV_FRAMES * 2];
+	const uint8_t *p = (const uint8_t*)data;
+	size_t chunk = (type == UTUN_TYPE_DATA) ? c->peer_max : 0xFFFF;
+	size_t total = len;
+
+	if(len > chunk && type != UTUN_TYPE_DATA) return -1;
+
+	do{
+		int cnt = 0;
+		for(int i = 0; i < UTUN_WRITEV_FRAMES; ++i){
+			size_t n = (len > chunk) ? chunk : len;
+
+			hdr[i][0] = type;
+			hdr[i][1] = 0;
+			hdr[i][2] = (uint8_t)(n >> 8);
+			hdr[i][3] = (uint8_t)(n & 0xff);
+			hdr[i][4] = (uint8_t)(session >> 8);
+			hdr[i][5] = (uint8_t)session;
+			iov[cnt].iov_base = hdr[i];
+			iov[cnt++].iov_len = c->hdr;
+			if(n){
+				iov[cnt].iov_base = (void*)p;
+				iov[cnt++].iov_len = n;
+			}
+			p   += n;
+			len -= n;
+			if(!len) break;
+		}
+		if(utun_conn_writev(c, iov, cnt) < 0) return -1;
+	}while(len);
+	if(type == UTUN_TYPE_DATA) utun_flow_spend(c, session, total);
+	return 0;
+}
+
+int utun_window(UtunConn *c, uint16_t session, uint32_t bytes){
+	uint8_t p[4] = { (uint8_t)(bytes >> 24), (uint8_t)(bytes >> 16), (uint8_t)(bytes >> 8), (uint8_t)bytes };
+
+	return utun_send_to(c, session, UTUN_TYPE_WINDOW, p, sizeof(p));
+}
+
+/* ------------------------------------------------------------------------- */
+/* Shared-memory transport                                                   */
+/*                                                                           */
+/* The memfd holds two rings back to back, room -> service first. Each is a */
+/* byte stream with free-running head and tail; a side that finds its ring  */
+/* empty (or full) raises a flag and sleeps on its eventfd, and the other   */
+/* side rings it only if the flag is up. Flag and index are each stored     */
+/* before the other side's is read, with a full fence in between, so one of */
+/* them always sees the other and no wakeup is lost.                        */
+/* ------------------------------------------------------------------------- */
+
+struct UtunShmRing{
+	alignas(64) _Atomic uint32_t	head;		/* producer: bytes written so far */
+	alignas(64) _Atomic uint32_t	tail;		/* consumer: bytes read so far */
+	alignas(64) _Atomic uint32_t	rx_sleeping;	/* consumer found it empty */
+	_Atomic uint32_t		tx_sleeping;	/* producer found it full */
+	alignas(64) uint8_t		data[];
+};
+
+static size_t utun_shm_span(uint32_t size){
+	return sizeof(UtunShmRing) + size;
+}
+
+int utun_shm_create(UtunShm *s, uint32_t ring_size){
+	int fds[UTUN_SHM_FDS];
+	int i, ok = 1;
+
+	if(!ring_size || (ring_size & (ring_size - 1))){
+		errno = EINVAL;
+		return -1;
+	}
+	fds[0] = memfd_create("uzenet-tunnel", MFD_CLOEXEC);
+	for(i = 1; i < UTUN_SHM_FDS; ++i) fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	for(i = 0; i < UTUN_SHM_FDS; ++i) ok = ok && fds[i] >= 0;
+	/* fresh pages read as zero: both rings start empty */
+	if(!ok || ftruncate(fds[0], (off_t)(2 * utun_shm_span(ring_size))) < 0){
+		for(i = 0; i < UTUN_SHM_FDS; ++i) if(fds[i] >= 0) close(fds[i]);
+		return -1;
+	}
+	return utun_shm_attach(s, fds, 1);
+}
+
+int utun_shm_attach(UtunShm *s, const int *fds, int room){
+	struct stat st;
+	uint32_t size = 0;
+	int i;
+
+	memcpy(s->fds, fds, sizeof(s->fds));
+	s->map = NULL;
+	if(fstat(fds[0], &st) == 0 && (size_t)st.st_size > 2 * sizeof(UtunShmRing))
+		size = (uint32_t)(st.st_size / 2 - sizeof(UtunShmRing));
+	if(!size || (size & (size - 1)) || (size_t)st.st_size != 2 * utun_shm_span(size)){
+		errno = EINVAL;
+		goto fail;
+	}
+	s->map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if(s->map == MAP_FAILED){
+		s->map = NULL;
+		goto fail;
+	}
+	s->map_len = (size_t)st.st_size;
+	s->size    = size;
+	if(room){
+		s->tx          = (UtunShmRing*)s->map;
+		s->rx          = (UtunShmRing*)(s->map + utun_shm_span(size));
+		s->rx_efd      = fds[1];
+		s->tx_efd      = fds[1];
+		s->peer_rx_efd = fds[2];
+		s->peer_tx_efd = fds[3];
+	}else{
+		s->rx          = (UtunShmRing*)s->map;
+		s->tx          = (UtunShmRing*)(s->map + utun_shm_span(size));
+		s->rx_efd      = fds[2];
+		s->tx_efd      = fds[3];
+		s->peer_rx_efd = fds[1];
+		s->peer_tx_efd = fds[1];
+	}
+	return 0;
+
+fail:
+	for(i = 0; i < UTUN_SHM_FDS; ++i) close(fds[i]);
+	return -1;
+}
+
+void utun_shm_close(UtunShm *s){
+	int i;
+
+	if(!s->map) return;
+	munmap(s->map, s->map_len);
+	for(i = 0; i < UTUN_SHM_FDS; ++i) close(s->fds[i]);
+	s->map = NULL;
+}
+
+/* Ring efd if the other side sleeps on *sleeping */
+static void utun_shm_kick(_Atomic uint32_t *sleeping, int efd){
+	uint64_t one = 1;
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if(atomic_load_explicit(sleeping, memory_order_relaxed) && atomic_exchange(sleeping, 0)){
+		ssize_t w = write(efd, &one, sizeof(one));
+		(void)w;	/* only fails with the counter full, when it is awake anyway */
+	}
+}
+
+size_t utun_shm_write(UtunShm *s, const struct iovec *iov, int cnt){
+	UtunShmRing *r = s->tx;
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t want = 0, done = 0;
+	int i, armed = 0;
+
+	for(i = 0; i < cnt; ++i) want += iov[i].iov_len;
+	for(;;){
+		size_t space = s->size - (uint32_t)(head - atomic_load_explicit(&r->tail, memory_order_acquire));
+		size_t n = 0, skip = done;
+
+		for(i = 0; i < cnt && n < space; ++i){
+			const uint8_t *p = (const uint8_t*)iov[i].iov_base;
+			size_t len = iov[i].iov_len, k, at, first;
+			if(skip >= len){
+				skip -= len;
+				continue;
+			}
+			k     = (len - skip < space - n) ? len - skip : space - n;
+			at    = (head + n) & (s->size - 1);
+			first = (s->size - at < k) ? s->size - at : k;
+			memcpy(r->data + at, p + skip, first);
+			memcpy(r->data, p + skip + first, k - first);
+			n   += k;
+			skip = 0;
+		}
+		if(n){
+			head += (uint32_t)n;
+			done += n;
+			atomic_store_explicit(&r->head, head, memory_order_release);
+			utun_shm_kick(&r->rx_sleeping, s->peer_rx_efd);
+		}
+		if(done == want){
+			if(armed) atomic_store_explicit(&r->tx_sleeping, 0, memory_order_relaxed);
+			return done;
+		}
+		if(armed) return done;
+		/* full: ask for a ring on tx_efd, then look once more */
+		atomic_store_explicit(&r->tx_sleeping, 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		armed = 1;
+	}
+}
+
+size_t utun_shm_read(UtunShm *s, void *buf, size_t len){
+	UtunShmRing *r = s->rx;
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	int armed = 0;
+
+	for(;;){
+		size_t n = (uint32_t)(atomic_load_explicit(&r->head, memory_order_acquire) - tail);
+		if(n > len) n = len;
+		if(n){
+			size_t at = tail & (s->size - 1);
+			size_t first = (s->size - at < n) ? s->size - at : n;
+			memcpy(buf, r->data + at, first);
+			memcpy((uint8_t*)buf + first, r->data, n - first);
+			atomic_store_explicit(&r->tail, tail + (uint32_t)n, memory_order_release);
+			if(armed) atomic_store_explicit(&r->rx_sleeping, 0, memory_order_relaxed);
+			utun_shm_kick(&r->tx_sleeping, s->peer_tx_efd);
+			return n;
+		}
+		if(armed || !len) return 0;
+		/* empty: ask for a ring on rx_efd, then look once more */
+		atomic_store_explicit(&r->rx_sleeping, 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		armed = 1;
+	}
+}
+
+/* Sleep until efd rings: 1, or 0 once the peer closed the socket, which
+ * carries nothing else after SHM */
+static int utun_shm_wait(UtunConn *c, int efd){
+	struct pollfd p[2] = { { .fd = efd, .events = POLLIN }, { .fd = c->fd, .events = POLLIN } };
+	uint64_t v;
+
+	for(;;){
+		if(poll(p, 2, -1) < 0){
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		if(p[1].revents) return 0;
+		if(p[0].revents & POLLIN){
+			ssize_t r = read(efd, &v, sizeof(v));
+			(void)r;
+			return 1;
+		}
+	}
+}
+
+int utun_shm_accept(UtunConn *c, const UtunFrameRef *fr){
+	if(fr->type != UTUN_TYPE_SHM || c->nfds != UTUN_SHM_FDS || c->shm.map){
+		errno = EPROTO;
+		return -1;
+	}
+	c->nfds = 0;
+	if(utun_shm_attach(&c->shm, c->fds, 0) < 0) return -1;
+	if(utun_send(c, UTUN_TYPE_SHM, NULL, 0) < 0) return -1;
+	/* room sent nothing after its SHM: both ways go through the rings now */
+	c->shm_tx = 1;
+	c->shm_rx = 1;
 	return 0;
 }
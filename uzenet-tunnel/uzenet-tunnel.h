@@ -4,12 +4,16 @@
 #include <stdint.h>
 #include <stddef.h>
 
-#define UTUN_MAX_PAYLOAD	256	/* or 64 if you want lichess-sized frames */
+#define UTUN_MAX_PAYLOAD	256	/* default per-connection limit, TunnelFrame's size */
 
 #define UTUN_TYPE_LOGIN		0x01
 #define UTUN_TYPE_DATA		0x02
 #define UTUN_TYPE_PING		0x03
 #define UTUN_TYPE_PONG		0x04
+/* room channels, service -> room only; data starts with the channel (u16 BE) */
+#define UTUN_TYPE_SUBSCRIBE	0x05	/* [channel][flags]: the link's user joins */
+#define UTUN_TYPE_UNSUBSCRIBE	0x06	/* [channel] */
+#define UTUN_TYPE_PUBLISH	0x07	/* [channel][payload <= 255]: to every subscriber */
 
 typedef struct{
 	uint8_t		type;
@@ -30,4 +34,183 @@ int utun_write_full(int fd, const void *buf, size_t len);
 int utun_read_frame(int fd, TunnelFrame *fr);
 int utun_write_frame(int fd, const TunnelFrame *fr);
 
+/* batched I/O: one writev() for a run of frames */
+#define UTUN_WRITEV_FRAMES	32	/* frames per writev(), 2 iovecs each */
+
+int utun_write_frames(int fd, const TunnelFrame *frs, int count);
+
+/* ------------------------------------------------------------------------- */
+/* Connection codec                                                          */
+/*                                                                           */
+/* A UtunConn buffers what one read() brings in and hands frames out in      */
+/* place: UtunFrameRef.data points into the connection's buffer, so a        */
+/* payload is never copied on the way in. On the way out utun_send() writes  */
+/* header and payload straight from the caller's buffer.                     */
+/*                                                                           */
+/* Each end says how much payload it accepts per frame: the room in the      */
+/* LOGIN meta, a service with a LIMIT frame when it wants other than         */
+/* UTUN_MAX_PAYLOAD. utun_send() cuts DATA to the peer's limit, so a bulk    */
+/* service sends up to UTUN_BULK_PAYLOAD per frame to a room that takes it.  */
+/* ------------------------------------------------------------------------- */
+
+#define UTUN_TYPE_LIMIT		0x08	/* [max payload u16]: largest DATA this end accepts */
+#define UTUN_MIN_PAYLOAD	16	/* smallest LIMIT honoured */
+#define UTUN_BULK_PAYLOAD	0xFFFF	/* largest limit either end may announce */
+#define UTUN_RBUF_SIZE		4096
+#define UTUN_HDR_SIZE		4	/* [type][flags][len u16] */
+
+/* LOGIN payload: [user u16][max payload u16, 0 = UTUN_MAX_PAYLOAD], big-endian */
+#define UTUN_LOGIN_SIZE		4
+
+typedef struct{
+	uint8_t		type;
+	uint8_t		flags;
+	uint16_t	length;
+	uint16_t	session;	/* multiplexed connections only, else 0 */
+	const uint8_t	*data;		/* in the connection's buffer, valid until its next read */
+} UtunFrameRef;
+
+/* Shared-memory transport, see below */
+#define UTUN_SHM_FDS		4	/* memfd, room's doorbell, service's rx and tx doorbells */
+
+typedef struct UtunShmRing UtunShmRing;
+
+typedef struct{
+	uint8_t		*map;		/* both rings, NULL when not in use */
+	size_t		map_len;
+	uint32_t	size;		/* bytes per ring */
+	UtunShmRing	*rx, *tx;
+	int		fds[UTUN_SHM_FDS];
+	int		rx_efd, tx_efd;		/* ours: data came in, space came free */
+	int		peer_rx_efd, peer_tx_efd;	/* rung when the peer sleeps on them */
+} UtunShm;
+
+typedef struct{
+	int		fd;
+	uint8_t		hdr;		/* header size: UTUN_HDR_SIZE, or UTUN_MUX_HDR_SIZE */
+	uint8_t		shm_rx, shm_tx;	/* reading / sending through shm instead of fd */
+	uint8_t		nfds;		/* fds that came with the data, for utun_shm_accept() */
+	int		fds[UTUN_SHM_FDS];
+	UtunShm		shm;
+	uint16_t	max_payload;	/* largest payload we ask the peer for, <= UTUN_RBUF_SIZE - 6 */
+	uint16_t	peer_max;	/* largest payload the peer accepts */
+	uint16_t	off;		/* first unparsed byte in buf */
+	uint16_t	len;		/* bytes in buf */
+	uint16_t	skip;		/* payload left of an over-length frame */
+	uint8_t		flow;		/* the peer sent WINDOW: DATA toward it spends credit */
+	uint32_t	credit;		/* per-user connection: DATA bytes the peer still takes */
+	uint32_t	*credits;	/* multiplexed: the same by session, from the first WINDOW */
+	uint8_t		buf[UTUN_RBUF_SIZE];
+} UtunConn;
+
+/* max_payload 0 means UTUN_MAX_PAYLOAD; it is capped so a frame fits the buffer */
+void utun_conn_init(UtunConn *c, int fd, uint16_t max_payload);
+/* unmaps shm, frees credit and closes fds the connection received; fd
+ * itself stays open */
+void utun_conn_release(UtunConn *c);
+/* nonzero if a complete frame is buffered, i.e. the next read won't block */
+int utun_conn_ready(const UtunConn *c);
+
+/* next frame, reading only when none is buffered: returns
+ *   1   frame in *fr, valid until the next call on c
+ *   0   clean EOF
+ *  <0   error; errno EAGAIN on a non-blocking fd with no whole frame yet,
+ *       EMSGSIZE for a frame over UTUN_MAX_PAYLOAD (skipped, the next call
+ *       goes on). Frames above max_payload but within UTUN_MAX_PAYLOAD are
+ *       returned: the peer may send some before our LIMIT reaches it. */
+int utun_next_frame(UtunConn *c, UtunFrameRef *fr);
+/* copying variant: up to max frames, only the first may block; returns the
+ * number of frames, 0 on EOF and <0 on error (EMSGSIZE if a frame is larger
+ * than a TunnelFrame holds) */
+int utun_read_frames(UtunConn *c, TunnelFrame *frs, int max);
+
+/* take a LOGIN frame: learns the room's limit and, if ours is not
+ * UTUN_MAX_PAYLOAD, answers with LIMIT; returns the user id or <0. Also
+ * takes an OPEN, which only carries the user. */
+int utun_login(UtunConn *c, const UtunFrameRef *fr);
+/* one frame of any type, DATA cut to the peer's limit and charged to its
+ * window (see "Flow control"); 0 or <0 on error. Frames go out whole, also
+ * on a non-blocking fd, which waits for the socket to take them. */
+int utun_send(UtunConn *c, uint8_t type, const void *data, size_t len);
+
+/* ------------------------------------------------------------------------- */
+/* Multiplexed connections                                                   */
+/*                                                                           */
+/* Room may open a service connection with MUX instead of LOGIN. From then   */
+/* on every header carries a session id, OPEN starts a session for a user    */
+/* and CLOSE ends one, so one long-lived connection serves every user the    */
+/* room worker has on that service. PING, PONG and LIMIT use session 0 and   */
+/* apply to the whole connection. utun_next_frame() switches the header      */
+/* format as it hands out the MUX frame.                                     */
+/* ------------------------------------------------------------------------- */
+
+#define UTUN_TYPE_MUX		0x09	/* room -> service, first frame: [max payload u16] */
+#define UTUN_TYPE_OPEN		0x0A	/* room -> service: [user u16], a new session */
+#define UTUN_TYPE_CLOSE		0x0B	/* either way: the session is over */
+#define UTUN_MUX_HDR_SIZE	6	/* [type][flags][len u16][session u16] */
+
+/* take a MUX frame: learns the room's limit and answers with LIMIT like
+ * utun_login(); returns 0 or <0 */
+int utun_mux_accept(UtunConn *c, const UtunFrameRef *fr);
+/* utun_send() for one session; callers sharing c across threads serialize */
+int utun_send_to(UtunConn *c, uint16_t session, uint8_t type, const void *data, size_t len);
+
+/* ------------------------------------------------------------------------- */
+/* Shared-memory transport                                                   */
+/*                                                                           */
+/* On a multiplexed connection room may move the byte stream off the socket */
+/* into two single-producer single-consumer rings in a memfd, one per        */
+/* direction. Room sends SHM with the memfd and eventfds attached as its     */
+/* last frame on the socket; the service maps them, answers SHM as its last  */
+/* frame there, and from then on both ends copy frames in and out of the    */
+/* rings. A doorbell is rung only when the other end found its ring empty   */
+/* (or full) and went to sleep, so a busy stream costs no syscalls. The     */
+/* socket stays open to tell either end when the other goes away.           */
+/* ------------------------------------------------------------------------- */
+
+#define UTUN_TYPE_SHM		0x0C	/* either way, the sender's last frame on the socket */
+#define UTUN_SHM_RING_SIZE	65536	/* bytes per direction, a power of two */
+
+struct iovec;
+
+/* room side: a new memfd with both rings and the doorbells to pass */
+int utun_shm_create(UtunShm *s, uint32_t ring_size);
+/* map fds[UTUN_SHM_FDS] that came with SHM (or a hot restart); room = 1 on
+ * the room's side. Takes the fds over, also on failure. */
+int utun_shm_attach(UtunShm *s, const int *fds, int room);
+void utun_shm_close(UtunShm *s);
+/* copy in as much as fits, ringing the peer if it sleeps; returns the bytes
+ * taken. Short of all of it, the ring is armed to ring tx_efd once it has
+ * room. */
+size_t utun_shm_write(UtunShm *s, const struct iovec *iov, int cnt);
+/* copy out up to len bytes; at 0 the ring is armed to ring rx_efd once
+ * something comes in */
+size_t utun_shm_read(UtunShm *s, void *buf, size_t len);
+
+/* take room's SHM frame: maps what came with it, answers SHM and switches c
+ * to the rings. On failure drop the connection, room no longer uses fd. */
+int utun_shm_accept(UtunConn *c, const UtunFrameRef *fr);
+
+/* ------------------------------------------------------------------------- */
+/* Flow control                                                              */
+/*                                                                           */
+/* A receiver that wants to be paced grants the sender a window per session */
+/* with WINDOW: that many more bytes of DATA payload. DATA spends it and     */
+/* each WINDOW adds to it. A sender is unlimited until its peer's first      */
+/* WINDOW; after that every session starts at no credit, OPEN and CLOSE      */
+/* reset it, so the receiver grants one right behind OPEN. utun_next_frame() */
+/* applies WINDOWs as it hands them out and utun_send_to() charges DATA, but */
+/* nothing ever waits for credit: a sender checks utun_credit() and holds    */
+/* back what does not fit, so one slow session stays queued on its own       */
+/* instead of stalling the connection.                                       */
+/* ------------------------------------------------------------------------- */
+
+#define UTUN_TYPE_WINDOW	0x0D	/* either way: [credit u32], more DATA the session may send */
+
+/* DATA bytes the session may still send, SIZE_MAX while the peer grants none;
+ * safe against a concurrent utun_next_frame() */
+size_t utun_credit(const UtunConn *c, uint16_t session);
+/* let the peer send <bytes> more DATA on the session; 0 or <0 on error */
+int utun_window(UtunConn *c, uint16_t session, uint32_t bytes);
+
 #endif
@@ -15,30 +15,95 @@
  * Protocol layering:
  *
  *   Uzebox <-> uzenet-room  : 0xF0|tunnel_id + len + payload
- *   uzenet-room <-> this    : uzenet-tunnel (TunnelFrame)
+ *   uzenet-room <-> this    : uzenet-tunnel (UtunConn)
  *   payload (this service)  : virtual FujiNet commands
  *
- * This file only cares about the last layer (TunnelFrame + service payload).
+ * This file only cares about the last layer (tunnel frames + service payload).
+ *
+ * A connection that starts with LOGIN belongs to one user and gets a thread
+ * of its own. One that starts with MUX carries every user of a room worker:
+ * its thread only reads and hands each session's frames to one of
+ * VFN_WORKERS threads, picked by session id so a session's commands still
+ * run in order. Room may move such a connection into shared memory (SHM);
+ * the codec then reads and sends through the rings instead.
+ *
+ * On a multiplexed connection both directions are paced per session with
+ * WINDOW. Room gets VFN_WINDOW of credit per session and more as a worker
+ * gets through its jobs, so a busy session can't queue without bound. A
+ * reply past room's window waits in the session's pending buffer until room
+ * grants more, so a slow Uzebox never holds up a worker, or the other
+ * sessions behind it.
+ *
+ * The reader never sends. A send on a full shared-memory ring waits for room
+ * to drain it, and the reader has to keep taking WINDOW and CLOSE meanwhile,
+ * so OPEN's first grant, the replies a WINDOW frees and PONG all go out as
+ * jobs on the session's worker.
  */
 
+struct vfn_mux_s{
+	UtunConn		tun;
+	pthread_mutex_t	lock;		/* refs, sessions' closed; never held across a send */
+	pthread_mutex_t	send_lock;	/* sends on tun, which may wait for room */
+	int				refs;		/* reader + live sessions + queued PONGs; the last closes fd */
+	vfn_client_t	**sessions;	/* by session id, reader thread only */
+};
+
 /* ------------------------------------------------------------------------- */
 /* Helpers                                                                   */
 /* ------------------------------------------------------------------------- */
 
-static int vfn_send_data(vfn_client_t *c, const void *buf, uint16_t len){
-	TunnelFrame fr;
+/* Send as much of a mux session's pending replies as room's window takes;
+ * called on the session's worker with mux->send_lock held */
+static int vfn_flush_pending(vfn_client_t *c){
+	size_t n = utun_credit(c->tun, c->session);
 
-	if(len > UTUN_MAX_PAYLOAD)
-		len = UTUN_MAX_PAYLOAD;
+	if(n > c->pending_len){
+		n = c->pending_len;
+	}
+	if(!n){
+		return 0;
+	}
+	if(utun_send_to(c->tun, c->session, UTUN_TYPE_DATA, c->pending, n) < 0){
+		return -1;
+	}
+	memmove(c->pending, c->pending + n, c->pending_len - n);
+	c->pending_len -= n;
+	return 0;
+}
 
-	memset(&fr, 0, sizeof(fr));
-	fr.type   = UTUN_TYPE_DATA;
-	fr.flags  = 0;
-	fr.length = len;
-	if(len)
-		memcpy(fr.data, buf, len);
+static int vfn_send_data(vfn_client_t *c, const void *buf, uint16_t len){
+	const uint8_t *p = buf;
+	size_t n;
+	int rc = 0;
 
-	return utun_write_frame(c->fd, &fr);
+	if(!c->mux){
+		return utun_send(c->tun, UTUN_TYPE_DATA, buf, len);
+	}
+	/* Only the session's worker gets here, so pending needs no lock */
+	pthread_mutex_lock(&c->mux->send_lock);
+	/* What room has credit for goes now, behind anything already waiting */
+	n = c->pending_len ? 0 : utun_credit(c->tun, c->session);
+	if(n > len){
+		n = len;
+	}
+	if(n){
+		rc = utun_send_to(c->tun, c->session, UTUN_TYPE_DATA, p, n);
+	}
+	if(rc == 0 && n < len){
+		uint8_t *q = NULL;
+		if(c->pending_len + (len - n) <= VFN_PENDING_MAX){
+			q = realloc(c->pending, c->pending_len + (len - n));
+		}
+		if(q){
+			memcpy(q + c->pending_len, p + n, len - n);
+			c->pending = q;
+			c->pending_len += len - n;
+		}else{
+			rc = -1;	/* room stopped granting, or out of memory: drop it */
+		}
+	}
+	pthread_mutex_unlock(&c->mux->send_lock);
+	return rc;
 }
 
 /* For now, we treat the first byte of DATA payload as a "command id". */
@@ -184,30 +249,313 @@ static void vfn_handle_data(vfn_client_t *c, const uint8_t *data, uint16_t len){
 	}
 }
 
+/* ------------------------------------------------------------------------- */
+/* Worker pool for multiplexed connections                                   */
+/* ------------------------------------------------------------------------- */
+
+typedef struct vfn_job_s{
+	struct vfn_job_s	*next;
+	vfn_mux_t			*mux;
+	vfn_client_t		*c;			/* NULL for PING */
+	uint16_t			session;
+	uint8_t				type;		/* OPEN, DATA, WINDOW, PING, or CLOSE: the job frees c */
+	uint16_t			len;
+	uint8_t				data[];
+} vfn_job_t;
+
+typedef struct{
+	pthread_mutex_t	lock;
+	pthread_cond_t	wake;
+	vfn_job_t		*head, *tail;
+} vfn_worker_t;
+
+static vfn_worker_t workers[VFN_WORKERS];
+
+static void vfn_mux_put(vfn_mux_t *m){
+	int refs;
+
+	pthread_mutex_lock(&m->lock);
+	refs = --m->refs;
+	pthread_mutex_unlock(&m->lock);
+	if(refs == 0){
+		utun_conn_release(&m->tun);
+		close(m->tun.fd);
+		pthread_mutex_destroy(&m->lock);
+		pthread_mutex_destroy(&m->send_lock);
+		free(m);
+	}
+}
+
+static int vfn_session_closed(vfn_client_t *c){
+	int closed;
+
+	pthread_mutex_lock(&c->mux->lock);
+	closed = c->closed;
+	pthread_mutex_unlock(&c->mux->lock);
+	return closed;
+}
+
+static void *vfn_worker_main(void *arg){
+	vfn_worker_t *w = arg;
+	vfn_mux_t *m;
+	vfn_job_t *j;
+
+	for(;;){
+		pthread_mutex_lock(&w->lock);
+		while(!w->head){
+			pthread_cond_wait(&w->wake, &w->lock);
+		}
+		j = w->head;
+		w->head = j->next;
+		if(!w->head){
+			w->tail = NULL;
+		}
+		pthread_mutex_unlock(&w->lock);
+
+		m = j->mux;
+		if(j->type == UTUN_TYPE_OPEN){
+			if(!vfn_session_closed(j->c)){
+				pthread_mutex_lock(&m->send_lock);
+				(void)utun_window(&m->tun, j->session, VFN_WINDOW);
+				pthread_mutex_unlock(&m->send_lock);
+			}
+		}else if(j->type == UTUN_TYPE_DATA){
+			vfn_handle_data(j->c, j->data, j->len);
+			/* Done with it: room may send that much more, a quarter
+			 * window at a time rather than a WINDOW per frame */
+			j->c->consumed += j->len;
+			if(j->c->consumed >= VFN_WINDOW / 4 && !vfn_session_closed(j->c)){
+				pthread_mutex_lock(&m->send_lock);
+				(void)utun_window(&m->tun, j->session, j->c->consumed);
+				pthread_mutex_unlock(&m->send_lock);
+				j->c->consumed = 0;
+			}
+		}else if(j->type == UTUN_TYPE_WINDOW){
+			/* The reader's codec took the credit; send what waited for it */
+			if(!vfn_session_closed(j->c)){
+				pthread_mutex_lock(&m->send_lock);
+				(void)vfn_flush_pending(j->c);
+				pthread_mutex_unlock(&m->send_lock);
+			}
+		}else if(j->type == UTUN_TYPE_PING){
+			pthread_mutex_lock(&m->send_lock);
+			(void)utun_send_to(&m->tun, j->session, UTUN_TYPE_PONG, NULL, 0);
+			pthread_mutex_unlock(&m->send_lock);
+			vfn_mux_put(m);
+		}else{
+			fprintf(stderr,
+				"[virtual-fujinet] user %u: session %u closed\n",
+				(unsigned)j->c->user_id, (unsigned)j->c->session);
+			vfn_mux_put(j->c->mux);
+			free(j->c->pending);
+			free(j->c);
+		}
+		free(j);
+	}
+	return NULL;
+}
+
+static int vfn_workers_start(void){
+	pthread_t tid;
+	int i;
+
+	for(i = 0; i < VFN_WORKERS; i++){
+		pthread_mutex_init(&workers[i].lock, NULL);
+		pthread_cond_init(&workers[i].wake, NULL);
+		if(pthread_create(&tid, NULL, vfn_worker_main, &workers[i]) != 0){
+			return -1;
+		}
+		pthread_detach(tid);
+	}
+	return 0;
+}
+
+/* Queue a session's frame on its worker; the payload is copied, since the
+ * reader's buffer moves on. */
+static int vfn_dispatch(vfn_mux_t *m, uint16_t session, vfn_client_t *c, uint8_t type, const uint8_t *data, uint16_t len){
+	vfn_worker_t *w = &workers[session % VFN_WORKERS];
+	vfn_job_t *j = malloc(sizeof(*j) + len);
+
+	if(!j){
+		return -1;
+	}
+	j->next    = NULL;
+	j->mux     = m;
+	j->c       = c;
+	j->session = session;
+	j->type    = type;
+	j->len     = len;
+	if(len){
+		memcpy(j->data, data, len);
+	}
+
+	pthread_mutex_lock(&w->lock);
+	if(w->tail){
+		w->tail->next = j;
+	}else{
+		w->head = j;
+	}
+	w->tail = j;
+	pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+}
+
+static void vfn_session_close(vfn_mux_t *m, uint16_t sid){
+	vfn_client_t *c = m->sessions[sid];
+
+	m->sessions[sid] = NULL;
+	pthread_mutex_lock(&m->lock);
+	c->closed = 1;
+	pthread_mutex_unlock(&m->lock);
+	if(vfn_dispatch(m, sid, c, UTUN_TYPE_CLOSE, NULL, 0) < 0){
+		/* Out of memory: its earlier jobs may still be queued, leak it */
+		fprintf(stderr, "[virtual-fujinet] user %u: cannot close session\n", (unsigned)c->user_id);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+/* Multiplexed connection                                                    */
+/* ------------------------------------------------------------------------- */
+
+/* Reader for a connection that opened with MUX; *tun moves into the shared
+ * state, which the last of the reader and the sessions frees. */
+static void vfn_mux_serve(UtunConn *tun, const UtunFrameRef *first){
+	vfn_mux_t *m = calloc(1, sizeof(*m));
+	UtunFrameRef fr;
+	uint32_t sid;
+	int rc;
+
+	if(!m || !(m->sessions = calloc(0x10000, sizeof(*m->sessions)))){
+		free(m);
+		close(tun->fd);
+		return;
+	}
+	m->tun  = *tun;
+	m->refs = 1;
+	pthread_mutex_init(&m->lock, NULL);
+	pthread_mutex_init(&m->send_lock, NULL);
+
+	rc = utun_mux_accept(&m->tun, first);	/* no sessions yet, nobody else sends */
+	fprintf(stderr, "[virtual-fujinet] MUX connection\n");
+
+	while(rc >= 0){
+		/* Reading needs no lock: sends never touch the read buffer */
+		rc = utun_next_frame(&m->tun, &fr);
+		if(rc <= 0){
+			if(rc < 0 && errno == EMSGSIZE){
+				rc = 0;
+				continue;
+			}
+			if(rc < 0){
+				fprintf(stderr, "[virtual-fujinet] MUX read error (%s)\n", strerror(errno));
+			}
+			break;
+		}
+
+		vfn_client_t *c = m->sessions[fr.session];
+		if(fr.type == UTUN_TYPE_OPEN){
+			vfn_client_t *n;
+			if(c){
+				vfn_session_close(m, fr.session);
+			}
+			n = calloc(1, sizeof(*n));
+			if(!n){
+				continue;
+			}
+			n->fd      = m->tun.fd;
+			n->tun     = &m->tun;
+			n->mux     = m;
+			n->session = fr.session;
+			n->user_id = (uint16_t)utun_login(&m->tun, &fr);
+			pthread_mutex_lock(&m->lock);
+			m->refs++;
+			pthread_mutex_unlock(&m->lock);
+			m->sessions[fr.session] = n;
+			if(vfn_dispatch(m, fr.session, n, UTUN_TYPE_OPEN, NULL, 0) < 0){
+				fprintf(stderr, "[virtual-fujinet] user %u: cannot grant a window\n", (unsigned)n->user_id);
+			}
+			fprintf(stderr,
+				"[virtual-fujinet] OPEN session %u user_id=%u\n",
+				(unsigned)fr.session, (unsigned)n->user_id);
+		}else if(fr.type == UTUN_TYPE_CLOSE){
+			if(c){
+				vfn_session_close(m, fr.session);
+			}
+		}else if(fr.type == UTUN_TYPE_DATA){
+			if(c && vfn_dispatch(m, fr.session, c, UTUN_TYPE_DATA, fr.data, fr.length) < 0){
+				fprintf(stderr, "[virtual-fujinet] user %u: dropped a frame\n", (unsigned)c->user_id);
+			}
+		}else if(fr.type == UTUN_TYPE_WINDOW){
+			/* The codec took the credit; the worker sends what waited for it */
+			if(c && vfn_dispatch(m, fr.session, c, UTUN_TYPE_WINDOW, NULL, 0) < 0){
+				fprintf(stderr, "[virtual-fujinet] user %u: dropped a window\n", (unsigned)c->user_id);
+			}
+		}else if(fr.type == UTUN_TYPE_PING){
+			pthread_mutex_lock(&m->lock);
+			m->refs++;
+			pthread_mutex_unlock(&m->lock);
+			if(vfn_dispatch(m, fr.session, NULL, UTUN_TYPE_PING, NULL, 0) < 0){
+				vfn_mux_put(m);
+			}
+		}else if(fr.type == UTUN_TYPE_SHM){
+			/* Room moves the connection into shared memory; a socket send
+			 * never waits long, room reads it until it sees our SHM */
+			pthread_mutex_lock(&m->send_lock);
+			rc = utun_shm_accept(&m->tun, &fr);
+			pthread_mutex_unlock(&m->send_lock);
+			if(rc < 0){
+				fprintf(stderr, "[virtual-fujinet] MUX cannot map shared memory (%s)\n", strerror(errno));
+			}
+		}else{
+			/* Ignore other types for now. */
+		}
+	}
+
+	/* EOF: every session on it is gone */
+	fprintf(stderr, "[virtual-fujinet] MUX disconnect\n");
+	for(sid = 1; sid < 0x10000; sid++){
+		if(m->sessions[sid]){
+			vfn_session_close(m, (uint16_t)sid);
+		}
+	}
+	free(m->sessions);
+	m->sessions = NULL;
+	vfn_mux_put(m);
+}
+
 /* ------------------------------------------------------------------------- */
 /* Single-connection handler                                                 */
 /* ------------------------------------------------------------------------- */
 
 void uzenet_virtual_fujinet_handle(int fd){
 	vfn_client_t c;
-	TunnelFrame fr;
+	UtunConn tun;
+	UtunFrameRef fr;
 	int rc;
 
 	memset(&c, 0, sizeof(c));
 	c.fd      = fd;
 	c.user_id = 0xFFFF;
+	c.tun     = &tun;
+	utun_conn_init(&tun, fd, 0);
 
-	/* 1) Expect a LOGIN frame from uzenet-room. */
-	rc = utun_read_frame(fd, &fr);
+	/* 1) Expect a LOGIN (or MUX) frame from uzenet-room. */
+	rc = utun_next_frame(&tun, &fr);
 	if(rc <= 0){
 		/* EOF or error before LOGIN. */
 		close(fd);
 		return;
 	}
 
-	if(fr.type == UTUN_TYPE_LOGIN && fr.length >= 2){
-		uint16_t uid = (uint16_t)((fr.data[0] << 8) | fr.data[1]);
-		c.user_id = uid;
+	if(fr.type == UTUN_TYPE_MUX){
+		vfn_mux_serve(&tun, &fr);
+		return;
+	}
+
+	rc = utun_login(&tun, &fr);
+	if(rc >= 0){
+		c.user_id = (uint16_t)rc;
 		fprintf(stderr,
 			"[virtual-fujinet] LOGIN user_id=%u\n",
 			(unsigned)c.user_id);
@@ -220,9 +568,9 @@ void uzenet_virtual_fujinet_handle(int fd){
 		return;
 	}
 
-	/* 2) Main frame loop. */
+	/* 2) Main frame loop; payloads are handled in place in the read buffer. */
 	for(;;){
-		rc = utun_read_frame(fd, &fr);
+		rc = utun_next_frame(&tun, &fr);
 		if(rc == 0){
 			/* EOF */
 			fprintf(stderr,
@@ -241,12 +589,7 @@ void uzenet_virtual_fujinet_handle(int fd){
 		if(fr.type == UTUN_TYPE_DATA){
 			vfn_handle_data(&c, fr.data, fr.length);
 		}else if(fr.type == UTUN_TYPE_PING){
-			TunnelFrame pong;
-			memset(&pong, 0, sizeof(pong));
-			pong.type   = UTUN_TYPE_PONG;
-			pong.flags  = 0;
-			pong.length = 0;
-			(void)utun_write_frame(c.fd, &pong);
+			(void)utun_send(&tun, UTUN_TYPE_PONG, NULL, 0);
 		}else{
 			/* Ignore other types for now. */
 		}
@@ -308,6 +651,12 @@ int main(int argc, char **argv){
 		return 1;
 	}
 
+	if(vfn_workers_start() < 0){
+		perror("pthread_create");
+		close(fd);
+		return 1;
+	}
+
 	listen_fd = fd;
 	fprintf(stderr, "[virtual-fujinet] listening on %s\n", VFN_SOCKET_PATH);
 
@@ -6,15 +6,29 @@
 
 #define VFN_SOCKET_PATH "/run/uzenet/virtual-fujinet.sock"
 
+#define VFN_WORKERS	4	/* threads serving sessions of multiplexed connections */
+#define VFN_WINDOW	4096	/* DATA a session may have queued for its worker */
+#define VFN_PENDING_MAX	65536	/* replies a session may have waiting for room's credit */
+
+typedef struct vfn_mux_s vfn_mux_t;
+
 /* Per-client context for uzenet-virtual-fujinet */
 typedef struct{
 	int			fd;
 	uint16_t	user_id;
+	UtunConn	*tun;		/* frame codec on fd, shared on a multiplexed connection */
+	vfn_mux_t	*mux;		/* NULL: the connection is this user's alone */
+	uint16_t	session;	/* id on mux */
+	int			closed;		/* mux: room closed the session, its jobs drain */
+	uint32_t	consumed;	/* mux: DATA handled since our last WINDOW */
+	uint8_t		*pending;	/* mux: replies past room's window, sent as WINDOWs come */
+	size_t		pending_len;
 
 	/* TODO: add per-user prefs, TNFS sessions, HTTPS state, etc. */
 } vfn_client_t;
 
-/* Entry point for a single accepted AF_UNIX connection. */
+/* Entry point for a single accepted AF_UNIX connection: one user after
+ * LOGIN, or every session of a room worker after MUX. */
 void uzenet_virtual_fujinet_handle(int fd);
 
 #endif /* UZENET_VIRTUAL_FUJINET_H */
@@ -29,7 +29,7 @@
 
 #include <curl/curl.h>
 #include "miniz.h"
-#include "uzenet-tunnel.h"	// TunnelFrame, TUNNEL_TYPE_*, ReadTunnelFramed, WriteTunnelFramed
+#include "../uzenet-tunnel/uzenet-tunnel.h"	// UtunConn, UTUN_TYPE_*
 
 typedef int sock_t;
 #define close_socket(s)	close(s)
@@ -38,6 +38,7 @@ typedef int sock_t;
 #define BACKLOG				32
 #define CMD_BUF_LEN			256
 #define MAX_EOCD_SEARCH		0x10000	// last 64KB
+#define BRIDGE_READ_LEN		UTUN_BULK_PAYLOAD	// worker output per DATA frame, if room takes it
 #define ZIPSTREAM_SOCKET_PATH	"/run/uzenet/zipstream.sock"
 
 struct mem_range {
@@ -337,11 +338,6 @@ static void handle_client_inner(sock_t client){
 
 /* ---------- Tunnel bridge ---------- */
 
-typedef struct{
-	uint16_t user_id;
-	uint16_t reserved;
-} TunnelLoginMeta;
-
 static int write_full_stream(int fd, const void *buf, size_t len){
 	const uint8_t *p = (const uint8_t*)buf;
 	while(len){
@@ -372,20 +368,27 @@ static void *tunnel_client_thread(void *arg){
 	int tunnel_fd = ta->tunnel_fd;
 	free(ta);
 
-	TunnelFrame fr;
+	UtunConn conn;
+	UtunFrameRef fr;
 	int have_first_data = 0;
 
+	utun_conn_init(&conn, tunnel_fd, 0);
+
 	// First frame: LOGIN meta or DATA
-	int r = ReadTunnelFramed(tunnel_fd, &fr);
+	int r = utun_next_frame(&conn, &fr);
 	if(r <= 0){
 		close(tunnel_fd);
 		return NULL;
 	}
 
-	if(fr.type == TUNNEL_TYPE_LOGIN && fr.length >= sizeof(TunnelLoginMeta)){
-		const TunnelLoginMeta *meta = (const TunnelLoginMeta*)fr.data;
-		syslog(LOG_INFO, "ZipStream: LOGIN user_id=%u", (unsigned)meta->user_id);
-	}else if(fr.type == TUNNEL_TYPE_DATA && fr.length > 0){
+	if(fr.type == UTUN_TYPE_LOGIN){
+		int uid = utun_login(&conn, &fr);
+		if(uid < 0){
+			close(tunnel_fd);
+			return NULL;
+		}
+		syslog(LOG_INFO, "ZipStream: LOGIN user_id=%u", (unsigned)uid);
+	}else if(fr.type == UTUN_TYPE_DATA && fr.length > 0){
 		have_first_data = 1;
 	}else{
 		// ignore other types, fall through
@@ -427,26 +430,29 @@ static void *tunnel_client_thread(void *arg){
 	for(;;){
 		fd_set rfds;
 		int maxfd = (tunnel_fd > bridge_fd ? tunnel_fd : bridge_fd) + 1;
+		// Frames already in the codec's buffer don't make tunnel_fd readable
+		int buffered = utun_conn_ready(&conn);
+		struct timeval poll_only = { 0, 0 };
 
 		FD_ZERO(&rfds);
 		FD_SET(tunnel_fd, &rfds);
 		FD_SET(bridge_fd, &rfds);
 
-		int n = select(maxfd, &rfds, NULL, NULL, NULL);
+		int n = select(maxfd, &rfds, NULL, NULL, buffered ? &poll_only : NULL);
 		if(n < 0){
 			if(errno == EINTR) continue;
 			break;
 		}
 
-		// Tunnel -> worker
-		if(FD_ISSET(tunnel_fd, &rfds)){
-			TunnelFrame in_fr;
-			int rt = ReadTunnelFramed(tunnel_fd, &in_fr);
+		// Tunnel -> worker, straight from the receive buffer
+		if(buffered || FD_ISSET(tunnel_fd, &rfds)){
+			UtunFrameRef in_fr;
+			int rt = utun_next_frame(&conn, &in_fr);
 			if(rt <= 0){
 				// remote closed or error
 				break;
 			}
-			if(in_fr.type == TUNNEL_TYPE_DATA && in_fr.length > 0){
+			if(in_fr.type == UTUN_TYPE_DATA && in_fr.length > 0){
 				if(write_full_stream(bridge_fd, in_fr.data, in_fr.length) < 0){
 					break;
 				}
@@ -456,29 +462,15 @@ static void *tunnel_client_thread(void *arg){
 
 		// Worker -> tunnel
 		if(FD_ISSET(bridge_fd, &rfds)){
-			uint8_t buf[1024];
+			uint8_t buf[BRIDGE_READ_LEN];
 			ssize_t rd = read(bridge_fd, buf, sizeof(buf));
 			if(rd <= 0){
 				// worker closed
 				break;
 			}
-			size_t off = 0;
-			while(off < (size_t)rd){
-				size_t chunk = (size_t)rd - off;
-				if(chunk > TUNNEL_MAX_PAYLOAD)
-					chunk = TUNNEL_MAX_PAYLOAD;
-
-				TunnelFrame out;
-				out.type   = TUNNEL_TYPE_DATA;
-				out.flags  = 0;
-				out.length = (uint16_t)chunk;
-				memcpy(out.data, buf + off, chunk);
-
-				if(WriteTunnelFramed(tunnel_fd, &out) < 0){
-					// remote closed
-					break;
-				}
-				off += chunk;
+			if(utun_send(&conn, UTUN_TYPE_DATA, buf, (size_t)rd) < 0){
+				// remote closed
+				break;
 			}
 		}
 	}